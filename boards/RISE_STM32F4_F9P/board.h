@@ -268,6 +268,13 @@
 /* Driver pre-compile time settings.                                         */
 /*===========================================================================*/
 
+/*
+ * BMI160 bus. SCL/SDA are I2C2 on AF4, leave BOARD_BMI160_I2CD undefined to
+ * use the bit-banged driver on LINE_SCL/LINE_SDA instead.
+ */
+#define BOARD_BMI160_I2CD           I2CD2
+#define BOARD_BMI160_I2C_AF         4U
+
 /*===========================================================================*/
 /* Derived constants and error checks.                                       */
 /*===========================================================================*/
@@ -647,7 +647,11 @@
  * @details User fields added to the end of the @p thread_t structure.
  */
 #define CH_CFG_THREAD_EXTRA_FIELDS                                          \
-  /* Add threads custom fields here.*/
+  /* Profiling data, see common/prof.c */                                   \
+  uint64_t prof_cycles;                                                     \
+  uint32_t prof_switches;                                                   \
+  uint32_t prof_lat_max;                                                    \
+  uint16_t prof_lat_hist[8];
 
 /**
  * @brief   Threads initialization hook.
@@ -657,7 +661,12 @@
  *          the threads creation APIs.
  */
 #define CH_CFG_THREAD_INIT_HOOK(tp) {                                       \
-  /* Add threads initialization code here.*/                                \
+  (tp)->prof_cycles = 0;                                                    \
+  (tp)->prof_switches = 0;                                                  \
+  (tp)->prof_lat_max = 0;                                                   \
+  for (int i = 0;i < 8;i++) {                                               \
+    (tp)->prof_lat_hist[i] = 0;                                             \
+  }                                                                         \
 }
 
 /**
@@ -673,7 +682,8 @@
  * @details This hook is invoked just before switching between threads.
  */
 #define CH_CFG_CONTEXT_SWITCH_HOOK(ntp, otp) {                              \
-  /* Context switch code here.*/                                            \
+  extern void prof_context_switch(thread_t *n, thread_t *o);                \
+  prof_context_switch(ntp, otp);                                            \
 }
 
 /**
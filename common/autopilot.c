@@ -25,12 +25,13 @@
 #include "servo_pwm.h"
 #include "utils.h"
 #include "pos.h"
-#include "bldc_interface.h"
+#include "drive.h"
 #include "time_today.h"
 #include "commands.h"
 #include "terminal.h"
-#include "comm_can.h"
 #include "conf_general.h"
+#include "prof.h"
+#include "latency.h"
 
 // Defines
 #define AP_HZ						100 // Hz
@@ -50,7 +51,7 @@ static float m_rad_now;
 static ROUTE_POINT m_point_rx_prev;
 static bool m_point_rx_prev_set;
 static mutex_t m_ap_lock;
-static int32_t m_start_time;
+static int64_t m_start_time_us; // Time of day, -1 if it was not known
 static bool m_sync_rx;
 static int m_print_closest_point;
 static bool m_en_dynamic_rad;
@@ -93,7 +94,7 @@ void autopilot_init(void) {
 	memset(&m_point_rx_prev, 0, sizeof(ROUTE_POINT));
 	m_point_rx_prev_set = false;
 	chMtxObjectInit(&m_ap_lock);
-	m_start_time = 0;
+	m_start_time_us = 0;
 	m_sync_rx = false;
 	m_print_closest_point = false;
 	m_en_dynamic_rad = true;
@@ -305,7 +306,7 @@ void autopilot_set_active(bool active) {
 	chMtxLock(&m_ap_lock);
 
 	if (active && !m_is_active) {
-		m_start_time = time_today_get_ms();
+		m_start_time_us = time_today_get_us();
 //		m_sync_rx = false;
 	}
 
@@ -333,7 +334,7 @@ void autopilot_reset_state(void) {
 void reset_state(void) {
 	m_point_now = 0;
 	m_is_route_started = false;
-	m_start_time = time_today_get_ms();
+	m_start_time_us = time_today_get_us();
 	m_sync_rx = false;
 	m_route_left = 0;
 	m_route_end = false;
@@ -385,14 +386,7 @@ void autopilot_set_speed_override(bool is_override, float speed) {
  * Speed in m/s.
  */
 void autopilot_set_motor_speed(float speed) {
-	if (!main_config.car.disable_motor) { // TODO: move check to bldc_interface?
-		float rpm = speed / (main_config.car.gear_ratio
-					* (2.0 / main_config.car.motor_poles) * (1.0 / 60.0)
-					* main_config.car.wheel_diam * M_PI);
-
-		comm_can_set_vesc_id(VESC_ID);
-		bldc_interface_set_rpm((int)rpm);
-	}
+	drive_set_speed(speed);
 }
 
 /**
@@ -434,7 +428,7 @@ static THD_FUNCTION(ap_thread, arg) {
 	uint32_t attributes_now = 0;
 
 	for(;;) {
-		chThdSleep(CH_CFG_ST_FREQUENCY / AP_HZ);
+		prof_sleep(CH_CFG_ST_FREQUENCY / AP_HZ);
 
 		chMtxLock(&m_ap_lock);
 
@@ -459,8 +453,9 @@ static THD_FUNCTION(ap_thread, arg) {
 			m_route_left += AP_ROUTE_SIZE;
 		}
 
-		// Time of today according to our clock
-		int ms_today = time_today_get_ms();
+		// Time of today according to our clock, in us so that the speed in
+		// time mode does not follow the ms steps of the clock
+		int64_t us_today = time_today_get_us();
 
 		if (len >= 2) {
 			POS_STATE pos_now;
@@ -753,7 +748,7 @@ static THD_FUNCTION(ap_thread, arg) {
 				float speed = 0.0;
 
 				if (main_config.ap_mode_time && !m_sync_rx) {
-					if (ms_today >= 0) {
+					if (us_today >= 0) {
 						// Calculate speed such that the route points are reached at their
 						// specified time. Notice that the direct distance between the car
 						// and the points is used and not the arc that the car drives. This
@@ -762,21 +757,24 @@ static THD_FUNCTION(ap_thread, arg) {
 						int32_t dist_prev = (int32_t)(utils_rp_distance(&rp_now, rp_ls1) * 1000.0);
 						int32_t dist_tot = (int32_t)(utils_rp_distance(&rp_now, rp_ls1) * 1000.0);
 						dist_tot += (int32_t)(utils_rp_distance(&rp_now, rp_ls2) * 1000.0);
-						int32_t time = utils_map_int(dist_prev, 0, dist_tot, rp_ls1->time, rp_ls2->time);
+						int64_t time_us = (int64_t)rp_ls1->time * 1000;
+						if (dist_tot > 0) {
+							time_us += (int64_t)(rp_ls2->time - rp_ls1->time) * 1000 * dist_prev / dist_tot;
+						}
 						float dist_car = utils_rp_distance(&car_pos, &rp_now);
 
-						int32_t t_diff = time - ms_today;
+						int64_t t_diff_us = time_us - us_today;
 
 						if (main_config.ap_mode_time == 2) {
-							t_diff += m_start_time;
+							t_diff_us += m_start_time_us;
 						}
 
-						if (t_diff < 0) {
-							t_diff += 24 * 60 * 60 * 1000;
+						if (t_diff_us < 0) {
+							t_diff_us += (int64_t)MS_PER_DAY * 1000;
 						}
 
-						if (t_diff > 0) {
-							speed = dist_car / ((float)t_diff / 1000.0);
+						if (t_diff_us > 0) {
+							speed = dist_car / ((float)t_diff_us / 1.0e6);
 						} else {
 							speed = 0.0;
 						}
@@ -798,13 +796,22 @@ static THD_FUNCTION(ap_thread, arg) {
 
 				servo_pwm_set_ramped(0, servo_pos); // TODO generalize
 				autopilot_set_motor_speed(speed);
+
+				latency_record(LATENCY_PATH_IMU_STEERING, pos_now.imu_sample_stamp);
+
+				// Only the first steering update after a fix depends on it
+				static uint32_t gnss_stamp_last = 0;
+				if (pos_now.gnss_sample_stamp != gnss_stamp_last) {
+					latency_record(LATENCY_PATH_GNSS_STEERING, pos_now.gnss_sample_stamp);
+					gnss_stamp_last = pos_now.gnss_sample_stamp;
+				}
 			}
 		}
 
 		if (m_route_end) {
 			servo_pwm_set_ramped(0, main_config.car.steering_center); // TODO generalize
 			if (!main_config.car.disable_motor) {
-				bldc_interface_set_current_brake(10.0);
+				drive_set_current_brake(10.0);
 			}
 			m_rad_now = -1.0;
 			m_is_active = false;
@@ -897,7 +904,7 @@ static void clear_route(void) {
 	m_point_now = 0;
 	m_point_last = 0;
 	m_point_rx_prev_set = false;
-	m_start_time = time_today_get_ms();
+	m_start_time_us = time_today_get_us();
 	m_sync_rx = false;
 	memset(&m_rp_now, 0, sizeof(ROUTE_POINT));
 	memset(&m_point_rx_prev, 0, sizeof(ROUTE_POINT));
@@ -913,7 +920,7 @@ static void terminal_state(int argc, const char **argv) {
 			"m_point_now: %i\n"
 			"m_point_last: %i\n"
 			"m_point_rx_prev_set: %i\n"
-			"m_start_time: %i\n"
+			"m_start_time: %li ms\n"
 			"m_route_left: %i\n"
 			"m_route_end: %i\n",
 
@@ -922,7 +929,7 @@ static void terminal_state(int argc, const char **argv) {
 			m_point_now,
 			m_point_last,
 			m_point_rx_prev_set,
-			m_start_time,
+			(long)(m_start_time_us < 0 ? -1 : m_start_time_us / 1000),
 			m_route_left,
 			m_route_end);
 }
@@ -955,48 +962,33 @@ static void terminal_print_closest(int argc, const char **argv) {
 
 static void terminal_dynamic_rad(int argc, const char **argv) {
 	if (argc == 2) {
-		if (strcmp(argv[1], "0") == 0) {
-			m_en_dynamic_rad = 0;
-			commands_printf("OK\n");
-		} else if (strcmp(argv[1], "1") == 0) {
-			m_en_dynamic_rad = 1;
+		if (terminal_arg_bool(argv[1], &m_en_dynamic_rad)) {
 			commands_printf("OK\n");
-		} else {
-			commands_printf("Invalid argument %s\n", argv[1]);
 		}
 	} else {
-		commands_printf("Wrong number of arguments\n");
+		terminal_wrong_args();
 	}
 }
 
 static void terminal_angle_dist_comp(int argc, const char **argv) {
 	if (argc == 2) {
-		if (strcmp(argv[1], "0") == 0) {
-			m_en_angle_dist_comp = 0;
-			commands_printf("Angle distance compensation disabled\n");
-		} else if (strcmp(argv[1], "1") == 0) {
-			m_en_angle_dist_comp = 1;
-			commands_printf("Angle distance compensation enabled\n");
-		} else {
-			commands_printf("Invalid argument %s\n", argv[1]);
+		if (terminal_arg_bool(argv[1], &m_en_angle_dist_comp)) {
+			commands_printf("Angle distance compensation %s\n",
+					m_en_angle_dist_comp ? "enabled" : "disabled");
 		}
 	} else {
-		commands_printf("Wrong number of arguments\n");
+		terminal_wrong_args();
 	}
 }
 
 static void terminal_look_ahead(int argc, const char **argv) {
 	if (argc == 2) {
-		int n = -1;
-		sscanf(argv[1], "%d", &n);
-
-		if (n < 1) {
-			commands_printf("Invalid argument\n");
-		} else {
+		int n;
+		if (terminal_arg_int(argv[1], 1, AP_ROUTE_SIZE, &n)) {
 			m_route_look_ahead = n;
 			commands_printf("Now looking %d points ahead along the route", n);
 		}
 	} else {
-		commands_printf("Wrong number of arguments\n");
+		terminal_wrong_args();
 	}
 }
@@ -0,0 +1,454 @@
+/*
+	Copyright 2021 Marvin Damschen	marvin.damschen@ri.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "blackbox.h"
+#include "ch.h"
+#include "pos.h"
+#include "pos_mc.h"
+#include "autopilot.h"
+#include "terminal.h"
+#include "crc.h"
+#include "prof.h"
+#include "stm32f4xx_conf.h"
+
+#include <string.h>
+#include <stdio.h>
+
+/*
+ * The black box continuously records compact snapshots into a RAM ring
+ * from its own low priority thread, so the control loops only pay for the
+ * mutex-protected copies in pos_get and pos_mc_get. On a safety event the
+ * ring is frozen and written to flash sector 11, which is kept out of the
+ * firmware image by ld_eeprom_emu.ld.
+ *
+ * The sector is split into fixed-size slots that are consumed in order.
+ * Erasing a 128k sector stalls the CPU for more than a second, so it is
+ * only done by blackbox_clear. When all slots are used new records are
+ * dropped and the stored ones are kept until they have been read.
+ */
+
+// Settings
+#define BLACKBOX_SECTOR				FLASH_Sector_11
+#define BLACKBOX_BASE_ADDR			((uint32_t)0x080E0000)
+#define BLACKBOX_SECTOR_SIZE		((uint32_t)0x20000)
+#define BLACKBOX_SLOT_SIZE			((uint32_t)0x2000)
+#define BLACKBOX_SLOTS				(BLACKBOX_SECTOR_SIZE / BLACKBOX_SLOT_SIZE)
+#define BLACKBOX_MAGIC				0xB1AC0B0Cu
+#define BLACKBOX_WORDS_PER_YIELD	64
+
+// Private types
+typedef enum {
+	FLUSH_OK = 0,
+	FLUSH_FULL,
+	FLUSH_FAILED
+} flush_result;
+
+typedef struct {
+	uint32_t magic; // written last, marks the slot as complete
+	uint32_t sample_cnt; // written first, marks the slot as used
+	uint32_t reason;
+	uint32_t trigger_time_ms;
+	uint32_t crc;
+	uint32_t reserved[3];
+} blackbox_header;
+
+// Private variables
+__attribute__((section(".ram4"))) static BLACKBOX_SAMPLE m_samples[BLACKBOX_SAMPLES];
+static int m_sample_head;
+static int m_sample_cnt;
+static volatile bool m_frozen;
+static volatile bool m_flushed;
+static volatile BLACKBOX_REASON m_reason;
+static volatile uint32_t m_trigger_time_ms;
+static uint32_t m_valid_slots; // bitmask, CRC checked once in update_valid_slots
+
+// Threads
+static THD_WORKING_AREA(blackbox_thread_wa, 1024);
+static THD_FUNCTION(blackbox_thread, arg);
+
+// Private functions
+static const blackbox_header *slot_header(int slot);
+static bool slot_is_free(int slot);
+static bool slot_is_valid(int slot);
+static void update_valid_slots(void);
+static int record_to_slot(int record);
+static flush_result flush_to_flash(void);
+static void record_sample(void);
+static const char *reason_to_string(BLACKBOX_REASON reason);
+static void terminal_info(int argc, const char **argv);
+static void terminal_trigger(int argc, const char **argv);
+static void terminal_print(int argc, const char **argv);
+static void terminal_clear(int argc, const char **argv);
+
+_Static_assert(sizeof(BLACKBOX_SAMPLE) % 4 == 0, "BLACKBOX_SAMPLE must be word aligned");
+_Static_assert(sizeof(blackbox_header) + sizeof(m_samples) <= BLACKBOX_SLOT_SIZE, "Black-box slot too small");
+
+void blackbox_init(void) {
+	m_sample_head = 0;
+	m_sample_cnt = 0;
+	m_frozen = false;
+	m_flushed = false;
+	m_reason = BLACKBOX_REASON_NONE;
+	m_trigger_time_ms = 0;
+
+	update_valid_slots();
+
+	terminal_register_command_callback(
+			"blackbox_info",
+			"List the black-box records stored in flash, newest first.",
+			0,
+			terminal_info);
+	terminal_register_command_callback(
+			"blackbox_trigger",
+			"Freeze the black-box ring and store it to flash.",
+			0,
+			terminal_trigger);
+	terminal_register_command_callback(
+			"blackbox_print",
+			"Print the samples of a black-box record, 0 is the newest.",
+			"[record]",
+			terminal_print);
+	terminal_register_command_callback(
+			"blackbox_clear",
+			"Erase all black-box records. Stalls the CPU for about a second.",
+			0,
+			terminal_clear);
+
+	chThdCreateStatic(blackbox_thread_wa, sizeof(blackbox_thread_wa),
+			NORMALPRIO - 1, blackbox_thread, NULL);
+}
+
+/**
+ * Freeze the ring and request it to be written to flash. Cheap enough to be
+ * called from the timeout thread; repeated calls are ignored until the
+ * record has been stored and the recorder has been re-armed.
+ *
+ * @param reason
+ * The safety event that caused the trigger.
+ */
+void blackbox_trigger(BLACKBOX_REASON reason) {
+	if (m_frozen) {
+		return;
+	}
+
+	m_reason = reason;
+	m_trigger_time_ms = chTimeI2MS(chVTGetSystemTimeX());
+	m_flushed = false;
+	m_frozen = true;
+}
+
+/**
+ * Resume recording after a triggered record has been stored. Does nothing
+ * while a flush is still pending.
+ */
+void blackbox_rearm(void) {
+	if (m_frozen && m_flushed) {
+		m_sample_head = 0;
+		m_sample_cnt = 0;
+		m_frozen = false;
+	}
+}
+
+/**
+ * Get the number of complete records in flash.
+ */
+int blackbox_get_record_num(void) {
+	int num = 0;
+	for (unsigned int i = 0;i < BLACKBOX_SLOTS;i++) {
+		if (slot_is_valid(i)) {
+			num++;
+		}
+	}
+	return num;
+}
+
+/**
+ * Get information about a stored record.
+ *
+ * @param record
+ * Record index, where 0 is the newest record.
+ *
+ * @return
+ * true if the record exists.
+ */
+bool blackbox_get_record_info(int record, BLACKBOX_REASON *reason, uint32_t *trigger_time_ms, int *sample_cnt) {
+	int slot = record_to_slot(record);
+	if (slot < 0) {
+		return false;
+	}
+
+	const blackbox_header *h = slot_header(slot);
+	*reason = h->reason;
+	*trigger_time_ms = h->trigger_time_ms;
+	*sample_cnt = h->sample_cnt;
+	return true;
+}
+
+/**
+ * Read one sample of a stored record. Samples are ordered oldest first.
+ *
+ * @return
+ * true if the record and sample exist.
+ */
+bool blackbox_get_sample(int record, int sample, BLACKBOX_SAMPLE *s) {
+	int slot = record_to_slot(record);
+	if (slot < 0) {
+		return false;
+	}
+
+	const blackbox_header *h = slot_header(slot);
+	if (sample < 0 || (uint32_t)sample >= h->sample_cnt) {
+		return false;
+	}
+
+	const BLACKBOX_SAMPLE *samples = (const BLACKBOX_SAMPLE*)(h + 1);
+	*s = samples[sample];
+	return true;
+}
+
+static THD_FUNCTION(blackbox_thread, arg) {
+	(void)arg;
+
+	chRegSetThreadName("Blackbox");
+
+	systime_t iteration_timer = chVTGetSystemTimeX();
+
+	for(;;) {
+		if (!m_frozen) {
+			record_sample();
+		} else if (!m_flushed) {
+			switch (flush_to_flash()) {
+			case FLUSH_FULL:
+				terminal_printf("Black box: all slots used, record dropped (run blackbox_clear)\n");
+				break;
+			case FLUSH_FAILED:
+				terminal_printf("Black box: flash programming failed, record lost\n");
+				break;
+			default:
+				break;
+			}
+			update_valid_slots();
+			m_flushed = true;
+		}
+
+		iteration_timer = prof_sleep_until_windowed(iteration_timer,
+				iteration_timer + TIME_MS2I(1000 / BLACKBOX_RATE_HZ));
+	}
+}
+
+static void record_sample(void) {
+	static POS_STATE pos;
+	static mc_values val;
+
+	pos_get(&pos);
+	pos_mc_get(&val);
+
+	BLACKBOX_SAMPLE *s = &m_samples[m_sample_head];
+	s->time_ms = chTimeI2MS(chVTGetSystemTimeX());
+	s->px = pos.px;
+	s->py = pos.py;
+	s->yaw = pos.yaw;
+	s->speed = pos.speed;
+	s->rpm = val.rpm;
+	s->current = val.current_motor;
+	s->tachometer = val.tachometer;
+	s->ap_point = autopilot_get_point_now();
+	s->ap_active = autopilot_is_active();
+	s->fault_code = val.fault_code;
+
+	m_sample_head = (m_sample_head + 1) % BLACKBOX_SAMPLES;
+	if (m_sample_cnt < BLACKBOX_SAMPLES) {
+		m_sample_cnt++;
+	}
+}
+
+static flush_result flush_to_flash(void) {
+	int slot = -1;
+	for (int i = BLACKBOX_SLOTS - 1;i >= 0;i--) {
+		if (!slot_is_free(i)) {
+			break;
+		}
+		slot = i;
+	}
+
+	if (slot < 0) {
+		return FLUSH_FULL;
+	}
+
+	uint32_t addr = BLACKBOX_BASE_ADDR + slot * BLACKBOX_SLOT_SIZE;
+	const blackbox_header *h = slot_header(slot);
+
+	FLASH_ClearFlag(FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR |
+			FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
+
+	FLASH_ProgramWord((uint32_t)&h->sample_cnt, m_sample_cnt);
+	FLASH_ProgramWord((uint32_t)&h->reason, m_reason);
+	FLASH_ProgramWord((uint32_t)&h->trigger_time_ms, m_trigger_time_ms);
+
+	// Oldest sample first. Yield now and then, every word stalls flash reads.
+	int start = m_sample_cnt < BLACKBOX_SAMPLES ? 0 : m_sample_head;
+	uint32_t dst = addr + sizeof(blackbox_header);
+	int words = 0;
+	for (int i = 0;i < m_sample_cnt;i++) {
+		const uint32_t *src = (const uint32_t*)&m_samples[(start + i) % BLACKBOX_SAMPLES];
+		for (unsigned int j = 0;j < sizeof(BLACKBOX_SAMPLE) / 4;j++) {
+			if (FLASH_ProgramWord(dst, src[j]) != FLASH_COMPLETE) {
+				return FLUSH_FAILED;
+			}
+			dst += 4;
+
+			if (++words % BLACKBOX_WORDS_PER_YIELD == 0) {
+				chThdSleepMilliseconds(1);
+			}
+		}
+	}
+
+	unsigned short crc = crc16((unsigned char*)(h + 1), m_sample_cnt * sizeof(BLACKBOX_SAMPLE));
+	FLASH_ProgramWord((uint32_t)&h->crc, crc);
+	if (FLASH_ProgramWord((uint32_t)&h->magic, BLACKBOX_MAGIC) != FLASH_COMPLETE) {
+		return FLUSH_FAILED;
+	}
+
+	return FLUSH_OK;
+}
+
+static const blackbox_header *slot_header(int slot) {
+	return (const blackbox_header*)(BLACKBOX_BASE_ADDR + slot * BLACKBOX_SLOT_SIZE);
+}
+
+static bool slot_is_free(int slot) {
+	const blackbox_header *h = slot_header(slot);
+	return h->magic == 0xFFFFFFFF && h->sample_cnt == 0xFFFFFFFF;
+}
+
+static bool slot_is_valid(int slot) {
+	return m_valid_slots & (1 << slot);
+}
+
+static void update_valid_slots(void) {
+	uint32_t valid = 0;
+
+	for (unsigned int i = 0;i < BLACKBOX_SLOTS;i++) {
+		const blackbox_header *h = slot_header(i);
+		if (h->magic == BLACKBOX_MAGIC && h->sample_cnt <= BLACKBOX_SAMPLES &&
+				h->crc == crc16((unsigned char*)(h + 1), h->sample_cnt * sizeof(BLACKBOX_SAMPLE))) {
+			valid |= 1 << i;
+		}
+	}
+
+	m_valid_slots = valid;
+}
+
+static int record_to_slot(int record) {
+	// Slots are used in order, so the newest record is in the last valid slot
+	for (int i = BLACKBOX_SLOTS - 1;i >= 0;i--) {
+		if (slot_is_valid(i)) {
+			if (record == 0) {
+				return i;
+			}
+			record--;
+		}
+	}
+	return -1;
+}
+
+static const char *reason_to_string(BLACKBOX_REASON reason) {
+	switch (reason) {
+	case BLACKBOX_REASON_TIMEOUT: return "Timeout";
+	case BLACKBOX_REASON_EMERGENCY_STOP: return "Emergency stop";
+	case BLACKBOX_REASON_MANUAL: return "Manual";
+	default: return "Unknown";
+	}
+}
+
+static void terminal_info(int argc, const char **argv) {
+	(void)argc;
+	(void)argv;
+
+	int num = blackbox_get_record_num();
+	terminal_printf("%d of %d black-box records used, recorder %s\n", num, BLACKBOX_SLOTS,
+			m_frozen ? (m_flushed ? "stopped" : "flushing") : "running");
+
+	for (int i = 0;i < num;i++) {
+		BLACKBOX_REASON reason;
+		uint32_t time_ms;
+		int cnt;
+		if (blackbox_get_record_info(i, &reason, &time_ms, &cnt)) {
+			terminal_printf("%d: %s at %u ms, %d samples\n", i, reason_to_string(reason), time_ms, cnt);
+		}
+	}
+}
+
+static void terminal_trigger(int argc, const char **argv) {
+	(void)argc;
+	(void)argv;
+
+	if (m_frozen) {
+		terminal_printf("Black box already triggered\n");
+	} else {
+		blackbox_trigger(BLACKBOX_REASON_MANUAL);
+		terminal_printf("OK\n");
+	}
+}
+
+static void terminal_print(int argc, const char **argv) {
+	if (argc == 2) {
+		int record = -1;
+		sscanf(argv[1], "%d", &record);
+
+		BLACKBOX_REASON reason;
+		uint32_t time_ms;
+		int cnt;
+		if (!blackbox_get_record_info(record, &reason, &time_ms, &cnt)) {
+			terminal_printf("Invalid record %s\n", argv[1]);
+			return;
+		}
+
+		terminal_printf("%s at %u ms\n", reason_to_string(reason), time_ms);
+		terminal_printf("time (ms),x,y,yaw,speed,rpm,current,tacho,ap point,ap active,fault\n");
+
+		for (int i = 0;i < cnt;i++) {
+			BLACKBOX_SAMPLE s;
+			blackbox_get_sample(record, i, &s);
+			terminal_printf("%u,%.3f,%.3f,%.2f,%.2f,%.0f,%.2f,%d,%d,%d,%d\n",
+					s.time_ms, (double)s.px, (double)s.py, (double)s.yaw, (double)s.speed,
+					(double)s.rpm, (double)s.current, s.tachometer, s.ap_point,
+					s.ap_active, s.fault_code);
+		}
+	} else {
+		terminal_printf("Wrong number of arguments\n");
+	}
+}
+
+static void terminal_clear(int argc, const char **argv) {
+	(void)argc;
+	(void)argv;
+
+	if (autopilot_is_active() || (m_frozen && !m_flushed)) {
+		terminal_printf("Black box busy, not clearing\n");
+		return;
+	}
+
+	FLASH_ClearFlag(FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR |
+			FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
+	if (FLASH_EraseSector(BLACKBOX_SECTOR, VoltageRange_3) == FLASH_COMPLETE) {
+		terminal_printf("OK\n");
+	} else {
+		terminal_printf("Erase failed\n");
+	}
+	update_valid_slots();
+}
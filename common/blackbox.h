@@ -0,0 +1,35 @@
+/*
+	Copyright 2021 Marvin Damschen	marvin.damschen@ri.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BLACKBOX_H_
+#define BLACKBOX_H_
+
+#include "datatypes.h"
+
+// Settings
+#define BLACKBOX_RATE_HZ			20
+#define BLACKBOX_SAMPLES			200 // 10 s at 20 Hz
+
+// Functions
+void blackbox_init(void);
+void blackbox_trigger(BLACKBOX_REASON reason);
+void blackbox_rearm(void);
+int blackbox_get_record_num(void);
+bool blackbox_get_record_info(int record, BLACKBOX_REASON *reason, uint32_t *trigger_time_ms, int *sample_cnt);
+bool blackbox_get_sample(int record, int sample, BLACKBOX_SAMPLE *s);
+
+#endif /* BLACKBOX_H_ */
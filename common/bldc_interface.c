@@ -28,6 +28,7 @@
 
 #include "bldc_interface.h"
 #include "buffer.h"
+#include "timebase.h"
 #include <string.h>
 
 // Private variables
@@ -139,6 +140,7 @@ void bldc_interface_process_packet(unsigned char *data, unsigned int len) {
 
 	case COMM_GET_VALUES:
 		ind = 0;
+		values.rx_time_us = timebase_get_us();
 		values.temp_mos = buffer_get_float16(data, 1e1, &ind);
 		values.temp_motor = buffer_get_float16(data, 1e1, &ind);
 		values.current_motor = buffer_get_float32(data, 1e2, &ind);
@@ -496,6 +498,10 @@ void bldc_interface_reset_safety_stop(void) {
 	m_safety_stop = false;
 }
 
+bool bldc_interface_get_safety_stop(void) {
+	return m_safety_stop;
+}
+
 void bldc_interface_detect_motor_param(float current, float min_rpm, float low_duty) {
 	int32_t send_index = 0;
 	send_buffer[send_index++] = COMM_DETECT_MOTOR_PARAM;
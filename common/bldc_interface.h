@@ -67,6 +67,7 @@ void bldc_interface_get_decoded_chuk(void);
 // Other functions
 void bldc_interface_safety_stop(void);
 void bldc_interface_reset_safety_stop(void);
+bool bldc_interface_get_safety_stop(void);
 void bldc_interface_detect_motor_param(float current, float min_rpm, float low_duty);
 void bldc_interface_reboot(void);
 void bldc_interface_send_alive(void);
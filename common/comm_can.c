@@ -29,6 +29,7 @@
 #include "bldc_interface.h"
 #include "commands.h"
 #include "terminal.h"
+#include "timebase.h"
 #include <stdio.h>
 
 // Settings
@@ -36,20 +37,100 @@
 #define RX_FRAMES_SIZE				100
 #define RX_BUFFER_SIZE				PACKET_MAX_PL_LEN
 #define CAN_STATUS_MSGS_TO_STORE	10
+#define CAN_FILTER_NUM				6
+#define CAN2_FILTER_START			14
+#define RX_SLOTS					4
+#define RX_SLOT_TIMEOUT_MS			500
+#define RX_FILL_TIMEOUT_MS			50 // A reassembly without frames for this long is abandoned
+#define RX_REPLY_ID_BASE			128
+#define RX_REPLY_ID_END				ID_CAR_CLIENT // ID_CAR_CLIENT and ID_ALL are not reply IDs
+#define RX_MAIN_ID_MAX				((RX_REPLY_ID_END - RX_REPLY_ID_BASE) / RX_SLOTS - 1)
+#define TX_QUEUE_LEN				32
+#define TX_QUEUE_HIGH_LEN			8
+#define TX_WAIT_TIMEOUT_MS			20 // Longest wait for queue room, setpoints never wait
+
+// Private types
+
+/*
+ * Reassembly state for one VESC. Buffer packets are addressed to the reply
+ * ID we put in the request, not tagged with the sender, so every slot uses
+ * its own reply ID. Long responses from several controllers can then
+ * arrive interleaved. Each board gets the range
+ * RX_REPLY_ID_BASE + main_id * RX_SLOTS + slot, so boards on the same bus
+ * do not overlap. Boards with a main_id above RX_MAIN_ID_MAX fall back to
+ * one slot with the reply ID main_id + 128 of older firmware.
+ */
+typedef struct {
+	int controller_id; // -1 when unused
+	systime_t last_used;
+	bool filling; // Buffer frames received, the process frame has not come yet
+	systime_t last_fill;
+	uint8_t buffer[RX_BUFFER_SIZE];
+	uint32_t packets;
+	uint32_t bytes;
+	uint32_t crc_errors;
+	uint32_t bound_errors;
+} rx_slot;
+
+typedef struct {
+	CANTxFrame frames[TX_QUEUE_LEN];
+	int size;
+	int read;
+	int num;
+} tx_queue;
+
+typedef enum {
+	TX_PRIO_NORMAL = 0,
+	TX_PRIO_HIGH,
+	TX_PRIO_NUM
+} TX_PRIO;
 
 // Threads
 static THD_WORKING_AREA(cancom_read_thread_wa, 512);
 static THD_WORKING_AREA(cancom_process_thread_wa, 4096);
+static THD_WORKING_AREA(cancom_tx_thread_wa, 256);
 static THD_FUNCTION(cancom_read_thread, arg);
 static THD_FUNCTION(cancom_process_thread, arg);
+static THD_FUNCTION(cancom_tx_thread, arg);
 
 // Variables
 static can_status_msg stat_msgs[CAN_STATUS_MSGS_TO_STORE];
-static mutex_t can_mtx;
+static uint8_t stat_index[256]; // Slot in stat_msgs + 1 per controller ID, 0 for none
+static int stat_num;
+static uint32_t rx_frames_cnt;
+static uint32_t rx_frames_ignored;
+
+/*
+ * Frames go straight into a free hardware mailbox when the queues are
+ * empty, otherwise into a queue that the TX thread drains on the TX empty
+ * event. Stops and brakes use the high priority queue. A setpoint replaces
+ * an unsent setpoint of the same kind to the same VESC instead of queueing
+ * behind it. Since stops overtake the normal queue, queueing one drops the
+ * unsent setpoints to that VESC, or to all VESCs for ID_ALL, so that they
+ * cannot undo the stop.
+ *
+ * Setpoints never block, a newer one follows soon, so they are dropped
+ * when the queue is full. Other frames are usually part of a multi-frame
+ * buffer packet, where a lost frame corrupts the whole packet, so they wait
+ * up to TX_WAIT_TIMEOUT_MS for room in tx_waiters.
+ */
+static tx_queue tx_queues[TX_PRIO_NUM];
+static uint32_t tx_sent;
+static uint32_t tx_accepted;
+static uint32_t tx_coalesced;
+static uint32_t tx_purged;
+static uint32_t tx_dropped;
+static uint32_t tx_waits;
+static threads_queue_t tx_waiters;
+static uint32_t tx_mailbox_full;
+static int tx_depth_max;
 static mutex_t vesc_mtx_ext;
-static uint8_t rx_buffer[RX_BUFFER_SIZE];
-static unsigned int rx_buffer_last_id;
+static rx_slot rx_slots[RX_SLOTS];
+static mutex_t rx_slot_mtx;
+static uint32_t rx_slot_full;
 static CANRxFrame rx_frames[RX_FRAMES_SIZE];
+static uint64_t rx_frame_time[RX_FRAMES_SIZE];
+static void(*status_func)(can_status_msg *stat) = 0;
 static int rx_frame_read;
 static int rx_frame_write;
 static thread_t *process_tp;
@@ -66,23 +147,83 @@ static const CANConfig cancfg = {
 		CAN_BTR_TS1(8) | CAN_BTR_BRP(6)
 };
 
+/*
+ * Acceptance filters, 32-bit mask mode into FIFO 0. The VESC extended ID is
+ * (packet << 8) | controller ID. Buffer packets are addressed to us, the
+ * target ID follows main_id, which can change at runtime, so it is checked
+ * in software. Status broadcasts carry the sender ID and are only accepted
+ * from VESC_ID, or from any controller when it is ID_ALL. Standard IDs and
+ * all other VESC packets are dropped by the hardware.
+ */
+#define FILTER_EID(eid)			(((uint32_t)(eid) << 3) | (1U << 2))
+#define FILTER_MASK(mask)		(((uint32_t)(mask) << 3) | (1U << 2) | (1U << 1))
+#define FILTER_PACKET(n, pkt, id, id_mask) \
+	{n, 0, 1, 0, FILTER_EID(((uint32_t)(pkt) << 8) | (id)), FILTER_MASK(0x1FFFFF00 | (id_mask))}
+
+static const CANFilter canfilters[CAN_FILTER_NUM] = {
+		FILTER_PACKET(0, CAN_PACKET_FILL_RX_BUFFER, 0, 0),
+		FILTER_PACKET(1, CAN_PACKET_FILL_RX_BUFFER_LONG, 0, 0),
+		FILTER_PACKET(2, CAN_PACKET_PROCESS_RX_BUFFER, 0, 0),
+		FILTER_PACKET(3, CAN_PACKET_PROCESS_SHORT_BUFFER, 0, 0),
+#if VESC_ID == ID_ALL
+		FILTER_PACKET(4, CAN_PACKET_STATUS, 0, 0),
+		FILTER_PACKET(5, CAN_PACKET_STATUS_5, 0, 0)
+#else
+		FILTER_PACKET(4, CAN_PACKET_STATUS, VESC_ID, 0xFF),
+		FILTER_PACKET(5, CAN_PACKET_STATUS_5, VESC_ID, 0xFF)
+#endif
+};
+
 // Private functions
 static void send_packet_wrapper(unsigned char *data, unsigned int len);
 static void printf_wrapper(char *str);
 static void cmd_terminal_forward_vesc(int argc, const char **argv);
+static void cmd_terminal_can_status(int argc, const char **argv);
+static void store_status(uint8_t id, CAN_PACKET_ID cmd, CANRxFrame *rxmsg, uint64_t time_us);
+static bool transmit(CANTxFrame *txmsg);
+static void tx_purge_setpoints_locked(uint8_t controller_id);
+static void tx_drain_locked(void);
+static int rx_slot_num(void);
+static bool rx_slot_busy(int slot, systime_t now);
+static int rx_slot_get(uint8_t controller_id);
+static uint8_t rx_slot_reply_id(int slot);
+static int rx_slot_from_reply_id(uint8_t id);
+static bool comm_expects_reply(const uint8_t *data, unsigned int len);
 
 void comm_can_init(void) {
 	for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
 		stat_msgs[i].id = -1;
 	}
+	memset(stat_index, 0, sizeof(stat_index));
+	memset(rx_slots, 0, sizeof(rx_slots));
+	for (int i = 0;i < RX_SLOTS;i++) {
+		rx_slots[i].controller_id = -1;
+	}
+	rx_slot_full = 0;
+	stat_num = 0;
+	rx_frames_cnt = 0;
+	rx_frames_ignored = 0;
 
 	rx_frame_read = 0;
 	rx_frame_write = 0;
 	vesc_id = VESC_ID;
 
-	chMtxObjectInit(&can_mtx);
+	memset(tx_queues, 0, sizeof(tx_queues));
+	tx_queues[TX_PRIO_NORMAL].size = TX_QUEUE_LEN;
+	tx_queues[TX_PRIO_HIGH].size = TX_QUEUE_HIGH_LEN;
+	tx_sent = 0;
+	tx_accepted = 0;
+	tx_coalesced = 0;
+	tx_purged = 0;
+	tx_dropped = 0;
+	tx_waits = 0;
+	chThdQueueObjectInit(&tx_waiters);
+	tx_mailbox_full = 0;
+	tx_depth_max = 0;
 	chMtxObjectInit(&vesc_mtx_ext);
+	chMtxObjectInit(&rx_slot_mtx);
 
+	canSTM32SetFilters(&CANDx, CAN2_FILTER_START, CAN_FILTER_NUM, canfilters);
 	canStart(&CANDx, &cancfg);
 
 	bldc_interface_init(send_packet_wrapper);
@@ -94,10 +235,18 @@ void comm_can_init(void) {
 			"[cmd]",
 			cmd_terminal_forward_vesc);
 
+	terminal_register_command_callback(
+			"can_status",
+			"Print the last status received from each VESC and the CAN receive counters.",
+			0,
+			cmd_terminal_can_status);
+
 	chThdCreateStatic(cancom_read_thread_wa, sizeof(cancom_read_thread_wa), NORMALPRIO + 1,
 			cancom_read_thread, NULL);
 	chThdCreateStatic(cancom_process_thread_wa, sizeof(cancom_process_thread_wa), NORMALPRIO,
 			cancom_process_thread, NULL);
+	chThdCreateStatic(cancom_tx_thread_wa, sizeof(cancom_tx_thread_wa), NORMALPRIO + 2,
+			cancom_tx_thread, NULL);
 }
 
 void comm_can_set_vesc_id(int id) {
@@ -111,6 +260,43 @@ void comm_can_set_vesc_id(int id) {
 //	}
 }
 
+/**
+ * Get the last status broadcast of a VESC.
+ *
+ * @param id
+ * The controller ID of the VESC.
+ *
+ * @param msg
+ * Pointer to store the status in.
+ *
+ * @return
+ * true if a status has been received from the VESC, false otherwise.
+ */
+bool comm_can_get_status(uint8_t id, can_status_msg *msg) {
+	bool res = false;
+
+	chSysLock();
+	if (stat_index[id]) {
+		*msg = stat_msgs[stat_index[id] - 1];
+		res = true;
+	}
+	chSysUnlock();
+
+	return res;
+}
+
+/**
+ * Set a function to be called from the CAN thread each time a VESC has
+ * broadcast its tachometer (CAN_PACKET_STATUS_5). The status passed to it
+ * also holds the latest rpm, current and duty cycle of that VESC.
+ *
+ * @param func
+ * The function, or 0 to disable.
+ */
+void comm_can_set_status_func(void(*func)(can_status_msg *stat)) {
+	status_func = func;
+}
+
 void comm_can_lock_vesc(void) {
 	chMtxLock(&vesc_mtx_ext);
 }
@@ -136,6 +322,7 @@ static THD_FUNCTION(cancom_read_thread, arg) {
 		msg_t result = canReceive(&CANDx, CAN_ANY_MAILBOX, &rxmsg, TIME_IMMEDIATE);
 
 		while (result == MSG_OK) {
+			rx_frame_time[rx_frame_write] = timebase_get_us();
 			rx_frames[rx_frame_write++] = rxmsg;
 			if (rx_frame_write == RX_FRAMES_SIZE) {
 				rx_frame_write = 0;
@@ -161,78 +348,105 @@ static THD_FUNCTION(cancom_process_thread, arg) {
 	unsigned int rxbuf_ind;
 	uint8_t crc_low;
 	uint8_t crc_high;
-	bool commands_send;
 
 	for(;;) {
 		chEvtWaitAny((eventmask_t) 1);
 
 		while (rx_frame_read != rx_frame_write) {
+			uint64_t rx_time_us = rx_frame_time[rx_frame_read];
 			CANRxFrame rxmsg = rx_frames[rx_frame_read++];
+			if (rx_frame_read == RX_FRAMES_SIZE) {
+				rx_frame_read = 0;
+			}
+			rx_frames_cnt++;
 
 			if (rxmsg.IDE == CAN_IDE_EXT) {
 				// Process extended IDs (VESC Communication)
 
 				uint8_t id = rxmsg.EID & 0xFF;
 				CAN_PACKET_ID cmd = rxmsg.EID >> 8;
-				can_status_msg *stat_tmp;
+
+				// Buffer packets for another node on the bus
+				int slot = rx_slot_from_reply_id(id);
+				bool is_status = cmd == CAN_PACKET_STATUS || cmd == CAN_PACKET_STATUS_5;
+				if (!is_status && slot < 0) {
+					rx_frames_ignored++;
+					continue;
+				}
+
+				rx_slot *s = &rx_slots[slot >= 0 ? slot : 0];
+
+				if (cmd == CAN_PACKET_FILL_RX_BUFFER || cmd == CAN_PACKET_FILL_RX_BUFFER_LONG) {
+					s->last_fill = chVTGetSystemTimeX();
+					s->filling = true;
+				} else if (cmd == CAN_PACKET_PROCESS_RX_BUFFER) {
+					s->filling = false;
+				}
 
 				switch (cmd) {
 				case CAN_PACKET_FILL_RX_BUFFER:
-					memcpy(rx_buffer + rxmsg.data8[0], rxmsg.data8 + 1, rxmsg.DLC - 1);
+					if (rxmsg.DLC < 1 || rxmsg.data8[0] + rxmsg.DLC - 1 > RX_BUFFER_SIZE) {
+						s->bound_errors++;
+						break;
+					}
+					memcpy(s->buffer + rxmsg.data8[0], rxmsg.data8 + 1, rxmsg.DLC - 1);
 					break;
 
 				case CAN_PACKET_FILL_RX_BUFFER_LONG:
 					rxbuf_ind = (unsigned int)rxmsg.data8[0] << 8;
 					rxbuf_ind |= rxmsg.data8[1];
-					if (rxbuf_ind < RX_BUFFER_SIZE) {
-						memcpy(rx_buffer + rxbuf_ind, rxmsg.data8 + 2, rxmsg.DLC - 2);
+					if (rxmsg.DLC < 2 || rxbuf_ind + rxmsg.DLC - 2 > RX_BUFFER_SIZE) {
+						s->bound_errors++;
+						break;
 					}
+					memcpy(s->buffer + rxbuf_ind, rxmsg.data8 + 2, rxmsg.DLC - 2);
 					break;
 
 				case CAN_PACKET_PROCESS_RX_BUFFER:
-					ind = 0;
-					rx_buffer_last_id = rxmsg.data8[ind++];
-					commands_send = rxmsg.data8[ind++];
+					if (rxmsg.DLC < 6) {
+						s->bound_errors++;
+						break;
+					}
+
+					ind = 2; // Sender ID and send flag
 					rxbuf_len = (unsigned int)rxmsg.data8[ind++] << 8;
 					rxbuf_len |= (unsigned int)rxmsg.data8[ind++];
 
 					if (rxbuf_len > RX_BUFFER_SIZE) {
+						s->bound_errors++;
 						break;
 					}
 
 					crc_high = rxmsg.data8[ind++];
 					crc_low = rxmsg.data8[ind++];
 
-					if (crc16(rx_buffer, rxbuf_len)
+					if (crc16(s->buffer, rxbuf_len)
 							== ((unsigned short) crc_high << 8
 									| (unsigned short) crc_low)) {
-
-						(void)commands_send;
-						bldc_interface_process_packet(rx_buffer, rxbuf_len);
+						s->packets++;
+						s->bytes += rxbuf_len;
+						s->last_used = chVTGetSystemTimeX();
+						bldc_interface_process_packet(s->buffer, rxbuf_len);
+					} else {
+						s->crc_errors++;
 					}
 					break;
 
 				case CAN_PACKET_PROCESS_SHORT_BUFFER:
-					ind = 0;
-					rx_buffer_last_id = rxmsg.data8[ind++];
-					commands_send = rxmsg.data8[ind++];
-					(void)commands_send;
-					bldc_interface_process_packet(rxmsg.data8 + ind, rxmsg.DLC - ind);
+					if (rxmsg.DLC < 2) {
+						s->bound_errors++;
+						break;
+					}
+
+					s->packets++;
+					s->bytes += rxmsg.DLC - 2;
+					s->last_used = chVTGetSystemTimeX();
+					bldc_interface_process_packet(rxmsg.data8 + 2, rxmsg.DLC - 2);
 					break;
 
 				case CAN_PACKET_STATUS:
-					for (int i = 0;i < CAN_STATUS_MSGS_TO_STORE;i++) {
-						stat_tmp = &stat_msgs[i];
-						if (stat_tmp->id == id || stat_tmp->id == -1) {
-							ind = 0;
-							stat_tmp->id = id;
-							stat_tmp->rx_time = chVTGetSystemTimeX();
-							stat_tmp->rpm = (float)buffer_get_int32(rxmsg.data8, &ind);
-							stat_tmp->current = (float)buffer_get_int16(rxmsg.data8, &ind) / 10.0;
-							stat_tmp->duty = (float)buffer_get_int16(rxmsg.data8, &ind) / 1000.0;
-							break;
-						}
-					}
+				case CAN_PACKET_STATUS_5:
+					store_status(id, cmd, &rxmsg, rx_time_us);
 					break;
 
 				default:
@@ -242,15 +456,17 @@ static THD_FUNCTION(cancom_process_thread, arg) {
 				// Process standard IDs
 				// TODO: readd io_board and possibly dw board
 			}
-
-			if (rx_frame_read == RX_FRAMES_SIZE) {
-				rx_frame_read = 0;
-			}
 		}
 	}
 }
 
-void comm_can_transmit_eid(uint32_t id, uint8_t *data, uint8_t len) {
+/**
+ * Send a CAN frame with an extended ID.
+ *
+ * @return
+ * false if the frame was dropped because the TX queue stayed full.
+ */
+bool comm_can_transmit_eid(uint32_t id, uint8_t *data, uint8_t len) {
 	CANTxFrame txmsg;
 	txmsg.IDE = CAN_IDE_EXT;
 	txmsg.EID = id;
@@ -258,12 +474,16 @@ void comm_can_transmit_eid(uint32_t id, uint8_t *data, uint8_t len) {
 	txmsg.DLC = len;
 	memcpy(txmsg.data8, data, len);
 
-	chMtxLock(&can_mtx);
-	canTransmit(&CANDx, CAN_ANY_MAILBOX, &txmsg, TIME_MS2I(20));
-	chMtxUnlock(&can_mtx);
+	return transmit(&txmsg);
 }
 
-void comm_can_transmit_sid(uint32_t id, uint8_t *data, uint8_t len) {
+/**
+ * Send a CAN frame with a standard ID.
+ *
+ * @return
+ * false if the frame was dropped because the TX queue stayed full.
+ */
+bool comm_can_transmit_sid(uint32_t id, uint8_t *data, uint8_t len) {
 	CANTxFrame txmsg;
 	txmsg.IDE = CAN_IDE_STD;
 	txmsg.SID = id;
@@ -271,9 +491,7 @@ void comm_can_transmit_sid(uint32_t id, uint8_t *data, uint8_t len) {
 	txmsg.DLC = len;
 	memcpy(txmsg.data8, data, len);
 
-	chMtxLock(&can_mtx);
-	canTransmit(&CANDx, CAN_ANY_MAILBOX, &txmsg, TIME_MS2I(20));
-	chMtxUnlock(&can_mtx);
+	return transmit(&txmsg);
 }
 
 /**
@@ -293,13 +511,34 @@ void comm_can_transmit_sid(uint32_t id, uint8_t *data, uint8_t len) {
  * @param send
  * If true, this packet will be passed to the send function of commands.
  * Otherwise, it will be passed to the process function (DON'T CARE HERE, only for VESC).
+ *
+ * When a frame of a long buffer cannot be queued the rest is not sent, the
+ * VESC drops the incomplete buffer. Requests that expect a response are
+ * dropped when all reply slots are busy.
  */
 void comm_can_send_buffer(uint8_t controller_id, uint8_t *data, unsigned int len, bool send) {
 	uint8_t send_buffer[8];
 
+	/*
+	 * Packets without a response need no reassembly slot, they carry the
+	 * reply ID of slot 0 so that setpoints and stops never wait for one.
+	 * A request is dropped when all slots are busy, the caller sees it as
+	 * a lost response.
+	 */
+	int slot = 0;
+	if (comm_expects_reply(data, len)) {
+		slot = rx_slot_get(controller_id);
+		if (slot < 0) {
+			rx_slot_full++;
+			return;
+		}
+	}
+
+	uint8_t reply_id = rx_slot_reply_id(slot);
+
 	if (len <= 6) {
 		uint32_t ind = 0;
-		send_buffer[ind++] = main_id + 128;
+		send_buffer[ind++] = reply_id;
 		send_buffer[ind++] = send;
 		memcpy(send_buffer + ind, data, len);
 		ind += len;
@@ -323,7 +562,9 @@ void comm_can_send_buffer(uint8_t controller_id, uint8_t *data, unsigned int len
 				memcpy(send_buffer + 1, data + i, send_len);
 			}
 
-			comm_can_transmit_eid(controller_id | ((uint32_t)CAN_PACKET_FILL_RX_BUFFER << 8), send_buffer, send_len + 1);
+			if (!comm_can_transmit_eid(controller_id | ((uint32_t)CAN_PACKET_FILL_RX_BUFFER << 8), send_buffer, send_len + 1)) {
+				return;
+			}
 		}
 
 		for (unsigned int i = end_a;i < len;i += 6) {
@@ -338,11 +579,13 @@ void comm_can_send_buffer(uint8_t controller_id, uint8_t *data, unsigned int len
 				memcpy(send_buffer + 2, data + i, send_len);
 			}
 
-			comm_can_transmit_eid(controller_id | ((uint32_t)CAN_PACKET_FILL_RX_BUFFER_LONG << 8), send_buffer, send_len + 2);
+			if (!comm_can_transmit_eid(controller_id | ((uint32_t)CAN_PACKET_FILL_RX_BUFFER_LONG << 8), send_buffer, send_len + 2)) {
+				return;
+			}
 		}
 
 		uint32_t ind = 0;
-		send_buffer[ind++] = main_id + 128;
+		send_buffer[ind++] = reply_id;
 		send_buffer[ind++] = send;
 		send_buffer[ind++] = len >> 8;
 		send_buffer[ind++] = len & 0xFF;
@@ -354,6 +597,327 @@ void comm_can_send_buffer(uint8_t controller_id, uint8_t *data, unsigned int len
 	}
 }
 
+static THD_FUNCTION(cancom_tx_thread, arg) {
+	(void)arg;
+	chRegSetThreadName("CAN TX");
+
+	event_listener_t el;
+	chEvtRegister(&CANDx.txempty_event, &el, 0);
+
+	for(;;) {
+		chEvtWaitAnyTimeout(ALL_EVENTS, TIME_MS2I(10));
+
+		chSysLock();
+		tx_drain_locked();
+		chSchRescheduleS();
+		chSysUnlock();
+	}
+}
+
+/*
+ * Classify a frame. Only single frame buffer packets to a VESC are looked
+ * at: data8[2] is the COMM_PACKET_ID.
+ */
+static TX_PRIO tx_prio(const CANTxFrame *f, bool *is_setpoint) {
+	*is_setpoint = false;
+
+	if (f->IDE != CAN_IDE_EXT || (f->EID >> 8) != CAN_PACKET_PROCESS_SHORT_BUFFER || f->DLC < 3) {
+		return TX_PRIO_NORMAL;
+	}
+
+	switch (f->data8[2]) {
+	case COMM_SET_CURRENT_BRAKE:
+	case COMM_SET_HANDBRAKE:
+		*is_setpoint = true;
+		return TX_PRIO_HIGH;
+
+	case COMM_SET_CURRENT:
+		*is_setpoint = true;
+		// Zero current is the safety stop
+		if (f->DLC >= 7 && f->data8[3] == 0 && f->data8[4] == 0 &&
+				f->data8[5] == 0 && f->data8[6] == 0) {
+			return TX_PRIO_HIGH;
+		}
+		return TX_PRIO_NORMAL;
+
+	case COMM_SET_DUTY:
+	case COMM_SET_RPM:
+	case COMM_SET_POS:
+	case COMM_SET_SERVO_POS:
+		*is_setpoint = true;
+		return TX_PRIO_NORMAL;
+
+	default:
+		return TX_PRIO_NORMAL;
+	}
+}
+
+static bool transmit(CANTxFrame *txmsg) {
+	bool is_setpoint;
+	TX_PRIO prio = tx_prio(txmsg, &is_setpoint);
+	tx_queue *q = &tx_queues[prio];
+
+	chSysLock();
+
+	if (prio == TX_PRIO_HIGH) {
+		tx_purge_setpoints_locked(txmsg->EID & 0xFF);
+	}
+
+	bool done = false;
+
+	if (is_setpoint) {
+		for (int i = 0;i < q->num;i++) {
+			CANTxFrame *f = &q->frames[(q->read + i) % q->size];
+			if (f->EID == txmsg->EID && f->IDE == txmsg->IDE &&
+					f->DLC >= 3 && f->data8[2] == txmsg->data8[2]) {
+				*f = *txmsg;
+				tx_coalesced++;
+				done = true;
+				break;
+			}
+		}
+	}
+
+	if (!done && !is_setpoint && q->num >= q->size) {
+		tx_waits++;
+		systime_t start = chVTGetSystemTimeX();
+
+		while (q->num >= q->size) {
+			sysinterval_t waited = chTimeDiffX(start, chVTGetSystemTimeX());
+			if (waited >= TIME_MS2I(TX_WAIT_TIMEOUT_MS)) {
+				break;
+			}
+			chThdEnqueueTimeoutS(&tx_waiters, TIME_MS2I(TX_WAIT_TIMEOUT_MS) - waited);
+		}
+	}
+
+	if (!done) {
+		if (q->num < q->size) {
+			q->frames[(q->read + q->num) % q->size] = *txmsg;
+			q->num++;
+			tx_accepted++;
+
+			int depth = tx_queues[TX_PRIO_NORMAL].num + tx_queues[TX_PRIO_HIGH].num;
+			if (depth > tx_depth_max) {
+				tx_depth_max = depth;
+			}
+			done = true;
+		} else {
+			tx_dropped++;
+		}
+	}
+
+	tx_drain_locked();
+	chSchRescheduleS();
+
+	chSysUnlock();
+
+	return done;
+}
+
+/*
+ * Drop the setpoints to a controller from the normal queue, keeping the
+ * order of the other frames. Setpoints to ID_ALL also reach the
+ * controller, so they are dropped as well. Call with the system locked.
+ */
+static void tx_purge_setpoints_locked(uint8_t controller_id) {
+	tx_queue *q = &tx_queues[TX_PRIO_NORMAL];
+	int kept = 0;
+
+	for (int i = 0;i < q->num;i++) {
+		CANTxFrame *f = &q->frames[(q->read + i) % q->size];
+		uint8_t id = f->EID & 0xFF;
+		bool is_setpoint;
+		tx_prio(f, &is_setpoint);
+
+		if (is_setpoint && (controller_id == ID_ALL || id == controller_id || id == ID_ALL)) {
+			tx_purged++;
+			continue;
+		}
+
+		if (kept != i) {
+			q->frames[(q->read + kept) % q->size] = *f;
+		}
+		kept++;
+	}
+
+	q->num = kept;
+}
+
+// Call with the system locked and reschedule afterwards
+static void tx_drain_locked(void) {
+	bool sent = false;
+
+	for (;;) {
+		tx_queue *q = &tx_queues[TX_PRIO_HIGH];
+		if (q->num == 0) {
+			q = &tx_queues[TX_PRIO_NORMAL];
+		}
+
+		if (q->num == 0) {
+			break;
+		}
+
+		// Returns true when all mailboxes are busy
+		if (canTryTransmitI(&CANDx, CAN_ANY_MAILBOX, &q->frames[q->read])) {
+			tx_mailbox_full++;
+			break;
+		}
+
+		q->read = (q->read + 1) % q->size;
+		q->num--;
+		tx_sent++;
+		sent = true;
+	}
+
+	if (sent) {
+		chThdDequeueAllI(&tx_waiters, MSG_OK);
+	}
+}
+
+static void store_status(uint8_t id, CAN_PACKET_ID cmd, CANRxFrame *rxmsg, uint64_t time_us) {
+	int slot = stat_index[id] - 1;
+	can_status_msg stat;
+
+	if (slot < 0) {
+		if (stat_num >= CAN_STATUS_MSGS_TO_STORE) {
+			return;
+		}
+		slot = stat_num++;
+		memset(&stat, 0, sizeof(stat));
+		stat.id = id;
+	} else {
+		stat = stat_msgs[slot];
+	}
+
+	int32_t ind = 0;
+	stat.rx_time = chVTGetSystemTimeX();
+	stat.rx_time_us = time_us;
+
+	if (cmd == CAN_PACKET_STATUS) {
+		stat.rpm = (float)buffer_get_int32(rxmsg->data8, &ind);
+		stat.current = (float)buffer_get_int16(rxmsg->data8, &ind) / 10.0;
+		stat.duty = (float)buffer_get_int16(rxmsg->data8, &ind) / 1000.0;
+	} else {
+		stat.tachometer = buffer_get_int32(rxmsg->data8, &ind);
+		stat.v_in = (float)buffer_get_int16(rxmsg->data8, &ind) / 10.0;
+		stat.tacho_valid = true;
+	}
+
+	chSysLock();
+	stat_msgs[slot] = stat;
+	stat_index[id] = slot + 1;
+	chSysUnlock();
+
+	// The tachometer frame completes a status update
+	if (cmd == CAN_PACKET_STATUS_5 && status_func) {
+		status_func(&stat);
+	}
+}
+
+static int rx_slot_num(void) {
+	return (main_id >= 0 && main_id <= RX_MAIN_ID_MAX) ? RX_SLOTS : 1;
+}
+
+// A slot is busy while a long response is being reassembled in it
+static bool rx_slot_busy(int slot, systime_t now) {
+	return rx_slots[slot].filling &&
+			chTimeDiffX(rx_slots[slot].last_fill, now) < TIME_MS2I(RX_FILL_TIMEOUT_MS);
+}
+
+/*
+ * Get the reassembly slot for a controller. Slots that have not been used
+ * for RX_SLOT_TIMEOUT_MS are handed to other controllers, the least
+ * recently used one when all are taken. A slot is never handed over while
+ * it is busy. This does not wait, it returns -1 when all slots are busy.
+ */
+static int rx_slot_get(uint8_t controller_id) {
+	int slots = rx_slot_num();
+
+	chMtxLock(&rx_slot_mtx);
+
+	int slot = -1;
+	int oldest = -1;
+	systime_t now = chVTGetSystemTimeX();
+
+	for (int i = 0;i < slots;i++) {
+		if (rx_slots[i].controller_id == controller_id) {
+			slot = i;
+			break;
+		}
+
+		if (!rx_slot_busy(i, now) && (oldest < 0 ||
+				chTimeDiffX(rx_slots[i].last_used, now) >
+				chTimeDiffX(rx_slots[oldest].last_used, now))) {
+			oldest = i;
+		}
+	}
+
+	if (slot < 0) {
+		for (int i = 0;i < slots;i++) {
+			if (!rx_slot_busy(i, now) && (rx_slots[i].controller_id < 0 ||
+					chTimeDiffX(rx_slots[i].last_used, now) > TIME_MS2I(RX_SLOT_TIMEOUT_MS))) {
+				slot = i;
+				break;
+			}
+		}
+	}
+
+	if (slot < 0) {
+		slot = oldest;
+	}
+
+	if (slot >= 0) {
+		rx_slots[slot].controller_id = controller_id;
+		rx_slots[slot].last_used = now;
+	}
+
+	chMtxUnlock(&rx_slot_mtx);
+
+	return slot;
+}
+
+static uint8_t rx_slot_reply_id(int slot) {
+	if (rx_slot_num() == 1) {
+		return (uint8_t)(main_id + 128);
+	}
+
+	return (uint8_t)(RX_REPLY_ID_BASE + main_id * RX_SLOTS + slot);
+}
+
+// -1 if the ID is not one of our reply IDs
+static int rx_slot_from_reply_id(uint8_t id) {
+	for (int i = 0;i < rx_slot_num();i++) {
+		if (rx_slot_reply_id(i) == id) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+// Setpoints and alive packets get no response from the VESC
+static bool comm_expects_reply(const uint8_t *data, unsigned int len) {
+	if (len == 0) {
+		return false;
+	}
+
+	switch (data[0]) {
+	case COMM_SET_DUTY:
+	case COMM_SET_CURRENT:
+	case COMM_SET_CURRENT_BRAKE:
+	case COMM_SET_RPM:
+	case COMM_SET_POS:
+	case COMM_SET_HANDBRAKE:
+	case COMM_SET_SERVO_POS:
+	case COMM_ALIVE:
+		return false;
+
+	default:
+		return true;
+	}
+}
+
 static void send_packet_wrapper(unsigned char *data, unsigned int len) {
 	comm_can_send_buffer(vesc_id, data, len, false);
 }
@@ -373,3 +937,46 @@ static void cmd_terminal_forward_vesc(int argc, const char **argv) {
 	}
 	bldc_interface_terminal_cmd(buffer);
 }
+
+static void cmd_terminal_can_status(int argc, const char **argv) {
+	(void)argv;
+
+	if (argc != 1) {
+		terminal_wrong_args();
+		return;
+	}
+
+	terminal_printf("Frames: %lu accepted, %lu for other nodes", rx_frames_cnt, rx_frames_ignored);
+	terminal_printf("TX: %lu accepted, %lu sent, %lu coalesced, %lu setpoints dropped by stops, %lu dropped (queue full)",
+			tx_accepted, tx_sent, tx_coalesced, tx_purged, tx_dropped);
+	terminal_printf("TX: %lu waits for queue room", tx_waits);
+	terminal_printf("TX: %lu times all mailboxes busy, max queue depth %d",
+			tx_mailbox_full, tx_depth_max);
+	terminal_printf("RX: %lu requests dropped, all reply slots busy", rx_slot_full);
+	if (rx_slot_num() == 1) {
+		terminal_printf("RX: main_id above %d, one reply slot only", RX_MAIN_ID_MAX);
+	}
+
+	for (int i = 0;i < RX_SLOTS;i++) {
+		rx_slot *s = &rx_slots[i];
+		if (s->controller_id < 0) {
+			continue;
+		}
+
+		terminal_printf("Slot %d (reply ID %3u, VESC %3d): %lu packets, %lu bytes, %lu CRC errors, %lu bound errors",
+				i, rx_slot_reply_id(i), s->controller_id,
+				s->packets, s->bytes, s->crc_errors, s->bound_errors);
+	}
+
+	for (int i = 0;i < stat_num;i++) {
+		can_status_msg stat;
+		if (comm_can_get_status(stat_msgs[i].id, &stat)) {
+			terminal_printf("ID %3d: %8.1f rpm %6.1f A %6.3f duty %5.1f V, tacho %ld, %lu ms ago",
+					stat.id, (double)stat.rpm, (double)stat.current, (double)stat.duty,
+					(double)stat.v_in, stat.tachometer,
+					TIME_I2MS(chVTTimeElapsedSinceX(stat.rx_time)));
+		}
+	}
+
+	terminal_printf(" ");
+}
@@ -24,10 +24,12 @@
 // Functions
 void comm_can_init(void);
 void comm_can_set_vesc_id(int id);
+bool comm_can_get_status(uint8_t id, can_status_msg *msg);
+void comm_can_set_status_func(void(*func)(can_status_msg *stat));
 void comm_can_lock_vesc(void);
 void comm_can_unlock_vesc(void);
-void comm_can_transmit_eid(uint32_t id, uint8_t *data, uint8_t len);
-void comm_can_transmit_sid(uint32_t id, uint8_t *data, uint8_t len);
+bool comm_can_transmit_eid(uint32_t id, uint8_t *data, uint8_t len);
+bool comm_can_transmit_sid(uint32_t id, uint8_t *data, uint8_t len);
 void comm_can_send_buffer(uint8_t controller_id, uint8_t *data, unsigned int len, bool send);
 
 #endif /* COMM_CAN_H_ */
@@ -17,10 +17,12 @@
  */
 
 #include "commands.h"
+#include "ch.h"
 #include "commands_specific.h"
 #include "packet.h"
 #include "buffer.h"
 #include "conf_general.h"
+#include "servo_pwm.h"
 #include "datatypes.h"
 #include "utils.h"
 #include "log.h"
@@ -31,16 +33,108 @@
 #include "timeout.h"
 #include "autopilot.h"
 #include "motor_sim.h"
+#include "blackbox.h"
+#include "prof.h"
+#include "latency.h"
 #include <stdint.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
 
 #define RTCM3PREAMB              0xD3
 
+// Settings
+#define TERMINAL_QUEUE_LEN		4
+#define TERMINAL_CMD_LEN		256
+#define PRINTF_BUF_LEN			512
+#define PRINTF_FLUSH_MS			20
+
+// Private types
+typedef struct {
+	char cmd[TERMINAL_CMD_LEN];
+	void(*send_func)(unsigned char *data, unsigned int len);
+} terminal_job;
+
 // Private variables
-static uint8_t m_send_buffer[PACKET_MAX_PL_LEN];
+static uint8_t m_send_buffer[PACKET_MAX_PL_LEN]; // Packet processing thread only
 static void(*m_send_func)(unsigned char *data, unsigned int len) = 0;
 
+/*
+ * Plots and NMEA are sent from other threads, e.g. from terminal commands,
+ * pos and the autopilot, so they get their own buffer. Only the link send
+ * function runs with m_plot_mutex held, so plotting with the pos or
+ * autopilot lock held cannot deadlock with packet processing.
+ */
+static uint8_t m_plot_buffer[PACKET_MAX_PL_LEN];
+static MUTEX_DECL(m_plot_mutex);
+
+/*
+ * Terminal commands run on their own thread so that slow commands do not
+ * hold up the packet processing thread. Jobs cycle between the free and
+ * the pending mailbox. Their output goes to the link the command came from
+ * and is flushed when the command returns.
+ */
+static terminal_job m_term_jobs[TERMINAL_QUEUE_LEN];
+static msg_t m_term_free_buf[TERMINAL_QUEUE_LEN];
+static msg_t m_term_pending_buf[TERMINAL_QUEUE_LEN];
+static mailbox_t m_term_free;
+static mailbox_t m_term_pending;
+static thread_t *m_term_thd = 0;
+static void(*m_term_send_func)(unsigned char *data, unsigned int len) = 0;
+
+/*
+ * printf output from all threads is appended line by line to one CMD_PRINTF
+ * packet under m_print_mutex. The packet is sent when the next line does
+ * not fit, when a line for another link arrives, or PRINTF_FLUSH_MS after
+ * the first line went into the empty buffer.
+ *
+ * Sending can block on the link, so the packet is copied to
+ * m_print_send_buf and sent after m_print_mutex is released. Threads that
+ * print only wait for the copy. m_print_send_mutex keeps the packets in
+ * order and is always taken before m_print_mutex.
+ */
+static bool m_print_init_done = false;
+static mutex_t m_print_mutex;
+static mutex_t m_print_send_mutex;
+static binary_semaphore_t m_print_sem;
+static char m_print_buf[PRINTF_BUF_LEN];
+static char m_print_send_buf[PRINTF_BUF_LEN];
+static int m_print_len = 0;
+static void(*m_print_func)(unsigned char *data, unsigned int len) = 0;
+
+// Threads
+static THD_WORKING_AREA(terminal_thread_wa, 4096);
+static THD_FUNCTION(terminal_thread, arg);
+static THD_WORKING_AREA(print_flush_thread_wa, 1024); // Runs the send functions
+static THD_FUNCTION(print_flush_thread, arg);
+
+// Private functions
+static void terminal_enqueue(const unsigned char *data, unsigned int len,
+		void (*func)(unsigned char *data, unsigned int len));
+static bool print_append(void(*func)(unsigned char *data, unsigned int len),
+		const char* format, va_list args);
+static void send_plot_buffer(unsigned int len);
+
+void commands_init(void) {
+	chMtxObjectInit(&m_print_mutex);
+	chMtxObjectInit(&m_print_send_mutex);
+	chBSemObjectInit(&m_print_sem, true);
+	m_print_init_done = true;
+
+	chThdCreateStatic(print_flush_thread_wa, sizeof(print_flush_thread_wa),
+			NORMALPRIO - 1, print_flush_thread, NULL);
+
+	chMBObjectInit(&m_term_free, m_term_free_buf, TERMINAL_QUEUE_LEN);
+	chMBObjectInit(&m_term_pending, m_term_pending_buf, TERMINAL_QUEUE_LEN);
+
+	for (int i = 0;i < TERMINAL_QUEUE_LEN;i++) {
+		chMBPostTimeout(&m_term_free, (msg_t)&m_term_jobs[i], TIME_IMMEDIATE);
+	}
+
+	m_term_thd = chThdCreateStatic(terminal_thread_wa, sizeof(terminal_thread_wa),
+			NORMALPRIO - 1, terminal_thread, NULL);
+}
+
 /**
  * Provide a function to use the next time there are packets to be sent.
  *
@@ -108,11 +202,136 @@ void commands_process_packet(unsigned char *data, unsigned int len,
 			timeout_reset();
 		} break;
 
-		case CMD_TERMINAL_CMD: {
+		case CMD_EMERGENCY_STOP: {
+			blackbox_trigger(BLACKBOX_REASON_EMERGENCY_STOP);
+			timeout_emergency_stop();
+		} break;
+
+		case CMD_EMERGENCY_STOP_RELEASE: {
+			timeout_emergency_release();
+		} break;
+
+		case CMD_BLACKBOX_GET: {
+			commands_set_send_func(func);
+
+			int32_t ind = 0;
+			int record = data[ind++];
+			int first = buffer_get_uint16(data, &ind);
+			int num = data[ind++];
+
+			if (num > 25) {
+				break;
+			}
+
+			BLACKBOX_REASON reason = BLACKBOX_REASON_NONE;
+			uint32_t trigger_time_ms = 0;
+			int sample_cnt = 0;
+			blackbox_get_record_info(record, &reason, &trigger_time_ms, &sample_cnt);
+
+			if (first >= sample_cnt) {
+				num = 0;
+			} else if ((first + num) > sample_cnt) {
+				num = sample_cnt - first;
+			}
+
+			int32_t send_index = 0;
+			m_send_buffer[send_index++] = id_ret;
+			m_send_buffer[send_index++] = CMD_BLACKBOX_GET;
+			m_send_buffer[send_index++] = blackbox_get_record_num();
+			m_send_buffer[send_index++] = record;
+			m_send_buffer[send_index++] = reason;
+			buffer_append_uint32(m_send_buffer, trigger_time_ms, &send_index);
+			buffer_append_uint16(m_send_buffer, sample_cnt, &send_index);
+			buffer_append_uint16(m_send_buffer, first, &send_index);
+			m_send_buffer[send_index++] = num;
+
+			for (int i = first;i < (first + num);i++) {
+				BLACKBOX_SAMPLE s;
+				blackbox_get_sample(record, i, &s);
+				buffer_append_uint32(m_send_buffer, s.time_ms, &send_index);
+				buffer_append_float32_auto(m_send_buffer, s.px, &send_index);
+				buffer_append_float32_auto(m_send_buffer, s.py, &send_index);
+				buffer_append_float32_auto(m_send_buffer, s.yaw, &send_index);
+				buffer_append_float32_auto(m_send_buffer, s.speed, &send_index);
+				buffer_append_float32_auto(m_send_buffer, s.rpm, &send_index);
+				buffer_append_float32_auto(m_send_buffer, s.current, &send_index);
+				buffer_append_int32(m_send_buffer, s.tachometer, &send_index);
+				buffer_append_int16(m_send_buffer, s.ap_point, &send_index);
+				m_send_buffer[send_index++] = s.ap_active;
+				m_send_buffer[send_index++] = s.fault_code;
+			}
+
+			commands_send_packet(m_send_buffer, send_index);
+		} break;
+
+		case CMD_PROF_GET: {
+			commands_set_send_func(func);
+
+			int32_t send_index = 0;
+			m_send_buffer[send_index++] = id_ret;
+			m_send_buffer[send_index++] = CMD_PROF_GET;
+
+			uint64_t total = prof_get_total_cycles();
+			buffer_append_uint64(m_send_buffer, total, &send_index);
+			buffer_append_uint32(m_send_buffer, STM32_SYSCLK, &send_index);
+			if (total == 0) {
+				total = 1;
+			}
+
+			// Per thread: name, prio, load (permille), switches, max latency (us), latency histogram
+			thread_t *tp = chRegFirstThread();
+			do {
+				if ((send_index + 16 + 11 + 2 * PROF_LAT_BINS) <= PACKET_MAX_PL_LEN) {
+					const char *name = tp->name == NULL ? "" : tp->name;
+					size_t name_len = strlen(name);
+					if (name_len > 15) {
+						name_len = 15;
+					}
+					memcpy(m_send_buffer + send_index, name, name_len);
+					send_index += name_len;
+					m_send_buffer[send_index++] = '\0';
+					m_send_buffer[send_index++] = tp->prio;
+					buffer_append_uint16(m_send_buffer, (uint16_t)(tp->prof_cycles * 1000 / total), &send_index);
+					buffer_append_uint32(m_send_buffer, tp->prof_switches, &send_index);
+					buffer_append_uint32(m_send_buffer, tp->prof_lat_max, &send_index);
+					for (int i = 0;i < PROF_LAT_BINS;i++) {
+						buffer_append_uint16(m_send_buffer, tp->prof_lat_hist[i], &send_index);
+					}
+				}
+
+				tp = chRegNextThread(tp);
+			} while (tp != NULL);
+
+			commands_send_packet(m_send_buffer, send_index);
+		} break;
+
+		case CMD_LATENCY_GET: {
 			commands_set_send_func(func);
 
-			data[len] = '\0';
-			terminal_process_string((char*)data);
+			int32_t send_index = 0;
+			m_send_buffer[send_index++] = id_ret;
+			m_send_buffer[send_index++] = CMD_LATENCY_GET;
+			m_send_buffer[send_index++] = LATENCY_PATH_NUM;
+			m_send_buffer[send_index++] = LATENCY_BINS;
+
+			for (int i = 0;i < LATENCY_PATH_NUM;i++) {
+				LATENCY_STATS s;
+				latency_get_stats(i, &s);
+				buffer_append_uint32(m_send_buffer, s.cnt, &send_index);
+				buffer_append_uint32(m_send_buffer, s.cnt ? s.min_us : 0, &send_index);
+				buffer_append_uint32(m_send_buffer, s.cnt ? (uint32_t)(s.sum_us / s.cnt) : 0, &send_index);
+				buffer_append_uint32(m_send_buffer, s.max_us, &send_index);
+				for (int j = 0;j < LATENCY_BINS;j++) {
+					buffer_append_uint32(m_send_buffer, s.hist[j], &send_index);
+				}
+			}
+
+			commands_send_packet(m_send_buffer, send_index);
+		} break;
+
+		case CMD_TERMINAL_CMD: {
+			commands_set_send_func(func);
+			terminal_enqueue(data, len, func);
 		} break;
 
 		case CMD_SET_POS:
@@ -402,6 +621,9 @@ void commands_process_packet(unsigned char *data, unsigned int len,
 			main_config.car.axis_distance = buffer_get_float32_auto(data, &ind);
 
 			motor_sim_set_running(main_config.car.simulate_motor);
+#ifdef SERVO_STEERING
+			servo_pwm_set_ramp_time(SERVO_STEERING, main_config.car.steering_ramp_time);
+#endif
 
 			// Multirotor settings
 			main_config.mr.vel_decay_e = buffer_get_float32_auto(data, &ind);
@@ -459,6 +681,23 @@ void commands_process_packet(unsigned char *data, unsigned int len,
 			main_config.mr.motor_pwm_min_us = buffer_get_uint16(data, &ind);
 			main_config.mr.motor_pwm_max_us = buffer_get_uint16(data, &ind);
 
+			// Appended later, older clients do not send these
+			if ((ind + 1) <= (int32_t)len) {
+				main_config.mr.motor_output = data[ind++];
+			}
+
+			if ((ind + 2) <= (int32_t)len) {
+				main_config.ahrs_filter = data[ind++];
+				main_config.ahrs_use_mag = data[ind++];
+			}
+
+			if ((ind + 1 + DRIVE_WHEELS_MAX) <= (int32_t)len) {
+				main_config.drive.type = data[ind++];
+				for (int i = 0;i < DRIVE_WHEELS_MAX;i++) {
+					main_config.drive.vesc_id[i] = data[ind++];
+				}
+			}
+
 			conf_general_store_main_config(&main_config);
 
 			// Doing this while driving will get wrong as there is so much accelerometer noise then.
@@ -604,6 +843,13 @@ void commands_process_packet(unsigned char *data, unsigned int len,
 			m_send_buffer[send_index++] = main_cfg_tmp.mr.motors_cw;
 			buffer_append_uint16(m_send_buffer, main_cfg_tmp.mr.motor_pwm_min_us, &send_index);
 			buffer_append_uint16(m_send_buffer, main_cfg_tmp.mr.motor_pwm_max_us, &send_index);
+			m_send_buffer[send_index++] = main_cfg_tmp.mr.motor_output;
+			m_send_buffer[send_index++] = main_cfg_tmp.ahrs_filter;
+			m_send_buffer[send_index++] = main_cfg_tmp.ahrs_use_mag;
+			m_send_buffer[send_index++] = main_cfg_tmp.drive.type;
+			for (int i = 0;i < DRIVE_WHEELS_MAX;i++) {
+				m_send_buffer[send_index++] = main_cfg_tmp.drive.vesc_id[i];
+			}
 
 			commands_send_packet(m_send_buffer, send_index);
 		} break;
@@ -631,16 +877,53 @@ void commands_printf(const char* format, ...) {
 }
 
 void commands_vprintf(const char* format, va_list args) {
-	int len;
-	static char print_buffer[512];
+	void(*func)(unsigned char *data, unsigned int len) = m_send_func;
 
-	print_buffer[0] = main_id;
-	print_buffer[1] = CMD_PRINTF;
-	len = vsnprintf(print_buffer + 2, 509, format, args);
+	if (m_term_thd && chThdGetSelfX() == m_term_thd) {
+		func = m_term_send_func;
+	}
 
-	if(len > 0) {
-		commands_send_packet((unsigned char*)print_buffer, (len<509) ? len + 2: 512);
+	if (!m_print_init_done || !func) {
+		return;
+	}
+
+	for (;;) {
+		chMtxLock(&m_print_mutex);
+		bool appended = print_append(func, format, args);
+		chMtxUnlock(&m_print_mutex);
+
+		if (appended) {
+			break;
+		}
+
+		commands_flush_printf();
+	}
+}
+
+/**
+ * Send the printf output that is waiting for the flush deadline now.
+ */
+void commands_flush_printf(void) {
+	if (!m_print_init_done) {
+		return;
+	}
+
+	chMtxLock(&m_print_send_mutex);
+
+	chMtxLock(&m_print_mutex);
+	int len = m_print_len;
+	void(*func)(unsigned char *data, unsigned int len) = m_print_func;
+	memcpy(m_print_send_buf + 2, m_print_buf + 2, len);
+	m_print_len = 0;
+	chMtxUnlock(&m_print_mutex);
+
+	if (len > 0 && func) {
+		m_print_send_buf[0] = main_id;
+		m_print_send_buf[1] = CMD_PRINTF;
+		func((unsigned char*)m_print_send_buf, len + 2);
 	}
+
+	chMtxUnlock(&m_print_send_mutex);
 }
 
 #define LOG_LINE_SIZE 512
@@ -662,51 +945,180 @@ void commands_printf_log_serial(char* format, ...) {
 
 void commands_send_nmea(const char *data, unsigned int len) {
 	if (main_config.gps_send_nmea) {
+		chMtxLock(&m_plot_mutex);
 		int32_t send_index = 0;
-		m_send_buffer[send_index++] = main_id;
-		m_send_buffer[send_index++] = CMD_SEND_NMEA_RADIO;
-		memcpy(m_send_buffer + send_index, data, len);
+		m_plot_buffer[send_index++] = main_id;
+		m_plot_buffer[send_index++] = CMD_SEND_NMEA_RADIO;
+		memcpy(m_plot_buffer + send_index, data, len);
 		send_index += len;
-		commands_send_packet(m_send_buffer, send_index);
+		send_plot_buffer(send_index);
+		chMtxUnlock(&m_plot_mutex);
 	}
 }
 
 void commands_init_plot(char *namex, char *namey) {
+	chMtxLock(&m_plot_mutex);
 	int ind = 0;
-	m_send_buffer[ind++] = main_id;
-	m_send_buffer[ind++] = CMD_PLOT_INIT;
-	memcpy(m_send_buffer + ind, namex, strlen(namex));
+	m_plot_buffer[ind++] = main_id;
+	m_plot_buffer[ind++] = CMD_PLOT_INIT;
+	memcpy(m_plot_buffer + ind, namex, strlen(namex));
 	ind += strlen(namex);
-	m_send_buffer[ind++] = '\0';
-	memcpy(m_send_buffer + ind, namey, strlen(namey));
+	m_plot_buffer[ind++] = '\0';
+	memcpy(m_plot_buffer + ind, namey, strlen(namey));
 	ind += strlen(namey);
-	m_send_buffer[ind++] = '\0';
-	commands_send_packet((unsigned char*)m_send_buffer, ind);
+	m_plot_buffer[ind++] = '\0';
+	send_plot_buffer(ind);
+	chMtxUnlock(&m_plot_mutex);
 }
 
 void commands_plot_add_graph(char *name) {
+	chMtxLock(&m_plot_mutex);
 	int ind = 0;
-	m_send_buffer[ind++] = main_id;
-	m_send_buffer[ind++] = CMD_PLOT_ADD_GRAPH;
-	memcpy(m_send_buffer + ind, name, strlen(name));
+	m_plot_buffer[ind++] = main_id;
+	m_plot_buffer[ind++] = CMD_PLOT_ADD_GRAPH;
+	memcpy(m_plot_buffer + ind, name, strlen(name));
 	ind += strlen(name);
-	m_send_buffer[ind++] = '\0';
-	commands_send_packet((unsigned char*)m_send_buffer, ind);
+	m_plot_buffer[ind++] = '\0';
+	send_plot_buffer(ind);
+	chMtxUnlock(&m_plot_mutex);
 }
 
 void commands_plot_set_graph(int graph) {
+	chMtxLock(&m_plot_mutex);
 	int ind = 0;
-	m_send_buffer[ind++] = main_id;
-	m_send_buffer[ind++] = CMD_PLOT_SET_GRAPH;
-	m_send_buffer[ind++] = graph;
-	commands_send_packet((unsigned char*)m_send_buffer, ind);
+	m_plot_buffer[ind++] = main_id;
+	m_plot_buffer[ind++] = CMD_PLOT_SET_GRAPH;
+	m_plot_buffer[ind++] = graph;
+	send_plot_buffer(ind);
+	chMtxUnlock(&m_plot_mutex);
 }
 
 void commands_send_plot_points(float x, float y) {
+	chMtxLock(&m_plot_mutex);
 	int32_t ind = 0;
-	m_send_buffer[ind++] = main_id;
-	m_send_buffer[ind++] = CMD_PLOT_DATA;
-	buffer_append_float32_auto(m_send_buffer, x, &ind);
-	buffer_append_float32_auto(m_send_buffer, y, &ind);
-	commands_send_packet((unsigned char*)m_send_buffer, ind);
+	m_plot_buffer[ind++] = main_id;
+	m_plot_buffer[ind++] = CMD_PLOT_DATA;
+	buffer_append_float32_auto(m_plot_buffer, x, &ind);
+	buffer_append_float32_auto(m_plot_buffer, y, &ind);
+	send_plot_buffer(ind);
+	chMtxUnlock(&m_plot_mutex);
+}
+
+/*
+ * Send m_plot_buffer to the link of the calling thread. The terminal
+ * thread answers on the link its command came from.
+ */
+static void send_plot_buffer(unsigned int len) {
+	void(*func)(unsigned char *data, unsigned int len) = m_send_func;
+
+	if (m_term_thd && chThdGetSelfX() == m_term_thd) {
+		func = m_term_send_func;
+	}
+
+	if (func) {
+		func(m_plot_buffer, len);
+	}
+}
+
+static void terminal_enqueue(const unsigned char *data, unsigned int len,
+		void (*func)(unsigned char *data, unsigned int len)) {
+	if (!m_term_thd) {
+		return;
+	}
+
+	if (len >= TERMINAL_CMD_LEN) {
+		commands_printf("Terminal command too long (%u bytes)\n", len);
+		return;
+	}
+
+	msg_t msg;
+	if (chMBFetchTimeout(&m_term_free, &msg, TIME_IMMEDIATE) != MSG_OK) {
+		commands_printf("Terminal busy, command dropped\n");
+		return;
+	}
+
+	terminal_job *job = (terminal_job*)msg;
+	memcpy(job->cmd, data, len);
+	job->cmd[len] = '\0';
+	job->send_func = func;
+	chMBPostTimeout(&m_term_pending, msg, TIME_INFINITE);
+}
+
+/*
+ * Append a line to the packet. Returns false without appending when the
+ * packet has to be flushed first, because the line is for another link or
+ * does not fit. args is not consumed, so the call can be repeated.
+ */
+static bool print_append(void(*func)(unsigned char *data, unsigned int len),
+		const char* format, va_list args) {
+	if (func != m_print_func) {
+		if (m_print_len > 0) {
+			return false;
+		}
+		m_print_func = func;
+	}
+
+	va_list args2;
+	va_copy(args2, args);
+
+	// Lines share one packet, the client prints it as one block of text
+	int sep = (m_print_len > 0 && m_print_buf[2 + m_print_len - 1] != '\n') ? 1 : 0;
+	int space = PRINTF_BUF_LEN - 2 - m_print_len - sep;
+	int len = vsnprintf(m_print_buf + 2 + m_print_len + sep, space, format, args2);
+
+	va_end(args2);
+
+	// A line that does not fit goes into the next packet, lines longer than
+	// a whole packet are cut
+	if (len >= space && m_print_len > 0) {
+		return false;
+	}
+
+	if (len <= 0) {
+		return true;
+	}
+
+	bool was_empty = m_print_len == 0;
+
+	if (sep) {
+		m_print_buf[2 + m_print_len] = '\n';
+	}
+
+	m_print_len += sep + (len < space ? len : space - 1);
+
+	if (was_empty) {
+		chBSemSignal(&m_print_sem);
+	}
+
+	return true;
+}
+
+static THD_FUNCTION(print_flush_thread, arg) {
+	(void)arg;
+
+	chRegSetThreadName("Printf flush");
+
+	for(;;) {
+		chBSemWait(&m_print_sem);
+		chThdSleepMilliseconds(PRINTF_FLUSH_MS);
+		commands_flush_printf();
+	}
+}
+
+static THD_FUNCTION(terminal_thread, arg) {
+	(void)arg;
+
+	chRegSetThreadName("Terminal");
+
+	for(;;) {
+		msg_t msg;
+		chMBFetchTimeout(&m_term_pending, &msg, TIME_INFINITE);
+		terminal_job *job = (terminal_job*)msg;
+
+		m_term_send_func = job->send_func;
+		terminal_process_string(job->cmd);
+		commands_flush_printf();
+
+		chMBPostTimeout(&m_term_free, msg, TIME_INFINITE);
+	}
 }
@@ -23,12 +23,14 @@
 #include "ublox.h"
 
 // Functions
+void commands_init(void);
 void commands_set_send_func(void(*func)(unsigned char *data, unsigned int len));
 void commands_send_packet(unsigned char *data, unsigned int len);
 void commands_process_packet(unsigned char *data, unsigned int len,
 		void (*func)(unsigned char *data, unsigned int len));
 void commands_printf(const char* format, ...);
 void commands_vprintf(const char* format, va_list args);
+void commands_flush_printf(void);
 void commands_printf_log_serial(char* format, ...);
 void commands_send_nmea(const char *data, unsigned int len);
 void commands_init_plot(char *namex, char *namey);
@@ -44,6 +44,12 @@ typedef enum {
 	LOG_EXT_ETHERNET
 } LOG_EXT_MODE;
 
+// Attitude filter
+typedef enum {
+	AHRS_FILTER_MADGWICK = 0,
+	AHRS_FILTER_MAHONY
+} AHRS_FILTER;
+
 // Orientation data
 typedef struct {
 	float q0;
@@ -100,6 +106,11 @@ typedef struct {
 	uint32_t gps_corr_time;
 	uint32_t ultra_update_time;
 
+	// Stamps of the sensor samples behind this state, see latency.c
+	uint32_t imu_sample_stamp;
+	uint32_t gnss_sample_stamp;
+	uint64_t imu_time_us; // timebase, of the IMU sample
+
 	// Multirotor state
 	float tilt_roll_err;
 	float tilt_pitch_err;
@@ -131,7 +142,7 @@ typedef struct {
 	float pz;
 	float yaw;
 	float speed;
-	int32_t time;
+	uint64_t time_us; // timebase
 } POS_POINT;
 
 typedef enum {
@@ -147,7 +158,8 @@ typedef enum {
 	CAN_PACKET_FILL_RX_BUFFER_LONG,
 	CAN_PACKET_PROCESS_RX_BUFFER,
 	CAN_PACKET_PROCESS_SHORT_BUFFER,
-	CAN_PACKET_STATUS
+	CAN_PACKET_STATUS,
+	CAN_PACKET_STATUS_5 = 27 // Tachometer and input voltage
 } CAN_PACKET_ID;
 
 // Commands
@@ -197,6 +209,10 @@ typedef enum {
 	CMD_IO_BOARD_SET_VALVE,
 	CMD_HYDRAULIC_MOVE,
 	CMD_HEARTBEAT,
+	CMD_BLACKBOX_GET,
+	CMD_PROF_GET,
+	CMD_LATENCY_GET,
+	CMD_EMERGENCY_STOP_RELEASE,
 
 	// Car commands
 	CMD_GET_STATE = 120,
@@ -237,6 +253,14 @@ typedef enum {
 	HYDRAULIC_MOVE_UNDEFINED
 } HYDRAULIC_MOVE;
 
+typedef enum {
+	DRIVE_ACKERMANN = 0,
+	DRIVE_DIFFERENTIAL,
+	DRIVE_4WD // Skid steered, left and right side driven like differential
+} DRIVE_TYPE;
+
+#define DRIVE_WHEELS_MAX		4
+
 typedef struct {
 	bool yaw_use_odometry; // Use odometry data for yaw angle correction.
 	float yaw_imu_gain; // Gain for yaw angle from IMU (vs odometry)
@@ -257,6 +281,19 @@ typedef struct {
 	float axis_distance;
 } MAIN_CONFIG_CAR;
 
+typedef struct {
+	DRIVE_TYPE type;
+	// CAN IDs of the drive VESCs: left (rear left), right (rear right), front left, front right.
+	// Ackermann uses the first one, differential the first two and 4WD all of them. Odometry
+	// with more than one needs their status broadcasts, so VESC_ID has to be ID_ALL.
+	uint8_t vesc_id[DRIVE_WHEELS_MAX];
+} MAIN_CONFIG_DRIVE;
+
+typedef enum {
+	MOTOR_OUTPUT_PWM = 0,
+	MOTOR_OUTPUT_DSHOT600
+} MOTOR_OUTPUT;
+
 typedef struct {
 	// Dead reckoning
 	float vel_decay_e;
@@ -319,6 +356,7 @@ typedef struct {
 	bool motors_cw; // Front left (or front in + mode) runs in the clockwise direction (ccw if false)
 	uint16_t motor_pwm_min_us; // Minimum servo pulse length for motor in microseconds
 	uint16_t motor_pwm_max_us; // Maximum servo pulse length for motor in microseconds
+	MOTOR_OUTPUT motor_output; // Motor output protocol, applied at startup
 } MAIN_CONFIG_MULTIROTOR;
 
 // Main configuration
@@ -375,6 +413,17 @@ typedef struct {
 
 	MAIN_CONFIG_CAR car;
 	MAIN_CONFIG_MULTIROTOR mr;
+
+	// Gyro bias in deg/s, estimated online and not part of the config packets.
+	// Only stored with conf_general_store_gyro_bias.
+	float gyro_bias_x;
+	float gyro_bias_y;
+	float gyro_bias_z;
+
+	AHRS_FILTER ahrs_filter; // Attitude filter
+	bool ahrs_use_mag; // Run the filter with the magnetometer (9-DOF) when mag_use is set
+
+	MAIN_CONFIG_DRIVE drive; // Car drive train
 } MAIN_CONFIG;
 
 typedef struct {
@@ -389,6 +438,7 @@ typedef struct {
 	int sats;
 	int32_t ms; // Milliseconds today
 	uint32_t update_time;
+	uint64_t update_time_us; // timebase
 	// Local position (ENU frame)
 	bool local_init_done;
 	float lx;
@@ -977,9 +1027,13 @@ typedef struct {
 typedef struct {
 	int id;
 	uint32_t rx_time;
+	uint64_t rx_time_us; // timebase, of the last status frame
 	float rpm;
 	float current;
 	float duty;
+	int32_t tachometer;
+	float v_in;
+	bool tacho_valid; // A CAN_PACKET_STATUS_5 has been received
 } can_status_msg;
 
 typedef enum {
@@ -1019,6 +1073,7 @@ typedef struct {
     mc_fault_code fault_code;
     float pid_pos;
     uint8_t vesc_id;
+    uint64_t rx_time_us; // timebase
 } mc_values;
 
 // Communication commands
@@ -1130,4 +1185,29 @@ typedef struct {
 	bool is_high;
 } ADC_CNT_t;
 
+// ============== Black-box Datatypes ================== //
+
+typedef enum {
+	BLACKBOX_REASON_NONE = 0,
+	BLACKBOX_REASON_TIMEOUT,
+	BLACKBOX_REASON_EMERGENCY_STOP,
+	BLACKBOX_REASON_MANUAL
+} BLACKBOX_REASON;
+
+// One black-box snapshot. Kept at a fixed 36 bytes so that records can be
+// copied to flash word by word.
+typedef struct {
+	uint32_t time_ms;
+	float px;
+	float py;
+	float yaw;
+	float speed;
+	float rpm;
+	float current;
+	int32_t tachometer;
+	int16_t ap_point;
+	uint8_t ap_active;
+	uint8_t fault_code;
+} BLACKBOX_SAMPLE;
+
 #endif /* DATATYPES_H_ */
@@ -0,0 +1,207 @@
+/*
+	Copyright 2021 Marvin Damschen	marvin.damschen@ri.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "drive.h"
+#include "conf_general.h"
+#include "bldc_interface.h"
+#include "comm_can.h"
+#include "servo_pwm.h"
+#include "buffer.h"
+#include "utils.h"
+
+#include <math.h>
+
+/*
+ * Motor commands for the drive types in MAIN_CONFIG_CAR.
+ *
+ * Ackermann cars have one drive VESC and steer with servo 0. Differential
+ * and skid steered 4WD vehicles have one VESC per wheel and turn by driving
+ * the sides at different speeds. For them the output of servo 0 is used as
+ * a virtual steering angle, so that the autopilot and the RC modes work
+ * unchanged: the sides get (1 -/+ tan(angle) / 2) of the command, which is
+ * the turn radius an Ackermann car with axis_distance as wheelbase drives.
+ *
+ * The commands for all wheels are put on the CAN TX queue back to back and
+ * go out as one burst. Setpoints that are still queued for a wheel are
+ * replaced by the new ones.
+ */
+
+// Private functions
+static bool can_send(void);
+static void send_wheels(COMM_PACKET_ID cmd, float value, bool split);
+
+/**
+ * Set the drive speed.
+ *
+ * @param speed
+ * Speed in m/s.
+ */
+void drive_set_speed(float speed) {
+	if (main_config.car.disable_motor) {
+		return;
+	}
+
+	float rpm = speed / (main_config.car.gear_ratio
+			* (2.0 / main_config.car.motor_poles) * (1.0 / 60.0)
+			* main_config.car.wheel_diam * M_PI);
+
+	if (can_send()) {
+		send_wheels(COMM_SET_RPM, rpm, true);
+	} else {
+		bldc_interface_set_rpm((int)rpm);
+	}
+}
+
+/**
+ * Set the motor current of the drive wheels.
+ *
+ * @param current
+ * Current in A, split between the sides for differential and 4WD.
+ */
+void drive_set_current(float current) {
+	if (main_config.car.disable_motor) {
+		return;
+	}
+
+	if (can_send()) {
+		send_wheels(COMM_SET_CURRENT, current, true);
+	} else {
+		bldc_interface_set_current(current);
+	}
+}
+
+/**
+ * Set the duty cycle of the drive wheels.
+ *
+ * @param duty
+ * Duty cycle, -1.0 to 1.0. Split between the sides for differential and 4WD.
+ */
+void drive_set_duty(float duty) {
+	if (main_config.car.disable_motor) {
+		return;
+	}
+
+	if (can_send()) {
+		send_wheels(COMM_SET_DUTY, duty, true);
+	} else {
+		bldc_interface_set_duty_cycle(duty);
+	}
+}
+
+/**
+ * Brake all drive wheels with the same current.
+ *
+ * @param current
+ * Brake current in A.
+ */
+void drive_set_current_brake(float current) {
+	if (main_config.car.disable_motor) {
+		return;
+	}
+
+	if (can_send()) {
+		send_wheels(COMM_SET_CURRENT_BRAKE, current, false);
+	} else {
+		bldc_interface_set_current_brake(current);
+	}
+}
+
+/**
+ * Get the number of drive VESCs for the configured drive type.
+ */
+int drive_wheel_num(void) {
+	switch (main_config.drive.type) {
+	case DRIVE_DIFFERENTIAL: return 2;
+	case DRIVE_4WD: return 4;
+	default: return 1;
+	}
+}
+
+/**
+ * Get the wheel a VESC drives.
+ *
+ * @param vesc_id
+ * CAN ID of the VESC.
+ *
+ * @return
+ * Index into drive.vesc_id, even for the left side and odd for the right
+ * side. -1 if the VESC is not a drive VESC.
+ */
+int drive_wheel_index(uint8_t vesc_id) {
+	for (int i = 0;i < drive_wheel_num();i++) {
+		if (main_config.drive.vesc_id[i] == vesc_id) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Get the steering angle from the current output of servo 0.
+ *
+ * @return
+ * Steering angle in radians, positive to the left.
+ */
+float drive_get_steering_angle(void) {
+	return (servo_pwm_get(0) - main_config.car.steering_center)
+			* ((2.0 * main_config.car.steering_max_angle_rad)
+					/ main_config.car.steering_range);
+}
+
+/*
+ * The motor simulation and the safety stop are handled by bldc_interface,
+ * so commands only go directly to the wheels when neither is active.
+ */
+static bool can_send(void) {
+	return !main_config.car.simulate_motor && !bldc_interface_get_safety_stop();
+}
+
+static void send_wheels(COMM_PACKET_ID cmd, float value, bool split) {
+	float side[2] = {value, value};
+
+	if (split && main_config.drive.type != DRIVE_ACKERMANN) {
+		float diff = tanf(drive_get_steering_angle()) / 2.0;
+		side[0] = value * (1.0 - diff);
+		side[1] = value * (1.0 + diff);
+	}
+
+	for (int i = 0;i < drive_wheel_num();i++) {
+		uint8_t buffer[5];
+		int32_t ind = 0;
+		float val = side[i & 1];
+
+		buffer[ind++] = cmd;
+
+		switch (cmd) {
+		case COMM_SET_RPM:
+			buffer_append_int32(buffer, (int32_t)val, &ind);
+			break;
+
+		case COMM_SET_DUTY:
+			utils_truncate_number(&val, -1.0, 1.0);
+			buffer_append_float32(buffer, val, 100000.0, &ind);
+			break;
+
+		default:
+			buffer_append_float32(buffer, val, 1000.0, &ind);
+			break;
+		}
+
+		comm_can_send_buffer(main_config.drive.vesc_id[i], buffer, ind, false);
+	}
+}
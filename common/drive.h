@@ -0,0 +1,32 @@
+/*
+	Copyright 2021 Marvin Damschen	marvin.damschen@ri.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DRIVE_H_
+#define DRIVE_H_
+
+#include "datatypes.h"
+
+// Functions
+void drive_set_speed(float speed);
+void drive_set_current(float current);
+void drive_set_duty(float duty);
+void drive_set_current_brake(float current);
+int drive_wheel_num(void);
+int drive_wheel_index(uint8_t vesc_id);
+float drive_get_steering_angle(void);
+
+#endif /* DRIVE_H_ */
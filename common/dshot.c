@@ -0,0 +1,273 @@
+/*
+	Copyright 2021 Marvin Damschen	marvin.damschen@ri.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "dshot.h"
+#include "dshot_encode.h"
+#include "ch.h"
+#include "hal.h"
+
+#include <string.h>
+#include <stddef.h>
+
+/*
+ * DShot600 on the four servo outputs, for ESCs that support it.
+ *
+ * TIM9 has no DMA request, so the outputs are driven by other timers on
+ * the same pins: SERVO0/1 (PB0/PB1) by TIM1_CH2N/CH3N and SERVO2/3
+ * (PA2/PA3) by TIM5_CH3/CH4. Every update event of a timer triggers a DMA
+ * burst through TIMx_DMAR that loads the next bit of both of its channels
+ * into CCRx, so a frame goes out without CPU involvement. Frames are sent
+ * on dshot_update and repeated by a virtual timer when no update comes,
+ * since ESCs disarm without a signal. If a DMA stream is taken by another
+ * driver the outputs stay low and nothing is sent.
+ *
+ * The frame is built in dshot_encode.h. 1.67 us per bit, a one is high
+ * for 75 % of the bit and a zero for 37.5 %.
+ */
+
+// Settings
+#define TIM_CLOCK				42000000 // Hz, divides both timer clocks
+#define BIT_RATE				600000 // Hz
+#define BIT_TICKS				(TIM_CLOCK / BIT_RATE)
+#define BIT_1_TICKS				((BIT_TICKS * 3) / 4)
+#define BIT_0_TICKS				((BIT_TICKS * 3) / 8)
+#define FRAME_BITS				16
+#define FRAME_SLOTS				(FRAME_BITS + 2) // Low slots at the end hold the line low
+#define KEEPALIVE_MS			2
+#define CHANNELS				4
+#define ALL_CHANNELS			0xFF
+
+// Private types
+typedef struct {
+	stm32_tim_t *tim;
+	uint32_t dma_id;
+	uint32_t dma_chn;
+	const stm32_dma_stream_t *dma;
+	uint32_t buffer[FRAME_SLOTS][2]; // Two CCRs per update event
+} dshot_timer;
+
+// Private variables
+static dshot_timer m_timers[2] = {
+		{STM32_TIM1, STM32_DMA_STREAM_ID(2, 5), 6, NULL, {{0}}}, // TIM1_UP
+		{STM32_TIM5, STM32_DMA_STREAM_ID(1, 0), 6, NULL, {{0}}} // TIM5_UP
+};
+static uint16_t m_values[CHANNELS];
+static bool m_ready;
+static bool m_safety_stop;
+static systime_t m_last_frame;
+static virtual_timer_t m_keepalive_vt;
+
+// Private functions
+static bool timer_init(dshot_timer *t, uint32_t timclk);
+static void send_frame_i(void);
+static void keepalive_cb(void *arg);
+
+/**
+ * Start the outputs.
+ *
+ * @return
+ * false if a DMA stream is used by another driver. The outputs are held
+ * low then and the other functions do nothing.
+ */
+bool dshot_init(void) {
+	memset(m_values, 0, sizeof(m_values));
+	m_ready = false;
+	m_safety_stop = false;
+	m_last_frame = 0;
+
+	palSetLineMode(LINE_SERVO0, PAL_MODE_ALTERNATE(1) | PAL_STM32_OSPEED_HIGHEST);
+	palSetLineMode(LINE_SERVO1, PAL_MODE_ALTERNATE(1) | PAL_STM32_OSPEED_HIGHEST);
+	palSetLineMode(LINE_SERVO2, PAL_MODE_ALTERNATE(2) | PAL_STM32_OSPEED_HIGHEST);
+	palSetLineMode(LINE_SERVO3, PAL_MODE_ALTERNATE(2) | PAL_STM32_OSPEED_HIGHEST);
+
+	rccEnableTIM1(true);
+	rccResetTIM1();
+	rccEnableTIM5(true);
+	rccResetTIM5();
+
+	// TIM1: CH2N and CH3N, burst to CCR2 and CCR3
+	stm32_tim_t *tim = m_timers[0].tim;
+	tim->CCMR1 = STM32_TIM_CCMR1_OC2M(6) | STM32_TIM_CCMR1_OC2PE;
+	tim->CCMR2 = STM32_TIM_CCMR2_OC3M(6) | STM32_TIM_CCMR2_OC3PE;
+	tim->CCER = STM32_TIM_CCER_CC2NE | STM32_TIM_CCER_CC3NE;
+	tim->BDTR = STM32_TIM_BDTR_MOE;
+	tim->DCR = STM32_TIM_DCR_DBA(offsetof(stm32_tim_t, CCR[1]) / 4) | STM32_TIM_DCR_DBL(1);
+	bool ok = timer_init(&m_timers[0], STM32_TIMCLK2);
+
+	// TIM5: CH3 and CH4, burst to CCR3 and CCR4
+	tim = m_timers[1].tim;
+	tim->CCMR2 = STM32_TIM_CCMR2_OC3M(6) | STM32_TIM_CCMR2_OC3PE |
+			STM32_TIM_CCMR2_OC4M(6) | STM32_TIM_CCMR2_OC4PE;
+	tim->CCER = STM32_TIM_CCER_CC3E | STM32_TIM_CCER_CC4E;
+	tim->DCR = STM32_TIM_DCR_DBA(offsetof(stm32_tim_t, CCR[2]) / 4) | STM32_TIM_DCR_DBL(1);
+	ok = timer_init(&m_timers[1], STM32_TIMCLK1) && ok;
+
+	if (!ok) {
+		for (int i = 0;i < 2;i++) {
+			m_timers[i].tim->CR1 = 0;
+			if (m_timers[i].dma != NULL) {
+				dmaStreamFree(m_timers[i].dma);
+				m_timers[i].dma = NULL;
+			}
+		}
+
+		rccDisableTIM1();
+		rccDisableTIM5();
+
+		palClearLine(LINE_SERVO0);
+		palClearLine(LINE_SERVO1);
+		palClearLine(LINE_SERVO2);
+		palClearLine(LINE_SERVO3);
+		palSetLineMode(LINE_SERVO0, PAL_MODE_OUTPUT_PUSHPULL);
+		palSetLineMode(LINE_SERVO1, PAL_MODE_OUTPUT_PUSHPULL);
+		palSetLineMode(LINE_SERVO2, PAL_MODE_OUTPUT_PUSHPULL);
+		palSetLineMode(LINE_SERVO3, PAL_MODE_OUTPUT_PUSHPULL);
+
+		return false;
+	}
+
+	m_ready = true;
+	chVTObjectInit(&m_keepalive_vt);
+
+	chSysLock();
+	send_frame_i();
+	chVTSetI(&m_keepalive_vt, TIME_MS2I(KEEPALIVE_MS), keepalive_cb, NULL);
+	chSysUnlock();
+
+	return true;
+}
+
+/**
+ * Set the throttle of a channel. Takes effect with the next frame, call
+ * dshot_update after setting all channels to send it right away.
+ *
+ * @param channel
+ * Channel to use
+ * Range: [0 - 3]
+ * 0xFF: All Channels
+ *
+ * @param throttle
+ * Throttle, 0.0 stops the motor.
+ * Range: [0.0 - 1.0]
+ */
+void dshot_set(uint8_t channel, float throttle) {
+	uint16_t value = dshot_encode_throttle(throttle);
+
+	for (uint8_t i = 0;i < CHANNELS;i++) {
+		if (channel == i || channel == ALL_CHANNELS) {
+			m_values[i] = value;
+		}
+	}
+}
+
+void dshot_set_all(float throttle) {
+	dshot_set(ALL_CHANNELS, throttle);
+}
+
+/**
+ * Send a frame with the current throttle values. Skipped if the previous
+ * frame is still going out, the keepalive timer sends the values then.
+ */
+void dshot_update(void) {
+	if (!m_ready) {
+		return;
+	}
+
+	chSysLock();
+	send_frame_i();
+	chSysUnlock();
+}
+
+void dshot_safety_stop(void) {
+	m_safety_stop = true;
+	dshot_update();
+}
+
+void dshot_reset_safety_stop(void) {
+	m_safety_stop = false;
+}
+
+static bool timer_init(dshot_timer *t, uint32_t timclk) {
+	stm32_tim_t *tim = t->tim;
+
+	// osalDbgAssert is compiled out in release builds, so check here
+	t->dma = dmaStreamAlloc(t->dma_id, 7, NULL, NULL);
+	if (t->dma == NULL) {
+		return false;
+	}
+	dmaStreamSetPeripheral(t->dma, &tim->DMAR);
+
+	tim->PSC = timclk / TIM_CLOCK - 1;
+	tim->ARR = BIT_TICKS - 1;
+	for (int i = 0;i < 4;i++) {
+		tim->CCR[i] = 0;
+	}
+	tim->DIER = STM32_TIM_DIER_UDE;
+	tim->EGR = STM32_TIM_EGR_UG;
+	tim->CR1 = STM32_TIM_CR1_ARPE | STM32_TIM_CR1_CEN;
+
+	return true;
+}
+
+static void send_frame_i(void) {
+	uint16_t packets[CHANNELS];
+	for (int i = 0;i < CHANNELS;i++) {
+		packets[i] = dshot_encode_packet(m_safety_stop ? 0 : m_values[i], false);
+	}
+
+	for (int t = 0;t < 2;t++) {
+		dshot_timer *timer = &m_timers[t];
+
+		if (timer->dma->stream->CR & STM32_DMA_CR_EN) {
+			continue;
+		}
+
+		for (int bit = 0;bit < FRAME_BITS;bit++) {
+			for (int c = 0;c < 2;c++) {
+				bool one = packets[t * 2 + c] & (0x8000 >> bit);
+				timer->buffer[bit][c] = one ? BIT_1_TICKS : BIT_0_TICKS;
+			}
+		}
+
+		for (int bit = FRAME_BITS;bit < FRAME_SLOTS;bit++) {
+			timer->buffer[bit][0] = 0;
+			timer->buffer[bit][1] = 0;
+		}
+
+		dmaStreamSetMemory0(timer->dma, timer->buffer);
+		dmaStreamSetTransactionSize(timer->dma, FRAME_SLOTS * 2);
+		dmaStreamSetMode(timer->dma, STM32_DMA_CR_CHSEL(timer->dma_chn) |
+				STM32_DMA_CR_DIR_M2P | STM32_DMA_CR_MINC |
+				STM32_DMA_CR_PSIZE_WORD | STM32_DMA_CR_MSIZE_WORD |
+				STM32_DMA_CR_PL(3));
+		dmaStreamClearInterrupt(timer->dma);
+		dmaStreamEnable(timer->dma);
+	}
+
+	m_last_frame = chVTGetSystemTimeX();
+}
+
+static void keepalive_cb(void *arg) {
+	(void)arg;
+
+	chSysLockFromISR();
+	if (chVTTimeElapsedSinceX(m_last_frame) >= TIME_MS2I(KEEPALIVE_MS)) {
+		send_frame_i();
+	}
+	chVTSetI(&m_keepalive_vt, TIME_MS2I(KEEPALIVE_MS), keepalive_cb, NULL);
+	chSysUnlockFromISR();
+}
@@ -0,0 +1,32 @@
+/*
+	Copyright 2021 Marvin Damschen	marvin.damschen@ri.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DSHOT_H_
+#define DSHOT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Functions
+bool dshot_init(void);
+void dshot_set(uint8_t channel, float throttle);
+void dshot_set_all(float throttle);
+void dshot_update(void);
+void dshot_safety_stop(void);
+void dshot_reset_safety_stop(void);
+
+#endif /* DSHOT_H_ */
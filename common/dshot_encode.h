@@ -0,0 +1,67 @@
+/*
+	Copyright 2021 Marvin Damschen	marvin.damschen@ri.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DSHOT_ENCODE_H_
+#define DSHOT_ENCODE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * DShot frame encoding. Kept free of hal.h so that the host tests can
+ * check it against reference frames.
+ *
+ * Frame: 11 bit value (0 stops the motor, 48 - 2047 is throttle),
+ * telemetry request bit and 4 bit checksum, sent MSB first.
+ */
+
+// Settings
+#define DSHOT_THROTTLE_MIN		48
+#define DSHOT_THROTTLE_MAX		2047
+
+/**
+ * Map a throttle to a DShot value.
+ *
+ * @param throttle
+ * Throttle, truncated to [0.0 - 1.0]. 0.0 stops the motor.
+ *
+ * @return
+ * 0 or a value in [DSHOT_THROTTLE_MIN - DSHOT_THROTTLE_MAX].
+ */
+static inline uint16_t dshot_encode_throttle(float throttle) {
+	if (!(throttle > 0.0f)) {
+		return 0;
+	}
+
+	if (throttle > 1.0f) {
+		throttle = 1.0f;
+	}
+
+	return DSHOT_THROTTLE_MIN +
+			(uint16_t)(throttle * (float)(DSHOT_THROTTLE_MAX - DSHOT_THROTTLE_MIN));
+}
+
+/**
+ * Build the 16 bit frame for a value.
+ */
+static inline uint16_t dshot_encode_packet(uint16_t value, bool telemetry) {
+	uint16_t packet = (uint16_t)((value << 1) | (telemetry ? 1 : 0));
+	uint16_t csum = (packet ^ (packet >> 4) ^ (packet >> 8)) & 0x0F;
+	return (uint16_t)((packet << 4) | csum);
+}
+
+#endif /* DSHOT_ENCODE_H_ */
@@ -0,0 +1,370 @@
+/*
+	Copyright 2021 Marvin Damschen	marvin.damschen@ri.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "conf_store.h"
+#include "eeprom.h"
+#include "crc.h"
+#include "terminal.h"
+
+#include <string.h>
+
+/*
+ * Versioned configuration records in the two flash sectors that used to
+ * hold the EEPROM emulation pages.
+ *
+ * Records are appended to the active sector. Each record is a header and
+ * the data, programmed a word at a time: the size first, the magic last. A
+ * record without magic is skipped on load, so a power loss during a save
+ * leaves the previous record in place. When the active sector is full the
+ * other sector is erased and the next record starts there, the old sector
+ * still holds the previous records until that point.
+ *
+ * The newest record is the valid one with the highest sequence number.
+ * Rollback clears the magic of the newest record, which makes the one
+ * before it the newest again.
+ */
+
+// Settings
+#define CONF_STORE_MAGIC			0xC0F1B10Bu
+#define CONF_STORE_SECTORS			2
+
+// Private types
+typedef struct {
+	uint32_t magic; // written last, marks the record as complete
+	uint32_t size_version; // written first, size in the low half
+	uint32_t seq;
+	uint32_t crc;
+} conf_store_header;
+
+typedef struct {
+	int sector;
+	uint32_t offset;
+	uint32_t seq;
+} record_pos;
+
+// Private variables
+static const uint32_t m_sector_addr[CONF_STORE_SECTORS] = {PAGE0_BASE_ADDRESS, PAGE1_BASE_ADDRESS};
+static const uint16_t m_sector_id[CONF_STORE_SECTORS] = {PAGE0_ID, PAGE1_ID};
+static uint32_t m_saves;
+static uint32_t m_save_fails;
+static uint32_t m_erases;
+static uint32_t m_last_len;
+
+// Private functions
+static bool conf_store_save_record(const void *data, uint32_t size, uint32_t version);
+static const conf_store_header *record_header(int sector, uint32_t offset);
+static uint32_t record_len(const conf_store_header *h);
+static uint32_t scan_sector(int sector, record_pos *newest);
+static bool find_newest(record_pos *newest);
+static bool sector_is_erased(int sector);
+static bool write_record(int sector, uint32_t offset, uint32_t seq,
+		const void *data, uint32_t size, uint32_t version);
+static void terminal_conf_store(int argc, const char **argv);
+
+void conf_store_init(void) {
+	terminal_register_command_callback(
+			"conf_store",
+			"Print information about the stored configuration. rollback drops the newest\n"
+			"record, reboot to use the one before it.",
+			"[rollback]",
+			terminal_conf_store);
+}
+
+/**
+ * Get the size and version of the newest valid record.
+ *
+ * @return
+ * false if there is no valid record.
+ */
+bool conf_store_newest(uint32_t *size, uint32_t *version) {
+	record_pos pos;
+
+	if (!find_newest(&pos)) {
+		return false;
+	}
+
+	const conf_store_header *h = record_header(pos.sector, pos.offset);
+	*size = h->size_version & 0xFFFF;
+	*version = h->size_version >> 16;
+	return true;
+}
+
+/**
+ * Copy the newest valid record to data. If the record is shorter than size
+ * the rest of data is left untouched, which keeps the defaults of fields
+ * that were appended after the record was written.
+ *
+ * @return
+ * The number of bytes copied, or -1 if there is no valid record.
+ */
+int conf_store_load(void *data, uint32_t size) {
+	record_pos pos;
+
+	if (!find_newest(&pos)) {
+		return -1;
+	}
+
+	const conf_store_header *h = record_header(pos.sector, pos.offset);
+	uint32_t len = h->size_version & 0xFFFF;
+	if (len > size) {
+		len = size;
+	}
+
+	memcpy(data, h + 1, len);
+	return len;
+}
+
+/**
+ * Store data as a new record. Can take long and stall the CPU when a
+ * sector has to be erased.
+ */
+bool conf_store_save(const void *data, uint32_t size, uint32_t version) {
+	bool res = conf_store_save_record(data, size, version);
+
+	m_saves++;
+	if (!res) {
+		m_save_fails++;
+	}
+
+	return res;
+}
+
+static bool conf_store_save_record(const void *data, uint32_t size, uint32_t version) {
+	record_pos newest;
+	bool found = find_newest(&newest);
+	uint32_t len = sizeof(conf_store_header) + ((size + 3) & ~3);
+
+	if (size > 0xFFFF || len > PAGE_SIZE) {
+		return false;
+	}
+
+	m_last_len = len;
+
+	FLASH_ClearFlag(FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR |
+			FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
+
+	if (found) {
+		uint32_t end = scan_sector(newest.sector, NULL);
+		if (end + len <= PAGE_SIZE) {
+			return write_record(newest.sector, end, newest.seq + 1, data, size, version);
+		}
+	}
+
+	int sector = 0;
+	if (found) {
+		sector = newest.sector == 0 ? 1 : 0;
+	} else {
+		// Keep the EEPROM emulation valid page intact as long as possible
+		if (sector_is_erased(1) || (*(__IO uint16_t*)m_sector_addr[0]) == VALID_PAGE) {
+			sector = 1;
+		}
+	}
+
+	if (!sector_is_erased(sector)) {
+		m_erases++;
+		if (FLASH_EraseSector(m_sector_id[sector], VOLTAGE_RANGE) != FLASH_COMPLETE) {
+			return false;
+		}
+	}
+
+	return write_record(sector, 0, found ? newest.seq + 1 : 1, data, size, version);
+}
+
+/**
+ * Invalidate the newest record.
+ *
+ * @return
+ * true if an older valid record is left.
+ */
+bool conf_store_rollback(void) {
+	record_pos pos;
+
+	if (!find_newest(&pos)) {
+		return false;
+	}
+
+	FLASH_ClearFlag(FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR |
+			FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
+
+	const conf_store_header *h = record_header(pos.sector, pos.offset);
+	FLASH_ProgramWord((uint32_t)&h->magic, 0);
+
+	return find_newest(&pos);
+}
+
+static const conf_store_header *record_header(int sector, uint32_t offset) {
+	return (const conf_store_header*)(m_sector_addr[sector] + offset);
+}
+
+static uint32_t record_len(const conf_store_header *h) {
+	return sizeof(conf_store_header) + (((h->size_version & 0xFFFF) + 3) & ~3);
+}
+
+/*
+ * Walk the records of a sector and return the offset of the free space
+ * after them. newest is updated if a valid record with a higher sequence
+ * number is found.
+ */
+static uint32_t scan_sector(int sector, record_pos *newest) {
+	uint32_t offset = 0;
+
+	while (offset + sizeof(conf_store_header) <= PAGE_SIZE) {
+		const conf_store_header *h = record_header(sector, offset);
+
+		if (h->size_version == 0xFFFFFFFF) {
+			break;
+		}
+
+		uint32_t len = record_len(h);
+		if (offset + len > PAGE_SIZE) {
+			// Not a record, e.g. an old EEPROM emulation page
+			return PAGE_SIZE;
+		}
+
+		if (newest && h->magic == CONF_STORE_MAGIC &&
+				(newest->sector < 0 || h->seq > newest->seq) &&
+				h->crc == crc16((unsigned char*)(h + 1), h->size_version & 0xFFFF)) {
+			newest->sector = sector;
+			newest->offset = offset;
+			newest->seq = h->seq;
+		}
+
+		offset += len;
+	}
+
+	return offset;
+}
+
+static bool find_newest(record_pos *newest) {
+	newest->sector = -1;
+	newest->offset = 0;
+	newest->seq = 0;
+
+	for (int i = 0;i < CONF_STORE_SECTORS;i++) {
+		scan_sector(i, newest);
+	}
+
+	return newest->sector >= 0;
+}
+
+static bool sector_is_erased(int sector) {
+	const uint32_t *addr = (const uint32_t*)m_sector_addr[sector];
+
+	for (unsigned int i = 0;i < PAGE_SIZE / 4;i++) {
+		if (addr[i] != 0xFFFFFFFF) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static bool write_record(int sector, uint32_t offset, uint32_t seq,
+		const void *data, uint32_t size, uint32_t version) {
+	const conf_store_header *h = record_header(sector, offset);
+	const uint8_t *src = (const uint8_t*)data;
+	uint32_t dst = (uint32_t)(h + 1);
+
+	if (FLASH_ProgramWord((uint32_t)&h->size_version, size | (version << 16)) != FLASH_COMPLETE ||
+			FLASH_ProgramWord((uint32_t)&h->seq, seq) != FLASH_COMPLETE ||
+			FLASH_ProgramWord((uint32_t)&h->crc, crc16((unsigned char*)src, size)) != FLASH_COMPLETE) {
+		return false;
+	}
+
+	for (uint32_t i = 0;i < size;i += 4) {
+		uint32_t word = 0xFFFFFFFF;
+		memcpy(&word, src + i, size - i < 4 ? size - i : 4);
+
+		if (FLASH_ProgramWord(dst, word) != FLASH_COMPLETE) {
+			return false;
+		}
+		dst += 4;
+	}
+
+	// Verify before committing
+	if (memcmp(h + 1, data, size) != 0) {
+		return false;
+	}
+
+	return FLASH_ProgramWord((uint32_t)&h->magic, CONF_STORE_MAGIC) == FLASH_COMPLETE;
+}
+
+static void terminal_conf_store(int argc, const char **argv) {
+	if (argc == 2) {
+		if (strcmp(argv[1], "rollback") == 0) {
+			if (conf_store_rollback()) {
+				terminal_printf("Newest record dropped, reboot to load the previous one\n");
+			} else {
+				terminal_printf("No older record left, defaults are used after reboot\n");
+			}
+		} else {
+			terminal_printf("Invalid argument %s\n", argv[1]);
+		}
+		return;
+	} else if (argc != 1) {
+		terminal_printf("Wrong number of arguments\n");
+		return;
+	}
+
+	for (int i = 0;i < CONF_STORE_SECTORS;i++) {
+		int records = 0, valid = 0;
+		uint32_t offset = 0;
+
+		while (offset + sizeof(conf_store_header) <= PAGE_SIZE) {
+			const conf_store_header *h = record_header(i, offset);
+			if (h->size_version == 0xFFFFFFFF || offset + record_len(h) > PAGE_SIZE) {
+				break;
+			}
+
+			records++;
+			if (h->magic == CONF_STORE_MAGIC) {
+				valid++;
+			}
+			offset += record_len(h);
+		}
+
+		terminal_printf("Sector %d: %d records, %d with magic, %lu of %lu bytes used",
+				i, records, valid, scan_sector(i, NULL), PAGE_SIZE);
+	}
+
+	record_pos pos;
+	if (find_newest(&pos)) {
+		const conf_store_header *h = record_header(pos.sector, pos.offset);
+		terminal_printf("Newest:   sector %d offset %lu seq %lu size %lu version %lu",
+				pos.sector, pos.offset, pos.seq,
+				h->size_version & 0xFFFF, h->size_version >> 16);
+	} else {
+		terminal_printf("Newest:   none");
+	}
+
+	// Erasing a 16k sector stalls the firmware for a few hundred milliseconds.
+	// The expected rate follows from the record size, the measured one is
+	// counted since boot. test/conf_store_bench measures it on the host.
+	if (m_last_len > 0) {
+		uint32_t per_sector = PAGE_SIZE / m_last_len;
+		terminal_printf("Wear:     %lu byte records, %lu per sector, expected %.1f erases per 1000 saves",
+				m_last_len, per_sector, (double)(1000.0 / (float)per_sector));
+	}
+	terminal_printf("Saves:    %lu since boot, %lu failed, %lu sector erases",
+			m_saves, m_save_fails, m_erases);
+	if (m_saves > 0) {
+		terminal_printf("Measured: %.1f erases per 1000 saves since boot",
+				(double)(1000.0 * (float)m_erases / (float)m_saves));
+	}
+
+	terminal_printf(" ");
+}
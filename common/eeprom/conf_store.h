@@ -0,0 +1,31 @@
+/*
+	Copyright 2021 Marvin Damschen	marvin.damschen@ri.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CONF_STORE_H_
+#define CONF_STORE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Functions
+void conf_store_init(void);
+bool conf_store_newest(uint32_t *size, uint32_t *version);
+int conf_store_load(void *data, uint32_t size);
+bool conf_store_save(const void *data, uint32_t size, uint32_t version);
+bool conf_store_rollback(void);
+
+#endif /* CONF_STORE_H_ */
@@ -123,7 +123,7 @@ uint16_t EE_Init(void)
 				return FlashStatus;
 			}
 		}
-		else if (PageStatus1 == RECEIVE_DATA) /* Page0 erased, Page1 receive */
+		else if (PageStatus1 != ERASED) /* Page0 erased, Page1 receive or torn while being marked valid */
 		{
 			/* Erase Page0 */
 			FlashStatus = EE_EraseSectorIfNotEmpty(PAGE0_ID, VOLTAGE_RANGE);
@@ -140,7 +140,7 @@ uint16_t EE_Init(void)
 				return FlashStatus;
 			}
 		}
-		else /* First EEPROM access (Page0&1 are erased) or invalid state -> format EEPROM */
+		else /* First EEPROM access (Page0&1 are erased) -> format EEPROM */
 		{
 			/* Erase both Page0 and Page1 and set Page0 as valid page */
 			FlashStatus = EE_Format();
@@ -194,7 +194,7 @@ uint16_t EE_Init(void)
 				return FlashStatus;
 			}
 		}
-		else if (PageStatus1 == ERASED) /* Page0 receive, Page1 erased */
+		else if (PageStatus1 != RECEIVE_DATA) /* Page0 receive, Page1 erased or torn by an interrupted erase */
 		{
 			/* Erase Page1 */
 			FlashStatus = EE_EraseSectorIfNotEmpty(PAGE1_ID, VOLTAGE_RANGE);
@@ -234,7 +234,7 @@ uint16_t EE_Init(void)
 				return FlashStatus;
 			}
 		}
-		else if (PageStatus1 == ERASED) /* Page0 valid, Page1 erased */
+		else if (PageStatus1 != RECEIVE_DATA) /* Page0 valid, Page1 erased or torn before receiving data */
 		{
 			/* Erase Page1 */
 			FlashStatus = EE_EraseSectorIfNotEmpty(PAGE1_ID, VOLTAGE_RANGE);
@@ -287,13 +287,53 @@ uint16_t EE_Init(void)
 		}
 		break;
 
-	default:  /* Any other state -> format eeprom */
-		/* Erase both Page0 and Page1 and set Page0 as valid page */
-		FlashStatus = EE_Format();
-		/* If erase/program operation was failed, a Flash error code is returned */
-		if (FlashStatus != FLASH_COMPLETE)
+	default:  /* Page0 status torn by power loss during a program or erase */
+		if (PageStatus1 == VALID_PAGE) /* Page0 torn before receiving data, Page1 valid */
 		{
-			return FlashStatus;
+			/* Erase Page0 */
+			FlashStatus = EE_EraseSectorIfNotEmpty(PAGE0_ID, VOLTAGE_RANGE);
+			/* If erase operation was failed, a Flash error code is returned */
+			if (FlashStatus != FLASH_COMPLETE)
+			{
+				return FlashStatus;
+			}
+		}
+		else if (PageStatus1 == ERASED) /* Page0 torn while being marked valid, Page1 erased */
+		{
+			/* Mark Page0 as valid */
+			FlashStatus = FLASH_ProgramHalfWord(PAGE0_BASE_ADDRESS, VALID_PAGE);
+			/* If program operation was failed, a Flash error code is returned */
+			if (FlashStatus != FLASH_COMPLETE)
+			{
+				return FlashStatus;
+			}
+		}
+		else if (PageStatus1 == RECEIVE_DATA) /* Page0 torn by an interrupted erase, Page1 receive */
+		{
+			/* Erase Page0 */
+			FlashStatus = EE_EraseSectorIfNotEmpty(PAGE0_ID, VOLTAGE_RANGE);
+			/* If erase operation was failed, a Flash error code is returned */
+			if (FlashStatus != FLASH_COMPLETE)
+			{
+				return FlashStatus;
+			}
+			/* Mark Page1 as valid */
+			FlashStatus = FLASH_ProgramHalfWord(PAGE1_BASE_ADDRESS, VALID_PAGE);
+			/* If program operation was failed, a Flash error code is returned */
+			if (FlashStatus != FLASH_COMPLETE)
+			{
+				return FlashStatus;
+			}
+		}
+		else /* Both torn, invalid state -> format eeprom */
+		{
+			/* Erase both Page0 and Page1 and set Page0 as valid page */
+			FlashStatus = EE_Format();
+			/* If erase/program operation was failed, a Flash error code is returned */
+			if (FlashStatus != FLASH_COMPLETE)
+			{
+				return FlashStatus;
+			}
 		}
 		break;
 	}
@@ -1,7 +1,8 @@
 
 include $(COMMONDIR)/eeprom/stdperiph_stm32f4/stm32lib.mk
 
-EEPROMSRC =    $(COMMONDIR)/eeprom/eeprom.c
+EEPROMSRC =    $(COMMONDIR)/eeprom/eeprom.c \
+               $(COMMONDIR)/eeprom/conf_store.c
 
 EEPROMINC =    $(COMMONDIR)/eeprom
 
@@ -27,6 +27,15 @@
 // Private functions
 static float invSqrt(float x);
 static float calculateAccConfidence(float accMag, float *accMagP);
+static float fast_asin(float x);
+
+#if AHRS_FAST_MATH
+#define AHRS_ATAN2(y, x)		utils_fast_atan2(y, x)
+#define AHRS_ASIN(x)			fast_asin(x)
+#else
+#define AHRS_ATAN2(y, x)		atan2f(y, x)
+#define AHRS_ASIN(x)			asinf(x)
+#endif
 
 static float calculateAccConfidence(float accMag, float *accMagP) {
 	// G.K. Egan (C) computes confidence in accelerometers when
@@ -525,7 +534,7 @@ float ahrs_get_roll(ATTITUDE_INFO *att) {
 	const float q2 = att->q2;
 	const float q3 = att->q3;
 
-	return -atan2f(q0 * q1 + q2 * q3, 0.5 - (q1 * q1 + q2 * q2));
+	return -AHRS_ATAN2(q0 * q1 + q2 * q3, 0.5f - (q1 * q1 + q2 * q2));
 }
 
 float ahrs_get_pitch(ATTITUDE_INFO *att) {
@@ -534,7 +543,9 @@ float ahrs_get_pitch(ATTITUDE_INFO *att) {
 	const float q2 = att->q2;
 	const float q3 = att->q3;
 
-	return asinf(-2.0 * (q1 * q3 - q0 * q2));
+	float s = -2.0f * (q1 * q3 - q0 * q2);
+	utils_truncate_number(&s, -1.0, 1.0);
+	return AHRS_ASIN(s);
 }
 
 float ahrs_get_yaw(ATTITUDE_INFO *att) {
@@ -543,19 +554,49 @@ float ahrs_get_yaw(ATTITUDE_INFO *att) {
 	const float q2 = att->q2;
 	const float q3 = att->q3;
 
-	return -atan2f(q0 * q3 + q1 * q2, 0.5 - (q2 * q2 + q3 * q3));
+	return -AHRS_ATAN2(q0 * q3 + q1 * q2, 0.5f - (q2 * q2 + q3 * q3));
 }
 
 void ahrs_get_roll_pitch_yaw(float *rpy, ATTITUDE_INFO *att) {
+#if AHRS_FAST_MATH
+	ahrs_get_roll_pitch_yaw_fast(rpy, att);
+#else
+	ahrs_get_roll_pitch_yaw_precise(rpy, att);
+#endif
+}
+
+void ahrs_get_roll_pitch_yaw_precise(float *rpy, ATTITUDE_INFO *att) {
 	// See http://math.stackexchange.com/questions/687964/getting-euler-tait-bryan-angles-from-quaternion-representation
 	const float q0 = att->q0;
 	const float q1 = att->q1;
 	const float q2 = att->q2;
 	const float q3 = att->q3;
 
-	rpy[0] = -atan2f(q0 * q1 + q2 * q3, 0.5 - (q1 * q1 + q2 * q2));
-	rpy[1] = asinf(-2.0 * (q1 * q3 - q0 * q2));
-	rpy[2] = -atan2f(q0 * q3 + q1 * q2, 0.5 - (q2 * q2 + q3 * q3));
+	float s = -2.0f * (q1 * q3 - q0 * q2);
+	utils_truncate_number(&s, -1.0, 1.0);
+
+	rpy[0] = -atan2f(q0 * q1 + q2 * q3, 0.5f - (q1 * q1 + q2 * q2));
+	rpy[1] = asinf(s);
+	rpy[2] = -atan2f(q0 * q3 + q1 * q2, 0.5f - (q2 * q2 + q3 * q3));
+}
+
+void ahrs_get_roll_pitch_yaw_fast(float *rpy, ATTITUDE_INFO *att) {
+	const float q0 = att->q0;
+	const float q1 = att->q1;
+	const float q2 = att->q2;
+	const float q3 = att->q3;
+
+	float s = -2.0f * (q1 * q3 - q0 * q2);
+	utils_truncate_number(&s, -1.0, 1.0);
+
+	rpy[0] = -utils_fast_atan2(q0 * q1 + q2 * q3, 0.5f - (q1 * q1 + q2 * q2));
+	rpy[1] = fast_asin(s);
+	rpy[2] = -utils_fast_atan2(q0 * q3 + q1 * q2, 0.5f - (q2 * q2 + q3 * q3));
+}
+
+static float fast_asin(float x) {
+	// sqrtf is a single FPU instruction
+	return utils_fast_atan2(x, sqrtf(1.0f - x * x));
 }
 
 static float invSqrt(float x) {
@@ -15,6 +15,13 @@
 
 #include "datatypes.h"
 
+// Use approximations of atan2, asin, sin and cos when extracting angles and
+// in the tilt compensation. The angles are within 0.6 deg of libm, see
+// test/ahrs_replay.c. ahrs_bench reports error and speed on the board.
+#ifndef AHRS_FAST_MATH
+#define AHRS_FAST_MATH		0
+#endif
+
 // Function declarations
 void ahrs_init_attitude_info(ATTITUDE_INFO *att);
 void ahrs_update_initial_orientation(float *accelXYZ, float *magXYZ, ATTITUDE_INFO *att);
@@ -29,5 +36,7 @@ float ahrs_get_roll(ATTITUDE_INFO *att);
 float ahrs_get_pitch(ATTITUDE_INFO *att);
 float ahrs_get_yaw(ATTITUDE_INFO *att);
 void ahrs_get_roll_pitch_yaw(float *rpy, ATTITUDE_INFO *att);
+void ahrs_get_roll_pitch_yaw_precise(float *rpy, ATTITUDE_INFO *att);
+void ahrs_get_roll_pitch_yaw_fast(float *rpy, ATTITUDE_INFO *att);
 
 #endif
@@ -19,68 +19,230 @@
 
 #include "bmi160_wrapper.h"
 #include "conf_general.h"
+#include "prof.h"
+#include "latency.h"
+#include "terminal.h"
+#include "timebase.h"
 
 #include <stdio.h>
 #include <string.h>
 
+/*
+ * Sensor time runs at 25.6 kHz and samples are taken when it crosses a
+ * multiple of the ODR period. In FIFO mode the sensortime frame at the end
+ * of each batch is rounded down to the period to get the time of the newest
+ * frame, the older frames are one period apart. dt is the difference
+ * between consecutive sample times, so it follows the sensor clock and not
+ * the scheduling of this thread. The timebase stamp of the newest frame is
+ * the time of the FIFO read, the older frames are one period before it.
+ */
+#define SENSORTIME_TICK_S		(1.0 / 25600.0)
+#define SENSORTIME_MASK			0xFFFFFF
+#define FIFO_MAX_FRAMES			(1024 / 13 + 1)
+
+// 9 clocks per byte at 400 kHz is 22.5 us, twice that plus some margin
+// for the transaction timeout.
+#define I2C_BYTE_TIMEOUT_US		45
+#define I2C_BASE_TIMEOUT_MS		2
+
 // Threads
 static THD_FUNCTION(bmi_thread, arg);
 static THD_WORKING_AREA(bmi_thread_wa, 2048);
 
 // Private functions
 static bool reset_init_bmi(void);
+static void select_odr(int samp_rate_hz);
+static void handle_sample(struct bmi160_sensor_data *accel, struct bmi160_sensor_data *gyro,
+		float dt, uint32_t stamp, uint64_t time_us);
+static void bus_stats_add(uint32_t start, uint16_t bytes, bool ok);
+#ifdef BOARD_BMI160_I2CD
+static void i2c_recover_bus(void);
+#endif
+static void terminal_bus(int argc, const char **argv);
 void user_delay_ms(uint32_t ms);
 static int8_t user_i2c_read(uint8_t dev_addr, uint8_t reg_addr, uint8_t *data, uint16_t len);
 static int8_t user_i2c_write(uint8_t dev_addr, uint8_t reg_addr, uint8_t *data, uint16_t len);
 
 // Private
+#ifdef BOARD_BMI160_I2CD
+static const I2CConfig m_i2c_cfg = {
+		OPMODE_I2C,
+		400000,
+		FAST_DUTY_CYCLE_2
+};
+#else
 static i2c_bb_state m_i2c_bb;
-static void(*read_callback)(float *accel, float *gyro, float *mag) = 0;
+#endif
+static uint32_t m_bus_transactions;
+static uint32_t m_bus_errors;
+static uint32_t m_bus_bytes;
+static uint32_t m_bus_max_cycles;
+static uint64_t m_bus_cycles;
+static void(*read_callback)(float *accel, float *gyro, float *mag, float dt, uint64_t time_us) = 0;
+static void(*batch_callback)(float dt) = 0;
 static struct bmi160_dev sensor;
 static int rate_hz;
+static int m_odr_hz;
+static uint8_t m_accel_odr;
+static uint8_t m_gyro_odr;
+
+#if BMI160_USE_FIFO
+static struct bmi160_fifo_frame m_fifo;
+static uint8_t m_fifo_buf[1024 + BMI160_FIFO_BYTES_OVERREAD];
+static struct bmi160_sensor_data m_fifo_accel[FIFO_MAX_FRAMES];
+static struct bmi160_sensor_data m_fifo_gyro[FIFO_MAX_FRAMES];
+#ifdef LINE_BMI160_INT1
+static binary_semaphore_t m_fifo_sem;
+static void fifo_wm_cb(void *arg);
+#endif
+#endif
 
 void bmi160_wrapper_init(int samp_rate_hz) {
 	rate_hz = samp_rate_hz;
+	select_odr(samp_rate_hz);
 
+#ifdef BOARD_BMI160_I2CD
+	i2c_recover_bus();
+	i2cStart(&BOARD_BMI160_I2CD, &m_i2c_cfg);
+#else
 	m_i2c_bb.sda_gpio = PAL_PORT(LINE_SDA);
 	m_i2c_bb.sda_pin = PAL_PAD(LINE_SDA);
 	m_i2c_bb.scl_gpio = PAL_PORT(LINE_SCL);
 	m_i2c_bb.scl_pin = PAL_PAD(LINE_SCL);
 	i2c_bb_init(&m_i2c_bb);
+#endif
 
 	sensor.id = BMI160_I2C_ADDR;
 	sensor.interface = BMI160_I2C_INTF;
 	sensor.read = user_i2c_read;
 	sensor.write = user_i2c_write;
 
+#if BMI160_USE_FIFO && defined(LINE_BMI160_INT1)
+	chBSemObjectInit(&m_fifo_sem, true);
+	palSetLineMode(LINE_BMI160_INT1, PAL_MODE_INPUT_PULLDOWN);
+	palEnableLineEvent(LINE_BMI160_INT1, PAL_EVENT_MODE_RISING_EDGE);
+	palSetLineCallback(LINE_BMI160_INT1, fifo_wm_cb, NULL);
+#endif
+
 	if (reset_init_bmi()) {
 		chThdCreateStatic(bmi_thread_wa, sizeof(bmi_thread_wa),
 				NORMALPRIO, bmi_thread, NULL);
 	}
+
+	terminal_register_command_callback(
+			"bmi_bus",
+			"Print the BMI160 bus time per transaction. Use reset to clear the counters.",
+			"[reset]",
+			terminal_bus);
 }
 
+/**
+ * Set the function that gets the samples.
+ *
+ * @param func
+ * Called with accel in g, gyro in deg/s, mag (always zero), the time
+ * since the previous sample in seconds and the timebase time of the sample.
+ */
 void bmi160_wrapper_set_read_callback(
-		void(*func)(float *accel, float *gyro, float *mag)) {
+		void(*func)(float *accel, float *gyro, float *mag, float dt, uint64_t time_us)) {
 	read_callback = func;
 }
 
+/**
+ * Set a function to be called after the read callback has got all samples
+ * of a FIFO batch, or after every sample without the FIFO.
+ *
+ * @param func
+ * Called with the sum of the dt of the samples in the batch.
+ */
+void bmi160_wrapper_set_batch_callback(void(*func)(float dt)) {
+	batch_callback = func;
+}
+
+static void select_odr(int samp_rate_hz) {
+	// Highest ODR that does not exceed the requested rate
+	static const struct {
+		int hz;
+		uint8_t accel;
+		uint8_t gyro;
+	} odrs[] = {
+			{1600, BMI160_ACCEL_ODR_1600HZ, BMI160_GYRO_ODR_1600HZ},
+			{800, BMI160_ACCEL_ODR_800HZ, BMI160_GYRO_ODR_800HZ},
+			{400, BMI160_ACCEL_ODR_400HZ, BMI160_GYRO_ODR_400HZ},
+			{200, BMI160_ACCEL_ODR_200HZ, BMI160_GYRO_ODR_200HZ},
+			{100, BMI160_ACCEL_ODR_100HZ, BMI160_GYRO_ODR_100HZ},
+			{50, BMI160_ACCEL_ODR_50HZ, BMI160_GYRO_ODR_50HZ},
+			{25, BMI160_ACCEL_ODR_25HZ, BMI160_GYRO_ODR_25HZ}
+	};
+
+	unsigned int i = 0;
+	while (i < (sizeof(odrs) / sizeof(odrs[0]) - 1) && odrs[i].hz > samp_rate_hz) {
+		i++;
+	}
+
+	m_odr_hz = odrs[i].hz;
+	m_accel_odr = odrs[i].accel;
+	m_gyro_odr = odrs[i].gyro;
+}
+
 static bool reset_init_bmi(void) {
 	sensor.delay_ms = user_delay_ms;
 
 	bmi160_init(&sensor);
 
-	sensor.accel_cfg.odr = BMI160_ACCEL_ODR_200HZ;
+	sensor.accel_cfg.odr = m_accel_odr;
 	sensor.accel_cfg.range = BMI160_ACCEL_RANGE_16G;
 	sensor.accel_cfg.bw = BMI160_ACCEL_BW_NORMAL_AVG4;
 	sensor.accel_cfg.power = BMI160_ACCEL_NORMAL_MODE;
 
-	sensor.gyro_cfg.odr = BMI160_GYRO_ODR_200HZ;
+	sensor.gyro_cfg.odr = m_gyro_odr;
 	sensor.gyro_cfg.range = BMI160_GYRO_RANGE_2000_DPS;
 	sensor.gyro_cfg.bw = BMI160_GYRO_BW_NORMAL_MODE;
 	sensor.gyro_cfg.power = BMI160_GYRO_NORMAL_MODE;
 
 	int8_t res = bmi160_set_sens_conf(&sensor);
 
+#if BMI160_USE_FIFO
+	m_fifo.data = m_fifo_buf;
+	m_fifo.length = sizeof(m_fifo_buf);
+	sensor.fifo = &m_fifo;
+
+	if (res == BMI160_OK) {
+		res = bmi160_set_fifo_config(BMI160_FIFO_GYRO | BMI160_FIFO_ACCEL |
+				BMI160_FIFO_HEADER | BMI160_FIFO_TIME, BMI160_ENABLE, &sensor);
+	}
+
+#ifdef LINE_BMI160_INT1
+	// The watermark only matters with the interrupt, without INT1 the FIFO
+	// is read once per batch time.
+	if (res == BMI160_OK) {
+		// Unit is 4 bytes, a header frame with accel and gyro is 13 bytes.
+		// Round down so that the level is passed by the last frame of the
+		// batch, rounding up would need one more frame.
+		res = bmi160_set_fifo_wm((BMI160_FIFO_WM_FRAMES * 13) / 4, &sensor);
+	}
+
+	if (res == BMI160_OK) {
+		struct bmi160_int_settg int_cfg;
+		memset(&int_cfg, 0, sizeof(int_cfg));
+		int_cfg.int_channel = BMI160_INT_CHANNEL_1;
+		int_cfg.int_type = BMI160_ACC_GYRO_FIFO_WATERMARK_INT;
+		int_cfg.int_pin_settg.output_en = BMI160_ENABLE;
+		int_cfg.int_pin_settg.output_mode = 0; // Push-pull
+		int_cfg.int_pin_settg.output_type = 1; // Active high
+		int_cfg.int_pin_settg.edge_ctrl = 1;
+		int_cfg.int_pin_settg.input_en = 0;
+		int_cfg.int_pin_settg.latch_dur = BMI160_LATCH_DUR_NONE;
+		int_cfg.fifo_wtm_int_en = BMI160_ENABLE;
+		res = bmi160_set_int_config(&int_cfg, &sensor);
+	}
+#endif
+
+	if (res == BMI160_OK) {
+		res = bmi160_set_fifo_flush(&sensor);
+	}
+#endif
+
 	return res == BMI160_OK;
 }
 
@@ -88,15 +250,132 @@ void user_delay_ms(uint32_t ms) {
 	chThdSleepMilliseconds(ms);
 }
 
+static void handle_sample(struct bmi160_sensor_data *accel, struct bmi160_sensor_data *gyro,
+		float dt, uint32_t stamp, uint64_t time_us) {
+	float tmp_accel[3], tmp_gyro[3], tmp_mag[3];
+
+	tmp_accel[0] = (float)accel->x * 16.0 / 32768.0;
+	tmp_accel[1] = (float)accel->y * 16.0 / 32768.0;
+	tmp_accel[2] = (float)accel->z * 16.0 / 32768.0;
+
+	tmp_gyro[0] = (float)gyro->x * 2000.0 / 32768.0;
+	tmp_gyro[1] = (float)gyro->y * 2000.0 / 32768.0;
+	tmp_gyro[2] = (float)gyro->z * 2000.0 / 32768.0;
+
+	memset(tmp_mag, 0, sizeof(tmp_mag));
+
+	if (read_callback) {
+		latency_set_sample(LATENCY_SRC_IMU, stamp);
+		read_callback(tmp_accel, tmp_gyro, tmp_mag, dt, time_us);
+	}
+}
+
+#if BMI160_USE_FIFO
+
+#ifdef LINE_BMI160_INT1
+static void fifo_wm_cb(void *arg) {
+	(void)arg;
+	chSysLockFromISR();
+	chBSemSignalI(&m_fifo_sem);
+	chSysUnlockFromISR();
+}
+#endif
+
+static THD_FUNCTION(bmi_thread, arg) {
+	(void)arg;
+
+	chRegSetThreadName("BMI Sampling");
+
+	const float period = 1.0 / (float)m_odr_hz;
+	const uint32_t period_ticks = 25600 / m_odr_hz;
+	const uint32_t period_us = 1000000 / m_odr_hz;
+	const sysinterval_t batch_time = TIME_US2I(BMI160_FIFO_WM_FRAMES * 1000000 / m_odr_hz);
+	uint32_t time_last = 0;
+	bool time_last_valid = false;
+
+	for(;;) {
+#ifdef LINE_BMI160_INT1
+		// The timeout keeps the samples coming if an edge is missed
+		chBSemWaitTimeout(&m_fifo_sem, 2 * batch_time);
+#else
+		prof_sleep(batch_time);
+#endif
+
+		uint32_t stamp = latency_stamp();
+		uint64_t read_us = timebase_get_us();
+		m_fifo.length = sizeof(m_fifo_buf);
+		if (bmi160_get_fifo_data(&sensor) != BMI160_OK) {
+			// Whatever is left in the FIFO is stale now, and reading a full
+			// FIFO again right away is what is most likely to time out.
+			bmi160_set_fifo_flush(&sensor);
+			time_last_valid = false;
+			continue;
+		}
+
+		uint8_t accel_len = FIFO_MAX_FRAMES;
+		uint8_t gyro_len = FIFO_MAX_FRAMES;
+		bmi160_extract_accel(m_fifo_accel, &accel_len, &sensor);
+		bmi160_extract_gyro(m_fifo_gyro, &gyro_len, &sensor);
+
+		int frames = accel_len < gyro_len ? accel_len : gyro_len;
+		if (frames == 0) {
+			continue;
+		}
+
+		// The sensortime frame is only appended when the FIFO was read empty,
+		// and frames are dropped when it overflowed. Flush after an overflow
+		// so that the next batch starts from fresh samples.
+		bool time_valid = m_fifo.sensor_time != 0;
+		if (m_fifo.skipped_frame_count != 0) {
+			bmi160_set_fifo_flush(&sensor);
+			time_last_valid = false;
+		}
+
+		uint32_t time_newest = m_fifo.sensor_time & ~(period_ticks - 1);
+		float batch_dt = 0.0;
+
+		for (int i = 0;i < frames;i++) {
+			float dt = period;
+
+			if (time_valid) {
+				uint32_t t = (time_newest - (uint32_t)(frames - 1 - i) * period_ticks) & SENSORTIME_MASK;
+				if (time_last_valid) {
+					dt = (float)((t - time_last) & SENSORTIME_MASK) * SENSORTIME_TICK_S;
+					if (dt <= 0.0 || dt > 10.0 * period) {
+						dt = period;
+					}
+				}
+				time_last = t;
+			}
+
+			uint64_t time_us = read_us - (uint64_t)(frames - 1 - i) * period_us;
+			handle_sample(&m_fifo_accel[i], &m_fifo_gyro[i], dt, stamp, time_us);
+			batch_dt += dt;
+		}
+
+		time_last_valid = time_valid;
+
+		if (batch_callback) {
+			batch_callback(batch_dt);
+		}
+	}
+}
+
+#else
+
 static THD_FUNCTION(bmi_thread, arg) {
 	(void)arg;
 
 	chRegSetThreadName("BMI Sampling");
 
+	systime_t time_last = chVTGetSystemTimeX();
+
 	for(;;) {
 		struct bmi160_sensor_data accel;
 		struct bmi160_sensor_data gyro;
 
+		uint32_t stamp = latency_stamp();
+		uint64_t time_us = timebase_get_us();
 		int8_t res = bmi160_get_sensor_data((BMI160_ACCEL_SEL | BMI160_GYRO_SEL),
 				&accel, &gyro, &sensor);
 
@@ -105,37 +384,178 @@ static THD_FUNCTION(bmi_thread, arg) {
 			continue;
 		}
 
-		float tmp_accel[3], tmp_gyro[3], tmp_mag[3];
+		systime_t now = chVTGetSystemTimeX();
+		float dt = (float)chTimeI2US(chTimeDiffX(time_last, now)) / 1.0e6;
+		time_last = now;
 
-		tmp_accel[0] = (float)accel.x * 16.0 / 32768.0;
-		tmp_accel[1] = (float)accel.y * 16.0 / 32768.0;
-		tmp_accel[2] = (float)accel.z * 16.0 / 32768.0;
+		handle_sample(&accel, &gyro, dt, stamp, time_us);
 
-		tmp_gyro[0] = (float)gyro.x * 2000.0 / 32768.0;
-		tmp_gyro[1] = (float)gyro.y * 2000.0 / 32768.0;
-		tmp_gyro[2] = (float)gyro.z * 2000.0 / 32768.0;
+		if (batch_callback) {
+			batch_callback(dt);
+		}
+
+		prof_sleep(TIME_US2I(1000000 / rate_hz));
+	}
+}
 
-		memset(tmp_mag, 0, sizeof(tmp_mag));
+#endif
 
-		if (read_callback) {
-			read_callback(tmp_accel, tmp_gyro, tmp_mag);
+/*
+ * Bus time is wall time from the start to the end of a transaction. With the
+ * I2C peripheral the thread sleeps while DMA moves the data, with i2c_bb the
+ * CPU spins for all of it.
+ */
+static void bus_stats_add(uint32_t start, uint16_t bytes, bool ok) {
+	uint32_t cycles = DWT->CYCCNT - start;
+
+	if (!ok) {
+		m_bus_errors++;
+	}
+
+	m_bus_transactions++;
+	m_bus_bytes += bytes;
+	m_bus_cycles += cycles;
+	if (cycles > m_bus_max_cycles) {
+		m_bus_max_cycles = cycles;
+	}
+}
+
+static void terminal_bus(int argc, const char **argv) {
+	if (argc == 2) {
+		if (strcmp(argv[1], "reset") == 0) {
+			m_bus_transactions = 0;
+			m_bus_errors = 0;
+			m_bus_bytes = 0;
+			m_bus_max_cycles = 0;
+			m_bus_cycles = 0;
+			terminal_printf("OK\n");
+		} else {
+			terminal_printf("Invalid argument %s\n", argv[1]);
 		}
+		return;
+	} else if (argc != 1) {
+		terminal_printf("Wrong number of arguments\n");
+		return;
+	}
 
-		chThdSleepMicroseconds(1000000 / rate_hz);
+	const float cycles_per_us = (float)STM32_SYSCLK / 1.0e6;
+	uint32_t num = m_bus_transactions > 0 ? m_bus_transactions : 1;
+
+#ifdef BOARD_BMI160_I2CD
+	terminal_printf("Backend:      I2C peripheral with DMA");
+#else
+	terminal_printf("Backend:      i2c_bb");
+#endif
+	terminal_printf("Transactions: %lu", m_bus_transactions);
+	terminal_printf("Errors:       %lu", m_bus_errors);
+	terminal_printf("Bytes:        %lu", m_bus_bytes);
+	terminal_printf("Avg time:     %.1f us", (double)((float)m_bus_cycles / (float)num / cycles_per_us));
+	terminal_printf("Max time:     %.1f us", (double)((float)m_bus_max_cycles / cycles_per_us));
+	terminal_printf("Total time:   %.3f s", (double)m_bus_cycles / (double)STM32_SYSCLK);
+	terminal_printf(" ");
+}
+
+#ifdef BOARD_BMI160_I2CD
+
+/*
+ * A slave that was interrupted in the middle of a read can hold SDA low
+ * forever. Clock SCL until it lets go, then generate a stop condition and
+ * hand the pins back to the peripheral. Must be called with the peripheral
+ * stopped.
+ */
+static void i2c_recover_bus(void) {
+	const rtcnt_t half_period = US2RTC(STM32_HCLK, 5);
+
+	palSetLine(LINE_SCL);
+	palSetLine(LINE_SDA);
+	palSetLineMode(LINE_SCL, PAL_MODE_OUTPUT_OPENDRAIN | PAL_STM32_OSPEED_MID1);
+	palSetLineMode(LINE_SDA, PAL_MODE_OUTPUT_OPENDRAIN | PAL_STM32_OSPEED_MID1);
+	chSysPolledDelayX(half_period);
+
+	for (int i = 0;i < 9 && palReadLine(LINE_SDA) == PAL_LOW;i++) {
+		palClearLine(LINE_SCL);
+		chSysPolledDelayX(half_period);
+		palSetLine(LINE_SCL);
+		chSysPolledDelayX(half_period);
 	}
+
+	// Stop condition: SDA goes high while SCL is high
+	palClearLine(LINE_SCL);
+	chSysPolledDelayX(half_period);
+	palClearLine(LINE_SDA);
+	chSysPolledDelayX(half_period);
+	palSetLine(LINE_SCL);
+	chSysPolledDelayX(half_period);
+	palSetLine(LINE_SDA);
+	chSysPolledDelayX(half_period);
+
+	palSetLineMode(LINE_SCL, PAL_MODE_ALTERNATE(BOARD_BMI160_I2C_AF) |
+			PAL_STM32_OTYPE_OPENDRAIN | PAL_STM32_OSPEED_MID1);
+	palSetLineMode(LINE_SDA, PAL_MODE_ALTERNATE(BOARD_BMI160_I2C_AF) |
+			PAL_STM32_OTYPE_OPENDRAIN | PAL_STM32_OSPEED_MID1);
+}
+
+// Buffers passed here are moved by DMA and must not be in CCM (.ram4)
+static bool i2c_tx_rx(uint8_t addr, uint8_t *txbuf, size_t txbytes, uint8_t *rxbuf, size_t rxbytes) {
+	// The timeout covers the whole transfer, so it has to grow with it
+	sysinterval_t timeout = TIME_MS2I(I2C_BASE_TIMEOUT_MS) +
+			TIME_US2I((txbytes + rxbytes + 1) * I2C_BYTE_TIMEOUT_US);
+
+	i2cAcquireBus(&BOARD_BMI160_I2CD);
+	msg_t res = i2cMasterTransmitTimeout(&BOARD_BMI160_I2CD, addr, txbuf, txbytes,
+			rxbuf, rxbytes, timeout);
+
+	if (res != MSG_OK) {
+		// Restart the peripheral to recover from a stuck bus or a timeout
+		i2cStop(&BOARD_BMI160_I2CD);
+		i2c_recover_bus();
+		i2cStart(&BOARD_BMI160_I2CD, &m_i2c_cfg);
+	}
+	i2cReleaseBus(&BOARD_BMI160_I2CD);
+
+	return res == MSG_OK;
+}
+
+static int8_t user_i2c_read(uint8_t dev_addr, uint8_t reg_addr, uint8_t *data, uint16_t len) {
+	uint32_t start = DWT->CYCCNT;
+	uint8_t txbuf[1];
+	txbuf[0] = reg_addr;
+	bool ok = i2c_tx_rx(dev_addr, txbuf, 1, data, len);
+	bus_stats_add(start, len + 1, ok);
+	return ok ? BMI160_OK : BMI160_E_COM_FAIL;
 }
 
+static int8_t user_i2c_write(uint8_t dev_addr, uint8_t reg_addr, uint8_t *data, uint16_t len) {
+	uint32_t start = DWT->CYCCNT;
+	uint8_t txbuf[len + 1];
+	txbuf[0] = reg_addr;
+	memcpy(txbuf + 1, data, len);
+	bool ok = i2c_tx_rx(dev_addr, txbuf, len + 1, 0, 0);
+	bus_stats_add(start, len + 1, ok);
+	return ok ? BMI160_OK : BMI160_E_COM_FAIL;
+}
+
+#else
+
 static int8_t user_i2c_read(uint8_t dev_addr, uint8_t reg_addr, uint8_t *data, uint16_t len) {
+	uint32_t start = DWT->CYCCNT;
 	m_i2c_bb.has_error = 0;
 	uint8_t txbuf[1];
 	txbuf[0] = reg_addr;
-	return i2c_bb_tx_rx(&m_i2c_bb, dev_addr, txbuf, 1, data, len) ? BMI160_OK : BMI160_E_COM_FAIL;
+	bool ok = i2c_bb_tx_rx(&m_i2c_bb, dev_addr, txbuf, 1, data, len);
+	bus_stats_add(start, len + 1, ok);
+	return ok ? BMI160_OK : BMI160_E_COM_FAIL;
 }
 
 static int8_t user_i2c_write(uint8_t dev_addr, uint8_t reg_addr, uint8_t *data, uint16_t len) {
+	uint32_t start = DWT->CYCCNT;
 	m_i2c_bb.has_error = 0;
 	uint8_t txbuf[len + 1];
 	txbuf[0] = reg_addr;
 	memcpy(txbuf + 1, data, len);
-	return i2c_bb_tx_rx(&m_i2c_bb, dev_addr, txbuf, len + 1, 0, 0) ? BMI160_OK : BMI160_E_COM_FAIL;
+	bool ok = i2c_bb_tx_rx(&m_i2c_bb, dev_addr, txbuf, len + 1, 0, 0);
+	bus_stats_add(start, len + 1, ok);
+	return ok ? BMI160_OK : BMI160_E_COM_FAIL;
 }
+
+#endif
@@ -29,7 +29,24 @@
 #include "i2c_bb.h"
 #include "bmi160.h"
 
+// Settings
+#ifndef BMI160_USE_FIFO
+#define BMI160_USE_FIFO				1 // Read batches from the FIFO instead of polling
+#endif
+#define BMI160_FIFO_WM_FRAMES		2 // Frames per batch
+
+/*
+ * In FIFO mode the watermark interrupt on INT1 wakes up the sampling thread
+ * if the board defines LINE_BMI160_INT1, otherwise the FIFO is read once
+ * per batch time.
+ */
+
+/*
+ * The ODR is the highest BMI160 rate that does not exceed samp_rate_hz,
+ * e.g. 400 Hz when asking for 500 Hz.
+ */
 void bmi160_wrapper_init(int samp_rate_hz);
-void bmi160_wrapper_set_read_callback(void(*func)(float *accel, float *gyro, float *mag));
+void bmi160_wrapper_set_read_callback(void(*func)(float *accel, float *gyro, float *mag, float dt, uint64_t time_us));
+void bmi160_wrapper_set_batch_callback(void(*func)(float dt));
 
 #endif /* IMU_BMI160_WRAPPER_H_ */
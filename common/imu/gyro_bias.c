@@ -0,0 +1,193 @@
+/*
+	Copyright 2021 Marvin Damschen	marvin.damschen@ri.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gyro_bias.h"
+#include "ch.h"
+#include "conf_general.h"
+#include "terminal.h"
+#include "pos.h"
+
+#include <math.h>
+#include <string.h>
+
+/*
+ * Online gyro bias estimation.
+ *
+ * The mean and variance of the gyro axes and of the accelerometer norm are
+ * tracked with first order filters. The vehicle is stationary when both
+ * variances are low, the gyro is close to the current bias and odometry
+ * reports no speed. After being stationary for a while the bias follows the
+ * filtered gyro mean slowly, so short disturbances do not pull it away.
+ *
+ * The estimate starts from the stored value at boot. It is only stored on
+ * request with the gyro_bias save terminal command, because writing flash
+ * locks the system for a moment and must not happen from the sampling
+ * thread.
+ */
+
+// Settings
+#define FILTER_TAU					0.5 // Mean and variance filter time constant, s
+#define BIAS_TAU					10.0 // Bias convergence time constant, s
+#define STATIONARY_TIME				1.0 // Time stationary before updating the bias, s
+#define ACC_VAR_MAX					(0.01 * 0.01) // g^2
+#define GYRO_VAR_MAX				(0.3 * 0.3) // (deg/s)^2
+#define GYRO_DIFF_MAX				5.0 // Max difference to the bias, deg/s
+#define SPEED_MAX					0.05 // Max odometry speed, m/s
+
+// Private variables
+static float m_bias[3];
+static float m_gyro_mean[3];
+static float m_gyro_var[3];
+static float m_acc_mean;
+static float m_acc_var;
+static float m_stationary_time;
+static bool m_filter_init_done;
+
+// Private functions
+static void terminal_gyro_bias(int argc, const char **argv);
+
+void gyro_bias_init(void) {
+	m_bias[0] = main_config.gyro_bias_x;
+	m_bias[1] = main_config.gyro_bias_y;
+	m_bias[2] = main_config.gyro_bias_z;
+
+	// Ignore implausible stored values
+	for (int i = 0;i < 3;i++) {
+		if (!isfinite(m_bias[i]) || fabsf(m_bias[i]) > GYRO_DIFF_MAX) {
+			memset(m_bias, 0, sizeof(m_bias));
+			break;
+		}
+	}
+
+	m_stationary_time = 0.0;
+	m_filter_init_done = false;
+
+	terminal_register_command_callback(
+			"gyro_bias",
+			"Print the gyro bias estimate. Use reset to start over or save to store it now.",
+			"[reset/save]",
+			terminal_gyro_bias);
+}
+
+/**
+ * Update the estimate with a new sample and remove the bias from it.
+ *
+ * @param accel
+ * Acceleration in g.
+ *
+ * @param gyro
+ * Angular rate in deg/s. The bias is subtracted in place.
+ *
+ * @param dt
+ * Time since the previous sample in seconds.
+ */
+void gyro_bias_update(const float *accel, float *gyro, float dt) {
+	float acc_norm = sqrtf(accel[0] * accel[0] + accel[1] * accel[1] + accel[2] * accel[2]);
+
+	if (!m_filter_init_done) {
+		for (int i = 0;i < 3;i++) {
+			m_gyro_mean[i] = gyro[i];
+			m_gyro_var[i] = GYRO_VAR_MAX;
+		}
+		m_acc_mean = acc_norm;
+		m_acc_var = ACC_VAR_MAX;
+		m_filter_init_done = true;
+	}
+
+	if (dt > 0.0 && dt < 0.1) {
+		const float a = dt / (FILTER_TAU + dt);
+		bool stationary = fabsf(pos_get_speed()) < SPEED_MAX;
+
+		for (int i = 0;i < 3;i++) {
+			float d = gyro[i] - m_gyro_mean[i];
+			m_gyro_mean[i] += a * d;
+			m_gyro_var[i] = (1.0 - a) * (m_gyro_var[i] + a * d * d);
+
+			if (m_gyro_var[i] > GYRO_VAR_MAX || fabsf(gyro[i] - m_bias[i]) > GYRO_DIFF_MAX) {
+				stationary = false;
+			}
+		}
+
+		float d = acc_norm - m_acc_mean;
+		m_acc_mean += a * d;
+		m_acc_var = (1.0 - a) * (m_acc_var + a * d * d);
+
+		if (m_acc_var > ACC_VAR_MAX) {
+			stationary = false;
+		}
+
+		m_stationary_time = stationary ? m_stationary_time + dt : 0.0;
+
+		if (m_stationary_time > STATIONARY_TIME) {
+			const float b = dt / (BIAS_TAU + dt);
+			for (int i = 0;i < 3;i++) {
+				m_bias[i] += b * (m_gyro_mean[i] - m_bias[i]);
+			}
+		}
+	}
+
+	gyro[0] -= m_bias[0];
+	gyro[1] -= m_bias[1];
+	gyro[2] -= m_bias[2];
+}
+
+/**
+ * Get the current bias estimate in deg/s.
+ */
+void gyro_bias_get(float *bias) {
+	bias[0] = m_bias[0];
+	bias[1] = m_bias[1];
+	bias[2] = m_bias[2];
+}
+
+/**
+ * Check if the vehicle is considered stationary.
+ */
+bool gyro_bias_is_stationary(void) {
+	return m_stationary_time > STATIONARY_TIME;
+}
+
+static void terminal_gyro_bias(int argc, const char **argv) {
+	if (argc == 2) {
+		if (strcmp(argv[1], "reset") == 0) {
+			memset(m_bias, 0, sizeof(m_bias));
+			m_stationary_time = 0.0;
+			terminal_printf("OK\n");
+		} else if (strcmp(argv[1], "save") == 0) {
+			float bias[3];
+			gyro_bias_get(bias);
+			if (conf_general_store_gyro_bias(bias[0], bias[1], bias[2])) {
+				terminal_printf("OK\n");
+			} else {
+				terminal_printf("Storing failed\n");
+			}
+		} else {
+			terminal_printf("Invalid argument %s\n", argv[1]);
+		}
+	} else if (argc == 1) {
+		terminal_printf("Bias:       %.4f %.4f %.4f deg/s",
+				(double)m_bias[0], (double)m_bias[1], (double)m_bias[2]);
+		terminal_printf("Stored:     %.4f %.4f %.4f deg/s",
+				(double)main_config.gyro_bias_x, (double)main_config.gyro_bias_y,
+				(double)main_config.gyro_bias_z);
+		terminal_printf("Stationary: %s (%.1f s)",
+				gyro_bias_is_stationary() ? "yes" : "no", (double)m_stationary_time);
+		terminal_printf(" ");
+	} else {
+		terminal_printf("Wrong number of arguments\n");
+	}
+}
@@ -0,0 +1,29 @@
+/*
+	Copyright 2021 Marvin Damschen	marvin.damschen@ri.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GYRO_BIAS_H_
+#define GYRO_BIAS_H_
+
+#include <stdbool.h>
+
+// Functions
+void gyro_bias_init(void);
+void gyro_bias_update(const float *accel, float *gyro, float dt);
+void gyro_bias_get(float *bias);
+bool gyro_bias_is_stationary(void);
+
+#endif /* GYRO_BIAS_H_ */
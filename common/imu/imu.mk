@@ -1,6 +1,7 @@
 IMUSRC =    $(COMMONDIR)/imu/BMI160_driver/bmi160.c \
             $(COMMONDIR)/imu/bmi160_wrapper.c \
-            $(COMMONDIR)/imu/ahrs.c
+            $(COMMONDIR)/imu/ahrs.c \
+            $(COMMONDIR)/imu/gyro_bias.c
 
 IMUINC =    $(COMMONDIR)/imu \
             $(COMMONDIR)/imu/BMI160_driver
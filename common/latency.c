@@ -0,0 +1,157 @@
+/*
+	Copyright 2021 Marvin Damschen	marvin.damschen@ri.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "latency.h"
+#include "ch.h"
+#include "hal.h"
+#include "terminal.h"
+
+#include <string.h>
+
+/*
+ * Sensor-to-output latency. A sensor sample is stamped with the DWT cycle
+ * counter when it is read, the stamp travels with POS_STATE and is compared
+ * with the cycle counter when the resulting output is commanded. Each path
+ * is recorded by a single thread, so no locking is done here.
+ */
+
+// Private variables
+static uint32_t m_sample_stamp[LATENCY_SRC_NUM];
+static LATENCY_STATS m_stats[LATENCY_PATH_NUM];
+
+static const char *m_path_names[LATENCY_PATH_NUM] = {
+		"IMU -> pos",
+		"IMU -> actuator",
+		"IMU -> steering",
+		"GNSS -> pos",
+		"GNSS -> steering"
+};
+
+// Private functions
+static void terminal_latency(int argc, const char **argv);
+
+void latency_init(void) {
+	memset(m_sample_stamp, 0, sizeof(m_sample_stamp));
+	latency_reset();
+
+	terminal_register_command_callback(
+			"latency",
+			"Print sensor-to-output latency histograms. Use reset to clear them.",
+			"[reset]",
+			terminal_latency);
+}
+
+void latency_reset(void) {
+	for (int i = 0;i < LATENCY_PATH_NUM;i++) {
+		memset(&m_stats[i], 0, sizeof(LATENCY_STATS));
+		m_stats[i].min_us = UINT32_MAX;
+	}
+}
+
+/**
+ * Get a time stamp for a sensor sample. Never returns 0, which is used for
+ * "no sample".
+ */
+uint32_t latency_stamp(void) {
+	return DWT->CYCCNT | 1;
+}
+
+void latency_set_sample(LATENCY_SOURCE src, uint32_t stamp) {
+	m_sample_stamp[src] = stamp;
+}
+
+/**
+ * Get the stamp of the last sample of a source. Only meaningful in the
+ * thread that set it, on the same call chain.
+ */
+uint32_t latency_get_sample(LATENCY_SOURCE src) {
+	return m_sample_stamp[src];
+}
+
+/**
+ * Record the latency of an output.
+ *
+ * @param path
+ * The path the output belongs to.
+ *
+ * @param stamp
+ * The stamp of the sensor sample the output is based on.
+ */
+void latency_record(LATENCY_PATH path, uint32_t stamp) {
+	if (stamp == 0) {
+		return;
+	}
+
+	uint32_t us = (DWT->CYCCNT - stamp) / (STM32_SYSCLK / 1000000);
+	LATENCY_STATS *s = &m_stats[path];
+
+	int bin = 0;
+	while ((us >> (bin + 3)) && bin < (LATENCY_BINS - 1)) {
+		bin++;
+	}
+
+	s->hist[bin]++;
+	s->cnt++;
+	s->sum_us += us;
+
+	if (us < s->min_us) {
+		s->min_us = us;
+	}
+
+	if (us > s->max_us) {
+		s->max_us = us;
+	}
+}
+
+void latency_get_stats(LATENCY_PATH path, LATENCY_STATS *stats) {
+	*stats = m_stats[path];
+}
+
+static void terminal_latency(int argc, const char **argv) {
+	if (argc == 2) {
+		if (strcmp(argv[1], "reset") == 0) {
+			latency_reset();
+			terminal_printf("OK\n");
+		} else {
+			terminal_printf("Invalid argument %s\n", argv[1]);
+		}
+		return;
+	} else if (argc != 1) {
+		terminal_printf("Wrong number of arguments\n");
+		return;
+	}
+
+	terminal_printf("Histogram bins (us): <8 <16 <32 <64 <128 <256 <512 <1k <2k <4k <8k >=8k");
+
+	for (int i = 0;i < LATENCY_PATH_NUM;i++) {
+		LATENCY_STATS s;
+		latency_get_stats(i, &s);
+
+		if (s.cnt == 0) {
+			terminal_printf("%s: no samples", m_path_names[i]);
+			continue;
+		}
+
+		terminal_printf("%s: %lu samples, min %lu us, mean %lu us, max %lu us",
+				m_path_names[i], s.cnt, s.min_us, (uint32_t)(s.sum_us / s.cnt), s.max_us);
+		terminal_printf("  %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu %lu",
+				s.hist[0], s.hist[1], s.hist[2], s.hist[3], s.hist[4], s.hist[5],
+				s.hist[6], s.hist[7], s.hist[8], s.hist[9], s.hist[10], s.hist[11]);
+	}
+
+	terminal_printf(" ");
+}
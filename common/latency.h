@@ -0,0 +1,60 @@
+/*
+	Copyright 2021 Marvin Damschen	marvin.damschen@ri.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LATENCY_H_
+#define LATENCY_H_
+
+#include "datatypes.h"
+
+// Settings
+#define LATENCY_BINS				12 // bin 0: < 8 us, bin n: < 2^(n + 3) us, last bin: >= 8192 us
+
+// Sensor sources
+typedef enum {
+	LATENCY_SRC_IMU = 0,
+	LATENCY_SRC_GNSS,
+	LATENCY_SRC_NUM
+} LATENCY_SOURCE;
+
+// Sensor-to-output paths
+typedef enum {
+	LATENCY_PATH_IMU_POS = 0,
+	LATENCY_PATH_IMU_ACTUATOR,
+	LATENCY_PATH_IMU_STEERING,
+	LATENCY_PATH_GNSS_POS,
+	LATENCY_PATH_GNSS_STEERING,
+	LATENCY_PATH_NUM
+} LATENCY_PATH;
+
+typedef struct {
+	uint32_t cnt;
+	uint32_t min_us;
+	uint32_t max_us;
+	uint64_t sum_us;
+	uint32_t hist[LATENCY_BINS];
+} LATENCY_STATS;
+
+// Functions
+void latency_init(void);
+void latency_reset(void);
+uint32_t latency_stamp(void);
+void latency_set_sample(LATENCY_SOURCE src, uint32_t stamp);
+uint32_t latency_get_sample(LATENCY_SOURCE src);
+void latency_record(LATENCY_PATH path, uint32_t stamp);
+void latency_get_stats(LATENCY_PATH path, LATENCY_STATS *stats);
+
+#endif /* LATENCY_H_ */
@@ -26,6 +26,7 @@
 #include "comm_can.h"
 #include "ch.h"
 #include "time_today.h"
+#include "prof.h"
 
 #include <string.h>
 #include <stdarg.h>
@@ -120,6 +121,7 @@ static THD_FUNCTION(log_thread, arg) {
 
 		if (time_p >= time + 5) {
 			chThdSleepUntil(time_p);
+			prof_wakeup(time_p);
 		} else {
 			chThdSleepMilliseconds(1);
 		}
@@ -22,6 +22,7 @@
 #include "hal.h"
 #include "bldc_interface.h"
 #include "utils.h"
+#include "prof.h"
 
 // Settings
 #define MOTOR_NUM						2
@@ -157,7 +158,7 @@ static THD_FUNCTION(sim_thread, arg) {
 			}
 		}
 
-		iteration_timer = chThdSleepUntilWindowed(iteration_timer,
+		iteration_timer = prof_sleep_until_windowed(iteration_timer,
 				iteration_timer + TIME_MS2I(SIMULATION_TIME_MS));
 	}
 }
@@ -23,19 +23,26 @@
 #include "commands.h" // TODO might make sense to factor out
 #include "conf_general.h"
 #include "time_today.h"
+#include "timebase.h"
 #include "servo_pwm.h" // TODO factor out
 #include "terminal.h"
+#include "trace.h"
+#include "latency.h"
 #include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
 
 #define POS_HISTORY_LEN					100
+#define POS_HISTORY_IMU_PERIOD_US		10000 // Without odometry, 1 s of history from the IMU
 
 // Private variables
 static POS_STATE m_pos;
 static POS_POINT m_pos_history[POS_HISTORY_LEN];
 static int m_pos_history_ptr;
 static mutex_t m_mutex_pos;
+// Copy of m_pos after each IMU correction, double buffered for lock-free reads
+static POS_STATE m_pos_latest[2];
+static volatile uint32_t m_pos_latest_seq;
 static bool m_en_delay_comp;
 static bool m_gps_corr_print;
 static bool m_pos_history_print;
@@ -51,11 +58,14 @@ static bool m_yaw_imu_clamp_set;
 static void cmd_terminal_delay_info(int argc, const char **argv);
 static void cmd_terminal_gps_corr_info(int argc, const char **argv);
 static void cmd_terminal_delay_comp(int argc, const char **argv);
-static void save_pos_history(void);
-static POS_POINT get_closest_point_to_time(int32_t time);
+static void save_pos_history(uint64_t time_us);
+static void publish_latest(void);
+static POS_POINT get_closest_point_to_time(uint64_t time_us);
 
 void pos_init(void) {
 	memset(&m_pos, 0, sizeof(m_pos));
+	memset(m_pos_latest, 0, sizeof(m_pos_latest));
+	m_pos_latest_seq = 0;
 	memset(&m_pos_history, 0, sizeof(m_pos_history));
 	m_pos_history_ptr = 0;
 	m_pos_history_print = false;
@@ -99,6 +109,29 @@ void pos_get(POS_STATE *p) {
 	chMtxUnlock(&m_mutex_pos);
 }
 
+/**
+ * Get the state as of the last IMU correction without taking the pos
+ * mutex, so that the caller never waits for a pos update in progress.
+ *
+ * @param p
+ * Pointer to store the state in.
+ *
+ * @return
+ * Sequence number of the state, increased by one for every IMU sample.
+ */
+uint32_t pos_get_latest(POS_STATE *p) {
+	uint32_t seq;
+
+	// A publish during the copy may have overwritten the slot, read again
+	do {
+		seq = __atomic_load_n(&m_pos_latest_seq, __ATOMIC_ACQUIRE);
+		*p = m_pos_latest[seq & 1];
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (seq != __atomic_load_n(&m_pos_latest_seq, __ATOMIC_RELAXED));
+
+	return seq;
+}
+
 float pos_get_yaw(void) {
 	return m_pos.yaw;
 }
@@ -141,53 +174,37 @@ void pos_set_yaw_offset(float angle) {
 
 static void cmd_terminal_delay_info(int argc, const char **argv) {
 	if (argc == 2) {
-		if (strcmp(argv[1], "0") == 0) {
-			m_pos_history_print = 0;
-			terminal_printf("OK\n");
-		} else if (strcmp(argv[1], "1") == 0) {
-			m_pos_history_print = 1;
+		if (terminal_arg_bool(argv[1], &m_pos_history_print)) {
 			terminal_printf("OK\n");
-		} else {
-			terminal_printf("Invalid argument %s\n", argv[1]);
 		}
 	} else {
-		terminal_printf("Wrong number of arguments\n");
+		terminal_wrong_args();
 	}
 }
 
 static void cmd_terminal_gps_corr_info(int argc, const char **argv) {
 	if (argc == 2) {
-		if (strcmp(argv[1], "0") == 0) {
-			m_gps_corr_print = 0;
-			terminal_printf("OK\n");
-		} else if (strcmp(argv[1], "1") == 0) {
-			m_gps_corr_print = 1;
+		if (terminal_arg_bool(argv[1], &m_gps_corr_print)) {
 			terminal_printf("OK\n");
-		} else {
-			terminal_printf("Invalid argument %s\n", argv[1]);
 		}
 	} else {
-		terminal_printf("Wrong number of arguments\n");
+		terminal_wrong_args();
 	}
 }
 
 static void cmd_terminal_delay_comp(int argc, const char **argv) {
 	if (argc == 2) {
-		if (strcmp(argv[1], "0") == 0) {
-			m_en_delay_comp = 0;
-			terminal_printf("OK\n");
-		} else if (strcmp(argv[1], "1") == 0) {
-			m_en_delay_comp = 1;
+		if (terminal_arg_bool(argv[1], &m_en_delay_comp)) {
 			terminal_printf("OK\n");
-		} else {
-			terminal_printf("Invalid argument %s\n", argv[1]);
 		}
 	} else {
-		terminal_printf("Wrong number of arguments\n");
+		terminal_wrong_args();
 	}
 }
 
-void pos_correction_imu(const float roll, const float pitch, const float yaw, const float yaw_mag, const float gyro[3], const float quaternions[4], const float dt) {
+void pos_correction_imu(const float roll, const float pitch, const float yaw, const float yaw_mag, const float gyro[3], const float quaternions[4], const float dt, const uint64_t time_us) {
+	TRACE_BEGIN(TRACE_EV_POS_CORR_IMU, 0);
+
 	chMtxLock(&m_mutex_pos);
 
 	m_pos.roll = roll * 180.0 / M_PI;
@@ -195,7 +212,8 @@ void pos_correction_imu(const float roll, const float pitch, const float yaw, co
 	m_pos.roll_rate = -gyro[0] * 180.0 / M_PI;
 	m_pos.pitch_rate = gyro[1] * 180.0 / M_PI;
 
-	if (main_config.mag_use) {
+	// With ahrs_use_mag the filter already fuses the magnetometer
+	if (main_config.mag_use && !main_config.ahrs_use_mag) {
 		static float yaw_now = 0;
 		static float yaw_imu_last = 0;
 
@@ -256,24 +274,58 @@ void pos_correction_imu(const float roll, const float pitch, const float yaw, co
 	m_pos.q2 = quaternions[2];
 	m_pos.q3 = quaternions[3];
 
+	m_pos.imu_sample_stamp = latency_get_sample(LATENCY_SRC_IMU);
+	m_pos.imu_time_us = time_us;
+
 	// Perform vehicle-type-specific corrections if necessary (should be registered in main)
-	if (m_pos_correction_imu_hook)
+	if (m_pos_correction_imu_hook) {
+		TRACE_BEGIN(TRACE_EV_POS_IMU_HOOK, 0);
 		m_pos_correction_imu_hook(&m_pos, dt);
+		TRACE_END(TRACE_EV_POS_IMU_HOOK, 0);
+	}
+
+	// The rover saves its history with each odometry update
+	if (VEHICLE_TYPE == VEHICLE_TYPE_COPTER) {
+		static uint64_t history_last_us = 0;
+		if (time_us - history_last_us >= POS_HISTORY_IMU_PERIOD_US) {
+			save_pos_history(time_us);
+			history_last_us = time_us;
+		}
+	}
+
+	publish_latest();
 
 	chMtxUnlock(&m_mutex_pos);
 
+	latency_record(LATENCY_PATH_IMU_POS, latency_get_sample(LATENCY_SRC_IMU));
+
 	// After corrections, trigger vehicle-type-specific actions if necessary (should be registered in main)
-	if (m_pos_correction_imu_post_hook)
+	if (m_pos_correction_imu_post_hook) {
+		TRACE_BEGIN(TRACE_EV_POS_IMU_POST_HOOK, 0);
 		m_pos_correction_imu_post_hook(dt);
+		TRACE_END(TRACE_EV_POS_IMU_POST_HOOK, 0);
+	}
+
+	TRACE_END(TRACE_EV_POS_CORR_IMU, 0);
 }
 
-static void save_pos_history(void) {
+/*
+ * Single writer with m_mutex_pos held. Fills the slot readers are not
+ * using and then makes it the current one.
+ */
+static void publish_latest(void) {
+	uint32_t seq = m_pos_latest_seq + 1;
+	m_pos_latest[seq & 1] = m_pos;
+	__atomic_store_n(&m_pos_latest_seq, seq, __ATOMIC_RELEASE);
+}
+
+static void save_pos_history(uint64_t time_us) {
 	m_pos_history[m_pos_history_ptr].px = m_pos.px;
 	m_pos_history[m_pos_history_ptr].py = m_pos.py;
 	m_pos_history[m_pos_history_ptr].pz = m_pos.pz;
 	m_pos_history[m_pos_history_ptr].yaw = m_pos.yaw;
 	m_pos_history[m_pos_history_ptr].speed = m_pos.speed;
-	m_pos_history[m_pos_history_ptr].time = time_today_get_ms();
+	m_pos_history[m_pos_history_ptr].time_us = time_us;
 
 	m_pos_history_ptr++;
 	if (m_pos_history_ptr >= POS_HISTORY_LEN) {
@@ -281,14 +333,14 @@ static void save_pos_history(void) {
 	}
 }
 
-static POS_POINT get_closest_point_to_time(int32_t time) {
+static POS_POINT get_closest_point_to_time(uint64_t time_us) {
 	if (m_pos_history_ptr == 0 && ((*(uint32_t*)m_pos_history)) == 0) { // return current position when history is empty
-		POS_POINT tmp = {m_pos.px, m_pos.py, m_pos.py, m_pos.yaw, m_pos.speed, time_today_get_ms()};
+		POS_POINT tmp = {m_pos.px, m_pos.py, m_pos.py, m_pos.yaw, m_pos.speed, timebase_get_us()};
 		return tmp;
 	}
 
 	int32_t ind = m_pos_history_ptr > 0 ? m_pos_history_ptr - 1 : POS_HISTORY_LEN - 1;
-	int32_t min_diff = abs(time - m_pos_history[ind].time);
+	uint64_t min_diff = utils_time_diff_us(time_us, m_pos_history[ind].time_us);
 	int32_t ind_use = ind;
 
 	int cnt = 0;
@@ -299,7 +351,7 @@ static POS_POINT get_closest_point_to_time(int32_t time) {
 			break;
 		}
 
-		int32_t diff = abs(time - m_pos_history[ind].time);
+		uint64_t diff = utils_time_diff_us(time_us, m_pos_history[ind].time_us);
 
 		if (diff < min_diff) {
 			min_diff = diff;
@@ -315,13 +367,15 @@ static POS_POINT get_closest_point_to_time(int32_t time) {
 }
 
 void pos_correction_gnss(const float gnss_px, const float gnss_py, const float gnss_pz, const int32_t gnss_ms, const int fix_type) {
+	TRACE_BEGIN(TRACE_EV_POS_CORR_GNSS, gnss_ms);
+
 	if (m_pos.gps_corr_cnt == 0.0)
 		m_pos.gps_corr_cnt = sqrtf(SQ(m_pos.px_gps - m_pos.px_gps_last) + SQ(m_pos.py_gps - m_pos.py_gps_last));
 
 	{
 		static int sample = 0;
 		if (m_pos_history_print) {
-			int32_t diff = time_today_get_ms() - gnss_ms;
+			int32_t diff = (int32_t)((int64_t)(timebase_get_us() - time_today_to_timebase_us(gnss_ms)) / 1000);
 			terminal_printf("Age: %d gnss_ms, PPS_CNT: %d", diff, time_today_get_pps_cnt());
 			if (sample == 0) {
 				commands_init_plot("Sample", "Age (gnss_ms)");
@@ -340,8 +394,8 @@ void pos_correction_gnss(const float gnss_px, const float gnss_py, const float g
 	if (fabsf(m_pos.speed * 3.6f) > 0.5 || 1) {
 		float yaw_gps = -atan2f(gnss_py - m_pos.gps_ang_corr_y_last_gps,
 				gnss_px - m_pos.gps_ang_corr_x_last_gps) * 180.0 / M_PI;
-		POS_POINT closest = get_closest_point_to_time(
-				(gnss_ms + m_pos.gps_ang_corr_last_gps_ms) / 2.0);
+		POS_POINT closest = get_closest_point_to_time(time_today_to_timebase_us(
+				(gnss_ms + m_pos.gps_ang_corr_last_gps_ms) / 2));
 		float yaw_diff = utils_angle_difference(yaw_gps, closest.yaw);
 		utils_step_towards(&m_imu_yaw_offset, m_imu_yaw_offset - yaw_diff,
 				main_config.gps_corr_gain_yaw * m_pos.gps_corr_cnt);
@@ -353,7 +407,8 @@ void pos_correction_gnss(const float gnss_px, const float gnss_py, const float g
 	float gain = main_config.gps_corr_gain_stat +
 			main_config.gps_corr_gain_dyn * m_pos.gps_corr_cnt;
 
-	POS_POINT closest = get_closest_point_to_time(m_en_delay_comp ? gnss_ms : time_today_get_ms());
+	POS_POINT closest = get_closest_point_to_time(m_en_delay_comp ?
+			time_today_to_timebase_us(gnss_ms) : timebase_get_us());
 	POS_POINT closest_corr = closest;
 
 	{
@@ -406,6 +461,7 @@ void pos_correction_gnss(const float gnss_px, const float gnss_py, const float g
 	m_pos.py_gps = gnss_py;
 	m_pos.pz_gps = gnss_pz;
 	m_pos.gps_ms = gnss_ms;
+	m_pos.gnss_sample_stamp = latency_get_sample(LATENCY_SRC_GNSS);
 	m_pos.gps_fix_type = fix_type;
 
 	m_pos.gps_ang_corr_x_last_gps = gnss_px;
@@ -414,18 +470,24 @@ void pos_correction_gnss(const float gnss_px, const float gnss_py, const float g
 
 	// Perform vehicle-type-specific corrections if necessary (should be registered in main)
 	if (m_pos_correction_gnss_hook) {
-		const float time_now = time_today_get_ms();
-		static float time_last = 0;
-		float dt = (time_now - time_last) / 1000.0;
+		const uint64_t time_now = timebase_get_us();
+		static uint64_t time_last = 0;
+		float dt = (float)(time_now - time_last) * 1.0e-6f;
 		time_last = time_now;
 
 		m_pos_correction_gnss_hook(&m_pos, dt);
 	}
 
 	chMtxUnlock(&m_mutex_pos);
+
+	latency_record(LATENCY_PATH_GNSS_POS, latency_get_sample(LATENCY_SRC_GNSS));
+
+	TRACE_END(TRACE_EV_POS_CORR_GNSS, gnss_ms);
 }
 
 void pos_correction_mc(float distance, float turn_rad_rear, float angle_diff, float speed) {
+	TRACE_BEGIN(TRACE_EV_POS_CORR_MC, 0);
+
 	chMtxLock(&m_mutex_pos);
 
 	if (fabsf(distance) > 1e-6) {
@@ -449,9 +511,11 @@ void pos_correction_mc(float distance, float turn_rad_rear, float angle_diff, fl
 
 	m_pos.speed = speed;
 
-	save_pos_history();
+	save_pos_history(timebase_get_us());
 
 	chMtxUnlock(&m_mutex_pos);
+
+	TRACE_END(TRACE_EV_POS_CORR_MC, 0);
 }
 
 void pos_set_correction_imu_hook(void (pos_correction_imu_hook)(POS_STATE *pos, float dt)) {
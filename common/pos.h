@@ -24,12 +24,13 @@
 // Functions
 void pos_init(void);
 void pos_get(POS_STATE *p);
+uint32_t pos_get_latest(POS_STATE *p);
 float pos_get_yaw(void);
 float pos_get_speed(void);
 float pos_get_gnss_speed(void);
 void pos_set_xya(float x, float y, float angle);
 void pos_set_yaw_offset(float angle);
-void pos_correction_imu(const float roll, const float pitch, const float yaw, const float yaw_mag, const float gyro[3], const float quaternions[4], const float dt);
+void pos_correction_imu(const float roll, const float pitch, const float yaw, const float yaw_mag, const float gyro[3], const float quaternions[4], const float dt, const uint64_t time_us);
 void pos_correction_gnss(const float gnss_px, const float gnss_py, const float gnss_pz, const int32_t gnss_ms, const int fix_type);
 void pos_correction_mc(float distance, float turn_rad_rear, float angle_diff, float speed);
 void pos_set_correction_imu_hook(void (pos_correction_imu_hook)(POS_STATE *pos, float dt));
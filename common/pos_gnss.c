@@ -22,8 +22,11 @@
 #include "terminal.h"
 #include "commands.h"
 #include "time_today.h"
+#include "timebase.h"
 #include "rtcm3_simple.h" // to get base station pos (ENU) from rtcm3 stream
 #include "pos.h"
+#include "trace.h"
+#include "latency.h"
 #include "ch.h"
 #include <math.h>
 #include <stdlib.h>
@@ -117,6 +120,9 @@ static void cmd_terminal_reset_enu_ref(int argc, const char **argv) {
 }
 
 void pos_gnss_nmea_cb(const char *data) {
+	TRACE_BEGIN(TRACE_EV_GNSS_NMEA, 0);
+	latency_set_sample(LATENCY_SRC_GNSS, latency_stamp());
+
 	nmea_gga_info_t gga;
 	static nmea_gsv_info_t gpgsv;
 	static nmea_gsv_info_t glgsv;
@@ -193,12 +199,15 @@ void pos_gnss_nmea_cb(const char *data) {
 		}
 
 		m_gps.update_time = chVTGetSystemTimeX();
+		m_gps.update_time_us = timebase_get_us();
 
 		chMtxUnlock(&m_mutex_gps);
 	}
 
 	if (gga_res >= 0) // forward NMEA if decoded
 		commands_send_nmea(data, strlen(data));
+
+	TRACE_END(TRACE_EV_GNSS_NMEA, gga.t_tow);
 }
 
 static void init_gps_local(GPS_STATE *gps) {
@@ -18,11 +18,14 @@
 
 #include "pos_imu.h"
 #include "ch.h"
+#include "hal.h"
 #include "utils.h"
 #include "conf_general.h"
 #include "terminal.h"
 #include "ahrs.h"
+#include "gyro_bias.h"
 #include "pos.h"
+#include "trace.h"
 #include <math.h>
 
 // Private variables
@@ -32,19 +35,43 @@ static float m_accel[3];
 static float m_gyro[3];
 static float m_mag[3];
 static float m_mag_raw[3];
+static float m_rot_cos;
+static float m_rot_sin;
 
 // Private functions
 static void cmd_terminal_reset_attitude(int argc, const char **argv);
+static void cmd_terminal_ahrs_bench(int argc, const char **argv);
 
 void pos_imu_init(void) {
 	ahrs_init_attitude_info(&m_att);
 	m_attitude_init_done = false;
 
+	gyro_bias_init();
+
+	// Rotate board yaw orientation
+	float rotf = 0.0;
+
+#ifdef BOARD_YAW_ROT // TODO: -> main_config
+	rotf += BOARD_YAW_ROT;
+#endif
+
+	rotf *= M_PI / 180.0;
+	utils_norm_angle_rad(&rotf);
+
+	m_rot_cos = cosf(rotf);
+	m_rot_sin = sinf(rotf);
+
 	terminal_register_command_callback(
 			"pos_reset_att",
 			"Re-initialize the attitude estimation",
 			NULL,
 			cmd_terminal_reset_attitude);
+
+	terminal_register_command_callback(
+			"ahrs_bench",
+			"Measure cycles per AHRS update and the error of the fast math angle extraction.",
+			"[iterations]",
+			cmd_terminal_ahrs_bench);
 }
 
 
@@ -68,11 +95,10 @@ void pos_imu_get(float *accel, float *gyro, float *mag) {
 	}
 }
 
-void pos_imu_data_cb(float *accel, float *gyro, float *mag) {
-	static systime_t time_last = 0;
-	sysinterval_t time_elapsed = chVTTimeElapsedSinceX(time_last);
-	time_last = chVTGetSystemTimeX();
-	float dt = chTimeI2US(time_elapsed)/1.0e6;
+void pos_imu_data_cb(float *accel, float *gyro, float *mag, float dt, uint64_t time_us) {
+	TRACE_BEGIN(TRACE_EV_IMU_DATA, 0);
+
+	gyro_bias_update(accel, gyro, dt);
 
 	gyro[0] = gyro[0] * M_PI / 180.0;
 	gyro[1] = gyro[1] * M_PI / 180.0;
@@ -118,17 +144,8 @@ void pos_imu_data_cb(float *accel, float *gyro, float *mag) {
 	}
 
 	// Rotate board yaw orientation
-	float rotf = 0.0;
-
-#ifdef BOARD_YAW_ROT // TODO: -> main_config
-	rotf += BOARD_YAW_ROT;
-#endif
-
-	rotf *= M_PI / 180.0;
-	utils_norm_angle_rad(&rotf);
-
-	float cRot = cosf(rotf);
-	float sRot = sinf(rotf);
+	const float cRot = m_rot_cos;
+	const float sRot = m_rot_sin;
 
 	m_accel[0] = cRot * accel[0] + sRot * accel[1];
 	m_accel[1] = cRot * accel[1] - sRot * accel[0];
@@ -144,13 +161,33 @@ void pos_imu_data_cb(float *accel, float *gyro, float *mag) {
 		ahrs_update_initial_orientation(m_accel, m_mag, (ATTITUDE_INFO*)&m_att);
 		m_attitude_init_done = true;
 	} else {
-		//		ahrs_update_mahony_imu(gyro, accel, dt, (ATTITUDE_INFO*)&m_att);
-		ahrs_update_madgwick_imu(m_gyro, m_accel, dt, (ATTITUDE_INFO*)&m_att);
+		bool use_mag = main_config.mag_use && main_config.ahrs_use_mag;
+
+		switch (main_config.ahrs_filter) {
+		case AHRS_FILTER_MAHONY:
+			if (use_mag) {
+				ahrs_update_mahony(m_gyro, m_accel, m_mag, dt, (ATTITUDE_INFO*)&m_att);
+			} else {
+				ahrs_update_mahony_imu(m_gyro, m_accel, dt, (ATTITUDE_INFO*)&m_att);
+			}
+			break;
+
+		case AHRS_FILTER_MADGWICK:
+		default:
+			if (use_mag) {
+				ahrs_update_madgwick(m_gyro, m_accel, m_mag, dt, (ATTITUDE_INFO*)&m_att);
+			} else {
+				ahrs_update_madgwick_imu(m_gyro, m_accel, dt, (ATTITUDE_INFO*)&m_att);
+			}
+			break;
+		}
 	}
 
-	float roll = ahrs_get_roll((ATTITUDE_INFO*)&m_att);
-	float pitch = ahrs_get_pitch((ATTITUDE_INFO*)&m_att);
-	float yaw = ahrs_get_yaw((ATTITUDE_INFO*)&m_att);
+	float rpy[3];
+	ahrs_get_roll_pitch_yaw(rpy, (ATTITUDE_INFO*)&m_att);
+	float roll = rpy[0];
+	float pitch = rpy[1];
+	float yaw = rpy[2];
 
 	// Apply tilt compensation for magnetometer values and calculate magnetic
 	// field angle. See:
@@ -160,19 +197,31 @@ void pos_imu_data_cb(float *accel, float *gyro, float *mag) {
 	float my = m_mag[1];
 	float mz = m_mag[2];
 
-	float sr = sinf(roll);
-	float cr = cosf(roll);
-	float sp = sinf(pitch);
-	float cp = cosf(pitch);
+	float sr, cr, sp, cp;
+#if AHRS_FAST_MATH
+	utils_fast_sincos_better(roll, &sr, &cr);
+	utils_fast_sincos_better(pitch, &sp, &cp);
+#else
+	sr = sinf(roll);
+	cr = cosf(roll);
+	sp = sinf(pitch);
+	cp = cosf(pitch);
+#endif
 
 	float c_mx = mx * cp + my * sr * sp + mz * sp * cr;
 	float c_my = my * cr - mz * sr;
 
+#if AHRS_FAST_MATH
+	float yaw_mag = utils_fast_atan2(-c_my, c_mx) - (float)M_PI / 2.0f;
+#else
 	float yaw_mag = atan2f(-c_my, c_mx) - M_PI / 2.0;
+#endif
 
 	const float quaternions[4] = {m_att.q0, m_att.q1, m_att.q2, m_att.q3};
 
-	pos_correction_imu(roll, pitch, yaw, yaw_mag, m_gyro, quaternions, dt);
+	pos_correction_imu(roll, pitch, yaw, yaw_mag, m_gyro, quaternions, dt, time_us);
+
+	TRACE_END(TRACE_EV_IMU_DATA, 0);
 }
 
 void cmd_terminal_reset_attitude(int argc, const char **argv) {
@@ -181,3 +230,107 @@ void cmd_terminal_reset_attitude(int argc, const char **argv) {
 	m_attitude_init_done = false;
 	terminal_printf("OK");
 }
+
+/*
+ * Runs the filters on a copy of the current attitude with a constant
+ * rotation rate, so the quaternion moves through many orientations. The
+ * 9-DOF variants use the last magnetometer sample and fall back to 6-DOF
+ * when it is zero, which is said in the output. Cycle counts include
+ * interrupts that happen during the measurement. Accuracy on recorded data
+ * is measured on the host with test/ahrs_replay.
+ */
+static void cmd_terminal_ahrs_bench(int argc, const char **argv) {
+	int iterations = 1000;
+
+	if (argc == 2) {
+		if (!terminal_arg_int(argv[1], 1, 100000, &iterations)) {
+			return;
+		}
+	} else if (argc != 1) {
+		terminal_wrong_args();
+		return;
+	}
+
+	static const char *filter_names[] = {"Madgwick", "Madgwick9", "Mahony", "Mahony9"};
+	const float dt = 0.0025;
+
+	terminal_printf("Fast math is %s in this build, %d iterations",
+			AHRS_FAST_MATH ? "enabled" : "disabled", iterations);
+	if (m_mag[0] == 0.0 && m_mag[1] == 0.0 && m_mag[2] == 0.0) {
+		terminal_printf("No magnetometer data, Madgwick9 and Mahony9 run as 6-DOF");
+	}
+	terminal_printf("   filter update cyc  rpy libm cyc  rpy fast cyc  max err deg");
+
+	for (int f = 0;f < 4;f++) {
+		ATTITUDE_INFO att = m_att;
+		uint64_t cyc_update = 0, cyc_precise = 0, cyc_fast = 0;
+		float err_max = 0.0;
+
+		for (int i = 0;i < iterations;i++) {
+			float gyro[3] = {0.3, -0.2, 0.5};
+			float accel[3] = {m_accel[0], m_accel[1], m_accel[2]};
+			float mag[3] = {m_mag[0], m_mag[1], m_mag[2]};
+			float rpy_precise[3], rpy_fast[3];
+
+			uint32_t t = DWT->CYCCNT;
+			switch (f) {
+			case 0: ahrs_update_madgwick_imu(gyro, accel, dt, &att); break;
+			case 1: ahrs_update_madgwick(gyro, accel, mag, dt, &att); break;
+			case 2: ahrs_update_mahony_imu(gyro, accel, dt, &att); break;
+			default: ahrs_update_mahony(gyro, accel, mag, dt, &att); break;
+			}
+			cyc_update += DWT->CYCCNT - t;
+
+			t = DWT->CYCCNT;
+			ahrs_get_roll_pitch_yaw_precise(rpy_precise, &att);
+			cyc_precise += DWT->CYCCNT - t;
+
+			t = DWT->CYCCNT;
+			ahrs_get_roll_pitch_yaw_fast(rpy_fast, &att);
+			cyc_fast += DWT->CYCCNT - t;
+
+			for (int j = 0;j < 3;j++) {
+				float err = fabsf(utils_angle_difference_rad(rpy_fast[j], rpy_precise[j]));
+				if (err > err_max) {
+					err_max = err;
+				}
+			}
+		}
+
+		terminal_printf("%9s %10.1f %13.1f %13.1f %12.4f",
+				filter_names[f],
+				(double)cyc_update / (double)iterations,
+				(double)cyc_precise / (double)iterations,
+				(double)cyc_fast / (double)iterations,
+				(double)(err_max * 180.0 / M_PI));
+	}
+
+	// Tilt compensation
+	uint64_t cyc_precise = 0, cyc_fast = 0;
+	float err_max = 0.0;
+
+	for (int i = 0;i < iterations;i++) {
+		float ang = -M_PI + 2.0 * M_PI * (float)i / (float)iterations;
+		float s_precise, c_precise, s_fast, c_fast;
+
+		uint32_t t = DWT->CYCCNT;
+		s_precise = sinf(ang);
+		c_precise = cosf(ang);
+		cyc_precise += DWT->CYCCNT - t;
+
+		t = DWT->CYCCNT;
+		utils_fast_sincos_better(ang, &s_fast, &c_fast);
+		cyc_fast += DWT->CYCCNT - t;
+
+		float err = fmaxf(fabsf(s_fast - s_precise), fabsf(c_fast - c_precise));
+		if (err > err_max) {
+			err_max = err;
+		}
+	}
+
+	terminal_printf("sin+cos: libm %.1f cyc, fast %.1f cyc, max err %.5f",
+			(double)cyc_precise / (double)iterations,
+			(double)cyc_fast / (double)iterations,
+			(double)err_max);
+	terminal_printf(" ");
+}
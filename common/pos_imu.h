@@ -19,8 +19,10 @@
 #ifndef POS_IMU_H_
 #define POS_IMU_H_
 
+#include <stdint.h>
+
 void pos_imu_init(void);
-void pos_imu_data_cb(float *accel, float *gyro, float *mag);
+void pos_imu_data_cb(float *accel, float *gyro, float *mag, float dt, uint64_t time_us);
 void pos_imu_get(float *accel, float *gyro, float *mag);
 
 #endif /* POS_IMU_H_ */
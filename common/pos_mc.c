@@ -19,43 +19,139 @@
 #include "pos_mc.h"
 #include "pos.h"
 #include "conf_general.h"
-#include "servo_pwm.h"
+#include "drive.h"
+#include "terminal.h"
+#include "ch.h"
 #include <string.h>
 #include <math.h>
 
+/*
+ * Odometry comes from the CAN status broadcasts of the VESC when they
+ * include the tachometer (CAN_PACKET_STATUS_5), at the broadcast rate of
+ * the VESC. Polled COMM_GET_VALUES responses are used for odometry only
+ * while no broadcasts arrive, and otherwise just refresh the remaining
+ * fields of mc_values.
+ *
+ * Differential and 4WD vehicles need the broadcasts of all drive VESCs.
+ * The distance of each wheel is accumulated until the next broadcast of
+ * the first wheel, then the sides are averaged and the heading change
+ * comes from the difference between them. Without broadcasts they fall
+ * back to the polled values of a single VESC like Ackermann vehicles, so
+ * the distance is still tracked but the heading change only comes from
+ * the steering command.
+ */
+
+// Settings
+#define STATUS_TIMEOUT_MS		100
+
 // Private variables
 static mc_values m_mc_val;
+static int m_status_id;
+static systime_t m_status_last;
+static float m_last_tacho;
+static bool m_tacho_read;
+static float m_wheel_last_tacho[DRIVE_WHEELS_MAX];
+static bool m_wheel_tacho_read[DRIVE_WHEELS_MAX];
+static float m_wheel_dist[DRIVE_WHEELS_MAX];
+static float m_wheel_rpm[DRIVE_WHEELS_MAX];
+static bool m_polled_warning_done;
+
+// Private functions
+static void update_odometry(float tacho, float rpm);
+static void update_wheel_odometry(can_status_msg *stat);
+static float tacho_to_m(float tacho);
+static float rpm_to_mps(float rpm);
 
 void pos_mc_init(void) {
 	memset(&m_mc_val, 0, sizeof(m_mc_val));
+	m_status_id = -1;
+	m_status_last = 0;
+	m_last_tacho = 0;
+	m_tacho_read = false;
+	memset(m_wheel_last_tacho, 0, sizeof(m_wheel_last_tacho));
+	memset(m_wheel_tacho_read, 0, sizeof(m_wheel_tacho_read));
+	memset(m_wheel_dist, 0, sizeof(m_wheel_dist));
+	memset(m_wheel_rpm, 0, sizeof(m_wheel_rpm));
+	m_polled_warning_done = false;
 }
 
 void pos_mc_values_cb(mc_values *val) {
+	bool status_active = pos_mc_status_active();
+
 	m_mc_val = *val;
 
-	static float last_tacho = 0;
-	static bool tacho_read = false;
-	float tacho = m_mc_val.tachometer;
-	float rpm = m_mc_val.rpm;
+	if (!status_active) {
+		if (main_config.drive.type != DRIVE_ACKERMANN && !m_polled_warning_done) {
+			m_polled_warning_done = true;
+			terminal_printf("Warning: no VESC status broadcasts (CAN_PACKET_STATUS_5), "
+					"odometry uses the polled values of one wheel");
+		}
 
-	// Reset tacho the first time.
-	if (!tacho_read) {
-		tacho_read = true;
-		last_tacho = tacho;
+		update_odometry(m_mc_val.tachometer, m_mc_val.rpm);
 	}
+}
 
-	float distance = (tacho - last_tacho) * main_config.car.gear_ratio
-			* (2.0 / main_config.car.motor_poles) * (1.0 / 6.0)
-			* main_config.car.wheel_diam * M_PI;
-	last_tacho = tacho;
+/**
+ * Handle a VESC status broadcast, see comm_can_set_status_func. With
+ * VESC_ID set to ID_ALL the first VESC that broadcasts is followed until
+ * it goes quiet. Differential and 4WD vehicles follow the VESCs in
+ * drive.vesc_id.
+ */
+void pos_mc_status_cb(can_status_msg *stat) {
+	if (!stat->tacho_valid) {
+		return;
+	}
+
+	if (main_config.drive.type != DRIVE_ACKERMANN) {
+		update_wheel_odometry(stat);
+		return;
+	}
+
+	if (!pos_mc_status_active()) {
+		if (stat->id != m_status_id) {
+			m_tacho_read = false;
+		}
+		m_status_id = stat->id;
+	} else if (stat->id != m_status_id) {
+		return;
+	}
+
+	m_status_last = chVTGetSystemTimeX();
+
+	m_mc_val.rpm = stat->rpm;
+	m_mc_val.current_motor = stat->current;
+	m_mc_val.duty_now = stat->duty;
+	m_mc_val.tachometer = stat->tachometer;
+	m_mc_val.v_in = stat->v_in;
+	m_mc_val.vesc_id = stat->id;
+	m_mc_val.rx_time_us = stat->rx_time_us;
+
+	update_odometry(stat->tachometer, stat->rpm);
+}
+
+/**
+ * Check if odometry currently comes from status broadcasts, in which case
+ * COMM_GET_VALUES only has to be polled for the other fields.
+ */
+bool pos_mc_status_active(void) {
+	return m_status_id >= 0 &&
+			chVTTimeElapsedSinceX(m_status_last) < TIME_MS2I(STATUS_TIMEOUT_MS);
+}
+
+static void update_odometry(float tacho, float rpm) {
+	// Reset tacho the first time, and when following another VESC.
+	if (!m_tacho_read) {
+		m_tacho_read = true;
+		m_last_tacho = tacho;
+	}
+
+	float distance = tacho_to_m(tacho - m_last_tacho);
+	m_last_tacho = tacho;
 
 	float angle_diff = 0.0;
 	float turn_rad_rear = 0.0;
 
-	float steering_angle = (servo_pwm_get(0) // TODO: generalize
-			- main_config.car.steering_center)
-			* ((2.0 * main_config.car.steering_max_angle_rad)
-					/ main_config.car.steering_range);
+	float steering_angle = drive_get_steering_angle();
 
 	if (fabsf(steering_angle) >= 1e-6) {
 		turn_rad_rear = main_config.car.axis_distance / tanf(steering_angle);
@@ -70,11 +166,74 @@ void pos_mc_values_cb(mc_values *val) {
 		angle_diff = (distance * 2.0) / (turn_rad_rear + turn_rad_front);
 	}
 
-	float speed = rpm * main_config.car.gear_ratio
-			* (2.0 / main_config.car.motor_poles) * (1.0 / 60.0)
+	pos_correction_mc(distance, turn_rad_rear, angle_diff, rpm_to_mps(rpm));
+}
+
+static void update_wheel_odometry(can_status_msg *stat) {
+	int wheel = drive_wheel_index(stat->id);
+	if (wheel < 0) {
+		return;
+	}
+
+	if (!m_wheel_tacho_read[wheel]) {
+		m_wheel_tacho_read[wheel] = true;
+		m_wheel_last_tacho[wheel] = stat->tachometer;
+	}
+
+	m_wheel_dist[wheel] += tacho_to_m(stat->tachometer - m_wheel_last_tacho[wheel]);
+	m_wheel_last_tacho[wheel] = stat->tachometer;
+	m_wheel_rpm[wheel] = stat->rpm;
+
+	// The first wheel paces the updates
+	if (wheel != 0) {
+		return;
+	}
+
+	m_status_id = stat->id;
+	m_status_last = chVTGetSystemTimeX();
+
+	// Start over from the polled tachometer if the broadcasts stop
+	m_tacho_read = false;
+
+	const int wheels = drive_wheel_num();
+	float side_dist[2] = {0.0, 0.0};
+	float rpm = 0.0;
+
+	for (int i = 0;i < wheels;i++) {
+		side_dist[i & 1] += m_wheel_dist[i] / (float)(wheels / 2);
+		rpm += m_wheel_rpm[i] / (float)wheels;
+		m_wheel_dist[i] = 0.0;
+	}
+
+	m_mc_val.rpm = rpm;
+	m_mc_val.current_motor = stat->current;
+	m_mc_val.duty_now = stat->duty;
+	m_mc_val.tachometer = stat->tachometer;
+	m_mc_val.v_in = stat->v_in;
+	m_mc_val.vesc_id = stat->id;
+	m_mc_val.rx_time_us = stat->rx_time_us;
+
+	float distance = (side_dist[0] + side_dist[1]) / 2.0;
+	float angle_diff = (side_dist[1] - side_dist[0]) / main_config.car.axis_distance;
+	float turn_rad = 0.0;
+
+	if (fabsf(angle_diff) >= 1e-6) {
+		turn_rad = distance / angle_diff;
+	}
+
+	pos_correction_mc(distance, turn_rad, angle_diff, rpm_to_mps(rpm));
+}
+
+static float tacho_to_m(float tacho) {
+	return tacho * main_config.car.gear_ratio
+			* (2.0 / main_config.car.motor_poles) * (1.0 / 6.0)
 			* main_config.car.wheel_diam * M_PI;
+}
 
-	pos_correction_mc(distance, turn_rad_rear, angle_diff, speed);
+static float rpm_to_mps(float rpm) {
+	return rpm * main_config.car.gear_ratio
+			* (2.0 / main_config.car.motor_poles) * (1.0 / 60.0)
+			* main_config.car.wheel_diam * M_PI;
 }
 
 void pos_mc_get(mc_values *val) {
@@ -23,6 +23,8 @@
 
 void pos_mc_init(void);
 void pos_mc_values_cb(mc_values *val);
+void pos_mc_status_cb(can_status_msg *stat);
+bool pos_mc_status_active(void);
 void pos_mc_get(mc_values *val);
 
 #endif /* POS_MC_H_ */
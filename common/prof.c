@@ -0,0 +1,187 @@
+/*
+	Copyright 2021 Marvin Damschen	marvin.damschen@ri.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "prof.h"
+#include "hal.h"
+#include "terminal.h"
+
+#include <string.h>
+
+/*
+ * Per-thread CPU time and wakeup latency.
+ *
+ * Run time is measured with the DWT cycle counter in the kernel context
+ * switch hook and stored in the profiling fields that cfg/chconf.h adds to
+ * thread_t. Interrupt time is accounted to the thread it interrupted.
+ *
+ * Wakeup latency is the time between the deadline a periodic thread asked
+ * to be woken at and the time it actually runs. Threads report it by
+ * sleeping through prof_sleep/prof_sleep_until_windowed or by calling
+ * prof_wakeup. The resolution is one system tick (100 us at 10 kHz), bins
+ * are powers of two in ticks: 0, 1, 2-3, 4-7, ..., >= 64.
+ */
+
+// Private variables
+static uint32_t m_last_switch_cycles;
+
+// Private functions
+static void terminal_prof(int argc, const char **argv);
+
+void prof_init(void) {
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+	prof_reset();
+
+	terminal_register_command_callback(
+			"prof",
+			"Print CPU load and wakeup latency per thread. Use reset to clear the counters.",
+			"[reset]",
+			terminal_prof);
+}
+
+/**
+ * Clear the run time and latency statistics of all threads.
+ */
+void prof_reset(void) {
+	thread_t *tp = chRegFirstThread();
+	do {
+		chSysLock();
+		tp->prof_cycles = 0;
+		tp->prof_switches = 0;
+		tp->prof_lat_max = 0;
+		memset(tp->prof_lat_hist, 0, sizeof(tp->prof_lat_hist));
+		chSysUnlock();
+		tp = chRegNextThread(tp);
+	} while (tp != NULL);
+}
+
+/**
+ * Called from CH_CFG_CONTEXT_SWITCH_HOOK with the kernel locked. Keep short.
+ */
+void prof_context_switch(thread_t *ntp, thread_t *otp) {
+	uint32_t now = DWT->CYCCNT;
+	otp->prof_cycles += now - m_last_switch_cycles;
+	m_last_switch_cycles = now;
+	ntp->prof_switches++;
+}
+
+/**
+ * Record the wakeup latency of the calling thread.
+ *
+ * @param deadline
+ * The system time the thread should have woken up at.
+ */
+void prof_wakeup(systime_t deadline) {
+	thread_t *tp = chThdGetSelfX();
+	sysinterval_t late = chTimeDiffX(deadline, chVTGetSystemTimeX());
+
+	// Woken early, e.g. the deadline wrapped
+	if (late > TIME_MAX_INTERVAL / 2) {
+		late = 0;
+	}
+
+	int bin = 0;
+	while (late >> bin && bin < (PROF_LAT_BINS - 1)) {
+		bin++;
+	}
+
+	if (tp->prof_lat_hist[bin] < UINT16_MAX) {
+		tp->prof_lat_hist[bin]++;
+	}
+
+	uint32_t late_us = TIME_I2US(late);
+	if (late_us > tp->prof_lat_max) {
+		tp->prof_lat_max = late_us;
+	}
+}
+
+/**
+ * chThdSleep that records the wakeup latency.
+ */
+void prof_sleep(sysinterval_t time) {
+	systime_t deadline = chTimeAddX(chVTGetSystemTimeX(), time);
+	chThdSleepUntil(deadline);
+	prof_wakeup(deadline);
+}
+
+/**
+ * chThdSleepUntilWindowed that records the wakeup latency.
+ */
+systime_t prof_sleep_until_windowed(systime_t prev, systime_t next) {
+	systime_t res = chThdSleepUntilWindowed(prev, next);
+	prof_wakeup(next);
+	return res;
+}
+
+/**
+ * Get the number of cycles accounted to all threads since the last reset.
+ */
+uint64_t prof_get_total_cycles(void) {
+	uint64_t total = 0;
+
+	thread_t *tp = chRegFirstThread();
+	do {
+		total += tp->prof_cycles;
+		tp = chRegNextThread(tp);
+	} while (tp != NULL);
+
+	return total;
+}
+
+static void terminal_prof(int argc, const char **argv) {
+	if (argc == 2) {
+		if (strcmp(argv[1], "reset") == 0) {
+			prof_reset();
+			terminal_printf("OK\n");
+		} else {
+			terminal_printf("Invalid argument %s\n", argv[1]);
+		}
+		return;
+	} else if (argc != 1) {
+		terminal_printf("Wrong number of arguments\n");
+		return;
+	}
+
+	uint64_t total = prof_get_total_cycles();
+	if (total == 0) {
+		total = 1;
+	}
+
+	terminal_printf("Measured %.2f s, latency bins in ticks: 0 1 2 4 8 16 32 64+",
+			(double)total / (double)STM32_SYSCLK);
+	terminal_printf("              name prio  load %%   switches  lat max us  latency histogram");
+	terminal_printf("-----------------------------------------------------------------------------");
+
+	thread_t *tp = chRegFirstThread();
+	do {
+		terminal_printf("%18s %4lu %7.2f %10lu %11lu  %u %u %u %u %u %u %u %u",
+				tp->name == NULL ? "" : tp->name,
+				(uint32_t)tp->prio,
+				(double)tp->prof_cycles * 100.0 / (double)total,
+				tp->prof_switches,
+				tp->prof_lat_max,
+				tp->prof_lat_hist[0], tp->prof_lat_hist[1],
+				tp->prof_lat_hist[2], tp->prof_lat_hist[3],
+				tp->prof_lat_hist[4], tp->prof_lat_hist[5],
+				tp->prof_lat_hist[6], tp->prof_lat_hist[7]);
+		tp = chRegNextThread(tp);
+	} while (tp != NULL);
+
+	terminal_printf(" ");
+}
@@ -0,0 +1,36 @@
+/*
+	Copyright 2021 Marvin Damschen	marvin.damschen@ri.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PROF_H_
+#define PROF_H_
+
+#include "ch.h"
+#include "datatypes.h"
+
+// Settings
+#define PROF_LAT_BINS				8 // must match prof_lat_hist in chconf.h
+
+// Functions
+void prof_init(void);
+void prof_reset(void);
+void prof_context_switch(thread_t *ntp, thread_t *otp);
+void prof_wakeup(systime_t deadline);
+void prof_sleep(sysinterval_t time);
+systime_t prof_sleep_until_windowed(systime_t prev, systime_t next);
+uint64_t prof_get_total_cycles(void);
+
+#endif /* PROF_H_ */
@@ -20,32 +20,42 @@
 #include "servo_pwm.h"
 #include "ch.h"
 #include "hal.h"
-#include "conf_general.h"
 #include "utils.h"
 
+/*
+ * Ramping runs in the update interrupt of the PWM timer, so every PWM
+ * period moves a ramping channel by a fixed step. The interrupt is only
+ * enabled while a channel on that timer is ramping.
+ */
+
 // Settings
 #define SERVO_OUT_PULSE_MIN_US		1000 // TODO -> main_config
 #define SERVO_OUT_PULSE_MAX_US		2000
 #define SERVO_UPDATE_RATE			200	// Hz
 #define TIM_CLOCK				1000000 // Hz
 #define ALL_CHANNELS			0xFF
-#define RAMP_LOOP_HZ			50 // Hz
+#define CHANNELS				4
 
 // Private variables
 static bool m_safety_stop;
 static float m_safe_stop_pulse_width;
-static float m_pulse_width_ramp_towards[4] = {0.0, 0.0, 0.0, 0.0};
-static float m_pulse_width_current[4] = {0.0, 0.0, 0.0, 0.0};
-static THD_WORKING_AREA(ramp_thread_wa, 128);
+static float m_pulse_width_ramp_towards[CHANNELS] = {0.0, 0.0, 0.0, 0.0};
+static float m_pulse_width_current[CHANNELS] = {0.0, 0.0, 0.0, 0.0};
+static float m_ramp_step[CHANNELS] = {0.0, 0.0, 0.0, 0.0}; // Per PWM period, 0 for no ramping
+static PWMDriver * const m_pwm_drivers[CHANNELS] = {&PWMD3, &PWMD3, &PWMD9, &PWMD9};
+static const pwmchannel_t m_pwm_channels[CHANNELS] = {2, 3, 0, 1};
 
 // Private functions
-static THD_FUNCTION(ramp_thread, arg);
-static inline void __servo_pwm_set_io(uint8_t channel, float pulse_width);
+static void set_io_i(uint8_t channel, float pulse_width);
+static void ramp_start_i(uint8_t channel);
+static void ramp_update_i(PWMDriver *pwmp, uint8_t first_channel);
+static void pwm3_period_cb(PWMDriver *pwmp);
+static void pwm9_period_cb(PWMDriver *pwmp);
 
 static PWMConfig pwmcfg3 = {
 		TIM_CLOCK,
 		(uint16_t)((uint32_t)TIM_CLOCK / (uint32_t)SERVO_UPDATE_RATE),
-		NULL,
+		pwm3_period_cb,
 		{
 				{PWM_OUTPUT_DISABLED, NULL},
 				{PWM_OUTPUT_DISABLED, NULL},
@@ -62,7 +72,7 @@ static PWMConfig pwmcfg3 = {
 static PWMConfig pwmcfg9 = {
 		TIM_CLOCK,
 		(uint16_t)((uint32_t)TIM_CLOCK / (uint32_t)SERVO_UPDATE_RATE),
-		NULL,
+		pwm9_period_cb,
 		{
 				{PWM_OUTPUT_DISABLED, NULL},
 				{PWM_OUTPUT_DISABLED, NULL},
@@ -95,8 +105,6 @@ void servo_pwm_init(uint8_t servo_enable_mask, float safe_stop_pulse_width) {
 
 	pwmStart(&PWMD3, &pwmcfg3);
 	pwmStart(&PWMD9, &pwmcfg9);
-
-	chThdCreateStatic(ramp_thread_wa, sizeof(ramp_thread_wa), NORMALPRIO, ramp_thread, NULL);
 }
 
 void servo_pwm_set_all(float pulse_width) {
@@ -118,67 +126,20 @@ void servo_pwm_set_all(float pulse_width) {
  */
 void servo_pwm_set(uint8_t channel, float pulse_width) {
 	utils_truncate_number(&pulse_width, 0.0, 1.0);
-	if (channel == ALL_CHANNELS) {
-		m_pulse_width_ramp_towards[0] = pulse_width;
-		m_pulse_width_ramp_towards[1] = pulse_width;
-		m_pulse_width_ramp_towards[2] = pulse_width;
-		m_pulse_width_ramp_towards[3] = pulse_width;
-	} else
-		m_pulse_width_ramp_towards[channel] = pulse_width;
-
-	__servo_pwm_set_io(channel, pulse_width);
-}
-
-void __servo_pwm_set_io(uint8_t channel, float pulse_width) {
-	uint32_t cnt_val;
 
-	if (m_safety_stop) {
-		return;
-	} else {
-		cnt_val = ((TIM_CLOCK / 1e3) * (uint32_t)SERVO_OUT_PULSE_MIN_US) / 1e3 +
-				((TIM_CLOCK / 1e3) * (uint32_t)(pulse_width * (float)(SERVO_OUT_PULSE_MAX_US -
-						SERVO_OUT_PULSE_MIN_US))) / 1e3;
-	}
-
-	switch(channel) {
-	case 0:
-		pwmEnableChannel(&PWMD3, 2, cnt_val);
-		m_pulse_width_current[0] = pulse_width;
-		break;
-
-	case 1:
-		pwmEnableChannel(&PWMD3, 3, cnt_val);
-		m_pulse_width_current[1] = pulse_width;
-		break;
-
-	case 2:
-		pwmEnableChannel(&PWMD9, 0, cnt_val);
-		m_pulse_width_current[2] = pulse_width;
-		break;
-
-	case 3:
-		pwmEnableChannel(&PWMD9, 1, cnt_val);
-		m_pulse_width_current[3] = pulse_width;
-		break;
-
-	case ALL_CHANNELS:
-		pwmEnableChannel(&PWMD3, 2, cnt_val);
-		pwmEnableChannel(&PWMD3, 3, cnt_val);
-		pwmEnableChannel(&PWMD9, 0, cnt_val);
-		pwmEnableChannel(&PWMD9, 1, cnt_val);
-		m_pulse_width_current[0] = pulse_width;
-		m_pulse_width_current[1] = pulse_width;
-		m_pulse_width_current[2] = pulse_width;
-		m_pulse_width_current[3] = pulse_width;
-		break;
-
-	default:
-		break;
+	chSysLock();
+	for (uint8_t i = 0;i < CHANNELS;i++) {
+		if (channel == i || channel == ALL_CHANNELS) {
+			m_pulse_width_ramp_towards[i] = pulse_width;
+			set_io_i(i, pulse_width);
+		}
 	}
+	chSysUnlock();
 }
 
 /**
- * Set output pulsewidth with ramping.
+ * Set output pulsewidth with ramping. Channels without a ramp time are set
+ * directly.
  *
  * @param channel
  * Channel to use
@@ -192,13 +153,44 @@ void __servo_pwm_set_io(uint8_t channel, float pulse_width) {
  */
 void servo_pwm_set_ramped(uint8_t channel, float pulse_width) {
 	utils_truncate_number(&pulse_width, 0.0, 1.0);
-	if (channel == ALL_CHANNELS) {
-		m_pulse_width_ramp_towards[0] = pulse_width;
-		m_pulse_width_ramp_towards[1] = pulse_width;
-		m_pulse_width_ramp_towards[2] = pulse_width;
-		m_pulse_width_ramp_towards[3] = pulse_width;
-	} else
-		m_pulse_width_ramp_towards[channel] = pulse_width;
+
+	chSysLock();
+	for (uint8_t i = 0;i < CHANNELS;i++) {
+		if (channel == i || channel == ALL_CHANNELS) {
+			m_pulse_width_ramp_towards[i] = pulse_width;
+			ramp_start_i(i);
+		}
+	}
+	chSysUnlock();
+}
+
+/**
+ * Set the ramp time of a channel.
+ *
+ * @param channel
+ * Channel to use
+ * Range: [0 - 3]
+ * 0xFF: All Channels
+ *
+ * @param ramp_time
+ * Time in seconds to ramp over the full pulsewidth range. 0 disables
+ * ramping.
+ *
+ */
+void servo_pwm_set_ramp_time(uint8_t channel, float ramp_time) {
+	float step = 0.0;
+	if (ramp_time > 1e-6) {
+		step = 1.0 / ((float)SERVO_UPDATE_RATE * ramp_time);
+	}
+
+	chSysLock();
+	for (uint8_t i = 0;i < CHANNELS;i++) {
+		if (channel == i || channel == ALL_CHANNELS) {
+			m_ramp_step[i] = step;
+			ramp_start_i(i);
+		}
+	}
+	chSysUnlock();
 }
 
 float servo_pwm_get(uint8_t id) {
@@ -213,23 +205,73 @@ void servo_pwm_safety_stop(void) {
 	m_safety_stop = true;
 }
 void servo_pwm_reset_safety_stop(void) {
+	chSysLock();
 	m_safety_stop = false;
+	for (uint8_t i = 0;i < CHANNELS;i++) {
+		ramp_start_i(i);
+	}
+	chSysUnlock();
+}
+
+static void set_io_i(uint8_t channel, float pulse_width) {
+	// Not started, e.g. when the pins are used for DShot
+	if (m_safety_stop || m_pwm_drivers[channel]->state != PWM_READY) {
+		return;
+	}
+
+	uint32_t cnt_val = ((TIM_CLOCK / 1e3) * (uint32_t)SERVO_OUT_PULSE_MIN_US) / 1e3 +
+			((TIM_CLOCK / 1e3) * (uint32_t)(pulse_width * (float)(SERVO_OUT_PULSE_MAX_US -
+					SERVO_OUT_PULSE_MIN_US))) / 1e3;
+
+	pwmEnableChannelI(m_pwm_drivers[channel], m_pwm_channels[channel], cnt_val);
+	m_pulse_width_current[channel] = pulse_width;
 }
 
-static THD_FUNCTION(ramp_thread, arg) {
-	(void)arg;
+static void ramp_start_i(uint8_t channel) {
+	if (m_pulse_width_current[channel] == m_pulse_width_ramp_towards[channel]) {
+		return;
+	}
+
+	if (m_ramp_step[channel] > 0.0) {
+		pwmEnablePeriodicNotificationI(m_pwm_drivers[channel]);
+	} else {
+		set_io_i(channel, m_pulse_width_ramp_towards[channel]);
+	}
+}
 
-	chRegSetThreadName("servo_pwm ramp");
+static void ramp_update_i(PWMDriver *pwmp, uint8_t first_channel) {
+	bool ramping = false;
 
-	for(;;) {
-		for (int i = 0; i < 4; i++) {
-			const float pos_prev = m_pulse_width_current[i];
-			utils_step_towards(&m_pulse_width_current[i], m_pulse_width_ramp_towards[i], 1.0 / ((float)RAMP_LOOP_HZ * main_config.car.steering_ramp_time));
+	for (uint8_t i = first_channel;i < first_channel + 2;i++) {
+		if (m_pulse_width_current[i] == m_pulse_width_ramp_towards[i]) {
+			continue;
+		}
 
-			if (m_pulse_width_current[i] != pos_prev)
-				__servo_pwm_set_io(i, m_pulse_width_current[i]);
+		float pulse_width = m_pulse_width_current[i];
+		if (m_ramp_step[i] > 0.0) {
+			utils_step_towards(&pulse_width, m_pulse_width_ramp_towards[i], m_ramp_step[i]);
+		} else {
+			pulse_width = m_pulse_width_ramp_towards[i];
 		}
 
-		chThdSleep(CH_CFG_ST_FREQUENCY / RAMP_LOOP_HZ);
+		set_io_i(i, pulse_width);
+		ramping |= m_pulse_width_current[i] != m_pulse_width_ramp_towards[i];
 	}
+
+	// Started again by servo_pwm_reset_safety_stop
+	if (!ramping || m_safety_stop) {
+		pwmDisablePeriodicNotificationI(pwmp);
+	}
+}
+
+static void pwm3_period_cb(PWMDriver *pwmp) {
+	chSysLockFromISR();
+	ramp_update_i(pwmp, 0);
+	chSysUnlockFromISR();
+}
+
+static void pwm9_period_cb(PWMDriver *pwmp) {
+	chSysLockFromISR();
+	ramp_update_i(pwmp, 2);
+	chSysUnlockFromISR();
 }
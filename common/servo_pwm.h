@@ -26,6 +26,7 @@
 void servo_pwm_init(uint8_t servo_enable_mask, float safe_stop_pulse_width);
 void servo_pwm_set(uint8_t id, float pulse_width);
 void servo_pwm_set_ramped(uint8_t id, float pulse_width);
+void servo_pwm_set_ramp_time(uint8_t id, float ramp_time);
 float servo_pwm_get(uint8_t id);
 void servo_pwm_set_all(float pulse_width);
 void servo_pwm_safety_stop(void);
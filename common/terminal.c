@@ -22,9 +22,11 @@
 #include "terminal.h"
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 // Settings
 #define CALLBACK_LEN						80
+#define HASH_LEN							128 // Power of two, well above CALLBACK_LEN
 
 // Private types
 typedef struct _terminal_callback_struct {
@@ -38,6 +40,19 @@ typedef struct _terminal_callback_struct {
 static void(*m_vprintf)(const char* format, va_list args) = 0;
 static terminal_callback_struct callbacks[CALLBACK_LEN];
 static int callback_write = 0;
+static int callback_num = 0;
+static uint8_t m_hash[HASH_LEN]; // Callback index + 1, 0 is empty
+static const terminal_callback_struct *m_current = 0;
+
+// Private functions
+static uint32_t hash_str(const char *str);
+static int hash_find(const char *command);
+static void hash_rebuild(void);
+static void print_command_help(const terminal_callback_struct *cb);
+static void print_usage(void);
+
+_Static_assert((HASH_LEN & (HASH_LEN - 1)) == 0, "HASH_LEN must be a power of two");
+_Static_assert(HASH_LEN > CALLBACK_LEN, "HASH_LEN must be larger than CALLBACK_LEN");
 
 void terminal_set_vprintf(void(*vprintf)(const char* format, va_list args)) {
 	m_vprintf = vprintf;
@@ -99,10 +114,17 @@ void terminal_process_string(char *str) {
 	}
 
 	// The help command
-	else if (strcmp(argv[0], "help") == 0) {
+	else if (strcmp(argv[0], "help") == 0 && argc == 2) {
+		int ind = hash_find(argv[1]);
+		if (ind >= 0) {
+			print_command_help(&callbacks[ind]);
+		} else {
+			terminal_printf("Invalid command: %s\n", argv[1]);
+		}
+	} else if (strcmp(argv[0], "help") == 0) {
 		terminal_printf("Valid commands are:");
-		terminal_printf("help");
-		terminal_printf("  Show this help");
+		terminal_printf("help [command]");
+		terminal_printf("  Show this help, or the help for one command");
 
 		terminal_printf("ping");
 		terminal_printf("  Print pong here to see if the reply works");
@@ -113,32 +135,19 @@ void terminal_process_string(char *str) {
 		terminal_printf("threads");
 		terminal_printf("  List all threads");
 
-		for (int i = 0;i < callback_write;i++) {
-			if (callbacks[i].arg_names) {
-				terminal_printf("%s %s", callbacks[i].command, callbacks[i].arg_names);
-			} else {
-				terminal_printf(callbacks[i].command);
-			}
-
-			if (callbacks[i].help) {
-				terminal_printf("  %s", callbacks[i].help);
-			} else {
-				terminal_printf("  There is no help available for this command.");
-			}
+		for (int i = 0;i < callback_num;i++) {
+			print_command_help(&callbacks[i]);
 		}
 
 		terminal_printf(" ");
 	} else {
-		bool found = false;
-		for (int i = 0;i < callback_write;i++) {
-			if (strcmp(argv[0], callbacks[i].command) == 0) {
-				callbacks[i].cbf(argc, (const char**)argv);
-				found = true;
-				break;
-			}
-		}
+		int ind = hash_find(argv[0]);
 
-		if (!found) {
+		if (ind >= 0) {
+			m_current = &callbacks[ind];
+			callbacks[ind].cbf(argc, (const char**)argv);
+			m_current = 0;
+		} else {
 			terminal_printf("Invalid command: %s\n"
 					"type help to list all available commands\n", argv[0]);
 		}
@@ -168,31 +177,199 @@ void terminal_register_command_callback(
 		const char *arg_names,
 		void(*cbf)(int argc, const char **argv)) {
 
-	int callback_num = callback_write;
-
-	for (int i = 0;i < callback_write;i++) {
-		// First check the address in case the same callback is registered more than once.
-		if (callbacks[i].command == command) {
-			callback_num = i;
-			break;
-		}
+	int ind = hash_find(command);
+	bool is_new = ind < 0;
 
-		// Check by string comparison.
-		if (strcmp(callbacks[i].command, command) == 0) {
-			callback_num = i;
-			break;
-		}
+	if (is_new) {
+		ind = callback_write;
 	}
 
-	callbacks[callback_num].command = command;
-	callbacks[callback_num].help = help;
-	callbacks[callback_num].arg_names = arg_names;
-	callbacks[callback_num].cbf = cbf;
+	// When the table has wrapped an old command is dropped, so its hash
+	// slot has to go as well.
+	bool overwrite = is_new && callback_num == CALLBACK_LEN;
+
+	callbacks[ind].command = command;
+	callbacks[ind].help = help;
+	callbacks[ind].arg_names = arg_names;
+	callbacks[ind].cbf = cbf;
 
-	if (callback_num == callback_write) {
+	if (is_new) {
 		callback_write++;
 		if (callback_write >= CALLBACK_LEN) {
 			callback_write = 0;
 		}
+
+		if (callback_num < CALLBACK_LEN) {
+			callback_num++;
+		}
+
+		if (overwrite) {
+			hash_rebuild();
+		} else {
+			uint32_t slot = hash_str(command) & (HASH_LEN - 1);
+			while (m_hash[slot]) {
+				slot = (slot + 1) & (HASH_LEN - 1);
+			}
+			m_hash[slot] = ind + 1;
+		}
+	}
+}
+
+/**
+ * Parse a boolean command argument. Accepts 0/1, off/on and false/true.
+ * Prints an error and the usage of the running command on failure.
+ *
+ * @param str
+ * The argument string.
+ *
+ * @param res
+ * The parsed value, only written on success.
+ *
+ * @return
+ * true on success, false otherwise.
+ */
+bool terminal_arg_bool(const char *str, bool *res) {
+	if (strcmp(str, "1") == 0 || strcmp(str, "on") == 0 || strcmp(str, "true") == 0) {
+		*res = true;
+		return true;
+	} else if (strcmp(str, "0") == 0 || strcmp(str, "off") == 0 || strcmp(str, "false") == 0) {
+		*res = false;
+		return true;
+	}
+
+	terminal_printf("Invalid argument %s, expected 0 or 1\n", str);
+	print_usage();
+	return false;
+}
+
+/**
+ * Parse an integer command argument and check that it is in range.
+ * Prints an error and the usage of the running command on failure.
+ *
+ * @param str
+ * The argument string.
+ *
+ * @param min
+ * The lowest accepted value.
+ *
+ * @param max
+ * The highest accepted value.
+ *
+ * @param res
+ * The parsed value, only written on success.
+ *
+ * @return
+ * true on success, false otherwise.
+ */
+bool terminal_arg_int(const char *str, int min, int max, int *res) {
+	char *end;
+	long val = strtol(str, &end, 0);
+
+	if (end == str || *end != '\0' || val < min || val > max) {
+		terminal_printf("Invalid argument %s, expected an integer in [%d, %d]\n", str, min, max);
+		print_usage();
+		return false;
+	}
+
+	*res = (int)val;
+	return true;
+}
+
+/**
+ * Parse a float command argument and check that it is in range.
+ * Prints an error and the usage of the running command on failure.
+ *
+ * @param str
+ * The argument string.
+ *
+ * @param min
+ * The lowest accepted value.
+ *
+ * @param max
+ * The highest accepted value.
+ *
+ * @param res
+ * The parsed value, only written on success.
+ *
+ * @return
+ * true on success, false otherwise.
+ */
+bool terminal_arg_float(const char *str, float min, float max, float *res) {
+	char *end;
+	float val = strtof(str, &end);
+
+	if (end == str || *end != '\0' || !(val >= min && val <= max)) {
+		terminal_printf("Invalid argument %s, expected a number in [%.3f, %.3f]\n",
+				str, (double)min, (double)max);
+		print_usage();
+		return false;
+	}
+
+	*res = val;
+	return true;
+}
+
+/**
+ * Print the wrong number of arguments message together with the usage of
+ * the running command.
+ */
+void terminal_wrong_args(void) {
+	terminal_printf("Wrong number of arguments\n");
+	print_usage();
+}
+
+// FNV-1a
+static uint32_t hash_str(const char *str) {
+	uint32_t h = 2166136261U;
+	while (*str) {
+		h ^= (uint8_t)*str++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static int hash_find(const char *command) {
+	uint32_t slot = hash_str(command) & (HASH_LEN - 1);
+
+	while (m_hash[slot]) {
+		int ind = m_hash[slot] - 1;
+		if (strcmp(callbacks[ind].command, command) == 0) {
+			return ind;
+		}
+		slot = (slot + 1) & (HASH_LEN - 1);
+	}
+
+	return -1;
+}
+
+static void hash_rebuild(void) {
+	memset(m_hash, 0, sizeof(m_hash));
+
+	for (int i = 0;i < callback_num;i++) {
+		uint32_t slot = hash_str(callbacks[i].command) & (HASH_LEN - 1);
+		while (m_hash[slot]) {
+			slot = (slot + 1) & (HASH_LEN - 1);
+		}
+		m_hash[slot] = i + 1;
+	}
+}
+
+static void print_command_help(const terminal_callback_struct *cb) {
+	if (cb->arg_names) {
+		terminal_printf("%s %s", cb->command, cb->arg_names);
+	} else {
+		terminal_printf(cb->command);
+	}
+
+	if (cb->help) {
+		terminal_printf("  %s", cb->help);
+	} else {
+		terminal_printf("  There is no help available for this command.");
+	}
+}
+
+static void print_usage(void) {
+	if (m_current && m_current->arg_names) {
+		terminal_printf("Usage: %s %s\n", m_current->command, m_current->arg_names);
 	}
 }
@@ -31,5 +31,9 @@ void terminal_register_command_callback(
 		const char *help,
 		const char *arg_names,
 		void(*cbf)(int argc, const char **argv));
+bool terminal_arg_bool(const char *str, bool *res);
+bool terminal_arg_int(const char *str, int min, int max, int *res);
+bool terminal_arg_float(const char *str, float min, float max, float *res);
+void terminal_wrong_args(void);
 
 #endif /* TERMINAL_H_ */
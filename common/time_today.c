@@ -17,35 +17,125 @@
 	This file uses code from RC_Controller by Benjamin Vedder (pos).
  */
 
+#include "time_today.h"
+#include "timebase.h"
 #include "ch.h"
+#include "hal.h"
+#include "trace.h"
+#include "terminal.h"
 
-#define MS_PER_DAY (24 * 60 * 60 * 1000)
+/*
+ * Time of day is interpolated from the 64-bit cycle count of timebase.
+ *
+ * Each PPS edge is timestamped with the cycle counter in the EXTI callback.
+ * None of the timer channels on the PPS pin is free for input capture
+ * (TIM3_CH3 drives a servo), but the capture latency of the interrupt is a
+ * fixed number of cycles as long as it is not preempted, which is well
+ * below a microsecond.
+ *
+ * At every edge the clock phase is set to the whole second the edge marks
+ * and the cycles per second are updated from the measured edge interval
+ * with a first order FLL. Between edges, and in holdover without PPS, the
+ * estimated cycle rate is used for the interpolation.
+ */
+
+// Settings
+#define US_PER_DAY				(24LL * 60LL * 60LL * 1000000LL)
+#define FLL_GAIN				0.125f
+#define FLL_MAX_PPM				500  // Reject edge intervals further off than this
+#define PHASE_STEP_US			1000 // Larger phase errors count as a step
 
 // Private variables
-static int32_t m_ms_today = -1;
-static systime_t last_update = -1;
+static bool m_time_valid = false;
+static uint64_t m_ref_cyc = 0;
+static int64_t m_ref_us = 0;
+static float m_freq_err_cyc = 0.0f; // Estimated cycles per second - STM32_SYSCLK
+static uint32_t m_cycles_per_s = STM32_SYSCLK;
+
 static int32_t m_pps_time_ref = -1;
 static int32_t m_pps_cnt = 0;
+static bool m_pps_locked = false;
+static uint64_t m_pps_last_cyc = 0;
+static int64_t m_pps_last_us = 0;
+static int32_t m_pps_phase_err_us = 0;
+static int32_t m_pps_phase_err_max_us = 0;
+static uint32_t m_pps_steps = 0;
+
+// Private functions
+static int64_t us_at(uint64_t cyc);
+static void terminal_time(int argc, const char **argv);
+
+void time_today_init(void) {
+	terminal_register_command_callback(
+			"time_today",
+			"Print the state of the time of day clock and the PPS discipline.",
+			0,
+			terminal_time);
+}
 
 void time_today_set_ms(int32_t ms_today) {
-	m_ms_today = ms_today;
-	last_update = chVTGetSystemTimeX();
+	syssts_t sts = chSysGetStatusAndLockX();
+	m_ref_cyc = timebase_get_cycles();
+	m_ref_us = (int64_t)ms_today * 1000;
+	m_time_valid = true;
+	chSysRestoreStatusX(sts);
 }
 
-// updates the time lazily, ignores drift as PPS is assumed
+/**
+ * Get the time of day in milliseconds, or -1 if it is not known yet.
+ */
 int32_t time_today_get_ms(void) {
-	if (m_ms_today == -1)
+	int64_t us = time_today_get_us();
+	return us < 0 ? -1 : (int32_t)(us / 1000);
+}
+
+/**
+ * Get the time of day in microseconds, or -1 if it is not known yet.
+ */
+int64_t time_today_get_us(void) {
+	syssts_t sts = chSysGetStatusAndLockX();
+
+	if (!m_time_valid) {
+		chSysRestoreStatusX(sts);
 		return -1;
+	}
 
-	systime_t now = chVTGetSystemTimeX();
-	m_ms_today += TIME_I2MS(chTimeDiffX(last_update, now));
-	last_update = now;
+	int64_t us = us_at(timebase_get_cycles());
+	chSysRestoreStatusX(sts);
 
-	if (m_ms_today >= MS_PER_DAY) {
-		m_ms_today -= MS_PER_DAY;
+	return us;
+}
+
+/**
+ * Convert a time of day to a timebase stamp, assuming that it is within
+ * half a day from now.
+ *
+ * @param ms_today
+ * The time of day in milliseconds.
+ *
+ * @return
+ * The corresponding timebase stamp. The current stamp if the time of day
+ * is not known yet.
+ */
+uint64_t time_today_to_timebase_us(int32_t ms_today) {
+	syssts_t sts = chSysGetStatusAndLockX();
+
+	uint64_t cyc = timebase_get_cycles();
+	uint64_t tb_us = cyc / (STM32_SYSCLK / 1000000);
+
+	if (m_time_valid) {
+		int64_t diff = us_at(cyc) - (int64_t)ms_today * 1000;
+		if (diff > US_PER_DAY / 2) {
+			diff -= US_PER_DAY;
+		} else if (diff < -US_PER_DAY / 2) {
+			diff += US_PER_DAY;
+		}
+		tb_us -= diff;
 	}
 
-	return m_ms_today;
+	chSysRestoreStatusX(sts);
+
+	return tb_us;
 }
 
 void time_today_set_pps_time_ref(int32_t pps_time_ref) {
@@ -56,24 +146,132 @@ void time_today_pps_cb(void *arg) {
 	(void)arg;
 	static int32_t last_time_ref = 0;
 
-	// Only one correction per time stamp.
-	if (last_time_ref == m_pps_time_ref) {
-		return;
+	chSysLockFromISR();
+	uint64_t cyc = timebase_get_cycles();
+
+	TRACE_INSTANT(TRACE_EV_PPS, m_pps_time_ref);
+
+	uint64_t interval = cyc - m_pps_last_cyc;
+	uint32_t max_dev = (uint32_t)((uint64_t)STM32_SYSCLK * FLL_MAX_PPM / 1000000);
+	bool one_second = m_pps_cnt > 0 &&
+			interval > (uint64_t)(STM32_SYSCLK - max_dev) &&
+			interval < (uint64_t)(STM32_SYSCLK + max_dev);
+
+	int64_t edge_us = -1;
+
+	if (last_time_ref != m_pps_time_ref && m_pps_time_ref != 0) {
+		// Assume that the last time reference (NMEA time stamp) is less
+		// than one second old and round to the closest second after it.
+		edge_us = ((int64_t)(m_pps_time_ref / 1000) + 1) * 1000000;
+	} else if (m_pps_locked && one_second) {
+		// No new time stamp, but the edges are one second apart
+		edge_us = m_pps_last_us + 1000000;
 	}
 
-	// Assume that the last time reference (NMEA time stamp) is less
-	// than one second old and round to the closest second after it.
-	if (m_pps_time_ref != 0) {
-		int32_t s_today = m_pps_time_ref / 1000;
-		s_today++;
-		m_ms_today = s_today * 1000;
+	if (edge_us >= 0) {
+		if (edge_us >= US_PER_DAY) {
+			edge_us -= US_PER_DAY;
+		}
+
+		if (m_time_valid) {
+			int64_t err = us_at(cyc) - edge_us;
+			if (err > US_PER_DAY / 2) {
+				err -= US_PER_DAY;
+			} else if (err < -US_PER_DAY / 2) {
+				err += US_PER_DAY;
+			}
+
+			if (err > PHASE_STEP_US || err < -PHASE_STEP_US) {
+				m_pps_steps++;
+			} else {
+				m_pps_phase_err_us = (int32_t)err;
+				int32_t err_abs = err < 0 ? -err : err;
+				if (err_abs > m_pps_phase_err_max_us) {
+					m_pps_phase_err_max_us = err_abs;
+				}
+			}
+		}
+
+		if (m_pps_locked && one_second) {
+			m_freq_err_cyc += ((float)((int32_t)(interval - STM32_SYSCLK)) - m_freq_err_cyc) * FLL_GAIN;
+			m_cycles_per_s = STM32_SYSCLK + (int32_t)m_freq_err_cyc;
+		}
+
+		m_ref_cyc = cyc;
+		m_ref_us = edge_us;
+		m_time_valid = true;
+		m_pps_locked = true;
+		m_pps_last_us = edge_us;
+	} else {
+		m_pps_locked = false;
 	}
 
 	last_time_ref = m_pps_time_ref;
-	last_update = chVTGetSystemTimeX();
+	m_pps_last_cyc = cyc;
 	m_pps_cnt++;
+
+	chSysUnlockFromISR();
 }
 
 int32_t time_today_get_pps_cnt(void) {
 	return m_pps_cnt;
 }
+
+/**
+ * Get the estimated frequency error of the system clock in parts per
+ * billion, from the PPS edge intervals. Positive when the clock is fast.
+ */
+int32_t time_today_get_freq_err_ppb(void) {
+	return (int32_t)(m_freq_err_cyc * (1.0e9f / (float)STM32_SYSCLK));
+}
+
+// Call with the system locked
+static int64_t us_at(uint64_t cyc) {
+	if (cyc < m_ref_cyc) {
+		int64_t us = m_ref_us - (int64_t)((m_ref_cyc - cyc) * 1000000ULL / m_cycles_per_s);
+		if (us < 0) {
+			us += US_PER_DAY;
+		}
+		return us;
+	}
+
+	uint64_t elapsed = cyc - m_ref_cyc;
+
+	// Move the reference forward in whole seconds so that the product
+	// below stays in range during long holdover.
+	if (elapsed >= m_cycles_per_s) {
+		uint64_t s = elapsed / m_cycles_per_s;
+		elapsed -= s * m_cycles_per_s;
+		m_ref_cyc += s * m_cycles_per_s;
+		m_ref_us = (m_ref_us + (int64_t)s * 1000000) % US_PER_DAY;
+	}
+
+	int64_t us = m_ref_us + (int64_t)(elapsed * 1000000ULL / m_cycles_per_s);
+	if (us >= US_PER_DAY) {
+		us -= US_PER_DAY;
+	}
+
+	return us;
+}
+
+static void terminal_time(int argc, const char **argv) {
+	(void)argv;
+
+	if (argc != 1) {
+		terminal_wrong_args();
+		return;
+	}
+
+	int64_t us = time_today_get_us();
+
+	if (us < 0) {
+		terminal_printf("Time of day:   unknown");
+	} else {
+		terminal_printf("Time of day:   %ld.%06ld s", (int32_t)(us / 1000000), (int32_t)(us % 1000000));
+	}
+	terminal_printf("PPS edges:     %ld, %s", m_pps_cnt, m_pps_locked ? "locked" : "not locked");
+	terminal_printf("Freq error:    %ld ppb (%lu cycles/s)", time_today_get_freq_err_ppb(), m_cycles_per_s);
+	terminal_printf("Phase error:   %ld us last, %ld us max", m_pps_phase_err_us, m_pps_phase_err_max_us);
+	terminal_printf("Phase steps:   %lu", m_pps_steps);
+	terminal_printf(" ");
+}
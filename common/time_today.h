@@ -22,10 +22,14 @@
 
 #include <stdint.h>
 
+void time_today_init(void);
 void time_today_set_ms(int32_t ms_today);
 int32_t time_today_get_ms(void);
+int64_t time_today_get_us(void);
+uint64_t time_today_to_timebase_us(int32_t ms_today);
 void time_today_set_pps_time_ref(int32_t pps_time_ref);
 void time_today_pps_cb(void *arg);
 int32_t time_today_get_pps_cnt(void);
+int32_t time_today_get_freq_err_ppb(void);
 
 #endif /* TIME_TODAY_H_ */
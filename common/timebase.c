@@ -0,0 +1,86 @@
+/*
+	Copyright 2021 Marvin Damschen	marvin.damschen@ri.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "timebase.h"
+#include "ch.h"
+#include "hal.h"
+
+/*
+ * Monotonic time since boot for timestamping samples. It is the DWT cycle
+ * counter extended to 64 bits, so it never wraps and differences between
+ * two stamps need no special handling. A virtual timer reads the counter
+ * every second so that no 32-bit wrap (25.6 s at 168 MHz) is missed.
+ *
+ * The microsecond value uses the nominal clock rate. time_today converts
+ * stamps to and from the PPS disciplined time of day.
+ */
+
+// Private variables
+static uint32_t m_cyc_last = 0;
+static uint64_t m_cyc_high = 0;
+static virtual_timer_t m_vt;
+
+// Private functions
+static void vt_cb(void *arg);
+
+/**
+ * Start the wrap tracking. Call after prof_init, which enables the cycle
+ * counter.
+ */
+void timebase_init(void) {
+	chVTObjectInit(&m_vt);
+
+	chSysLock();
+	m_cyc_last = DWT->CYCCNT;
+	chVTSetI(&m_vt, TIME_S2I(1), vt_cb, NULL);
+	chSysUnlock();
+}
+
+/**
+ * Get the number of CPU cycles since boot. Can be called from threads,
+ * ISRs and locked sections.
+ */
+uint64_t timebase_get_cycles(void) {
+	syssts_t sts = chSysGetStatusAndLockX();
+
+	uint32_t c = DWT->CYCCNT;
+	if (c < m_cyc_last) {
+		m_cyc_high += 1ULL << 32;
+	}
+	m_cyc_last = c;
+	uint64_t res = m_cyc_high | c;
+
+	chSysRestoreStatusX(sts);
+
+	return res;
+}
+
+/**
+ * Get the number of microseconds since boot.
+ */
+uint64_t timebase_get_us(void) {
+	return timebase_get_cycles() / (STM32_SYSCLK / 1000000);
+}
+
+static void vt_cb(void *arg) {
+	(void)arg;
+
+	chSysLockFromISR();
+	timebase_get_cycles();
+	chVTSetI(&m_vt, TIME_S2I(1), vt_cb, NULL);
+	chSysUnlockFromISR();
+}
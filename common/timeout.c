@@ -17,10 +17,14 @@
  */
 
 #include "timeout.h"
+#include "prof.h"
 
 // Private variables
 static systime_t m_timeout_msec;
 static systime_t m_last_update_time;
+static bool m_contact;
+static volatile bool m_emergency_stop;
+static mutex_t m_cb_mtx;
 static void (*m_timeout_action_cb)(void);
 static void (*m_timeout_reset_cb)(void);
 
@@ -29,16 +33,57 @@ static THD_WORKING_AREA(timeout_thread_wa, 512);
 static THD_FUNCTION(timeout_thread, arg);
 
 void timeout_init(systime_t timeoutms, void (*timeout_action_cb)(void), void (*timeout_reset_cb)(void)) {
+	chMtxObjectInit(&m_cb_mtx);
 	m_timeout_msec = timeoutms;
 	m_timeout_action_cb = timeout_action_cb;
 	m_timeout_reset_cb = timeout_reset_cb;
 	m_last_update_time = chVTGetSystemTimeX();
+	m_contact = false;
 
 	chThdCreateStatic(timeout_thread_wa, sizeof(timeout_thread_wa), HIGHPRIO, timeout_thread, NULL);
 }
 
 void timeout_reset(void) {
 	m_last_update_time = chVTGetSystemTimeX();
+	m_contact = true;
+}
+
+/**
+ * Check if timeout_reset has been called since boot, i.e. if a host has
+ * been in contact. Before that an expired timeout is just a boot without
+ * a host.
+ */
+bool timeout_has_contact(void) {
+	return m_contact;
+}
+
+/**
+ * Run the stop action right away and latch it. Heartbeats do not release
+ * the latch, only timeout_emergency_release does.
+ */
+void timeout_emergency_stop(void) {
+	m_emergency_stop = true;
+
+	// Before timeout_init the thread picks the latch up on its first poll
+	if (!m_timeout_action_cb) {
+		return;
+	}
+
+	chMtxLock(&m_cb_mtx);
+	m_timeout_action_cb();
+	chMtxUnlock(&m_cb_mtx);
+}
+
+/**
+ * Release a latched emergency stop. The reset action runs on the next poll
+ * if the timeout has not expired.
+ */
+void timeout_emergency_release(void) {
+	m_emergency_stop = false;
+}
+
+bool timeout_is_emergency_stopped(void) {
+	return m_emergency_stop;
 }
 
 static THD_FUNCTION(timeout_thread, arg) {
@@ -47,11 +92,14 @@ static THD_FUNCTION(timeout_thread, arg) {
 	chRegSetThreadName("Timeout");
 
 	for(;;) {
-		if (m_timeout_msec != 0 && chVTTimeElapsedSinceX(m_last_update_time) > TIME_MS2I(m_timeout_msec))
+		chMtxLock(&m_cb_mtx);
+		if (m_emergency_stop ||
+				(m_timeout_msec != 0 && chVTTimeElapsedSinceX(m_last_update_time) > TIME_MS2I(m_timeout_msec)))
 			m_timeout_action_cb();
 		else
 			m_timeout_reset_cb();
+		chMtxUnlock(&m_cb_mtx);
 
-		chThdSleepMilliseconds(100);
+		prof_sleep(TIME_MS2I(100));
 	}
 }
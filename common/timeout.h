@@ -24,5 +24,9 @@
 // Functions
 void timeout_init(systime_t timeoutms, void (*timeout_action_cb)(void), void (*timeout_reset_cb)(void));
 void timeout_reset(void);
+void timeout_emergency_stop(void);
+void timeout_emergency_release(void);
+bool timeout_is_emergency_stopped(void);
+bool timeout_has_contact(void);
 
 #endif /* TIMEOUT_H_ */
@@ -0,0 +1,168 @@
+/*
+	Copyright 2021 Marvin Damschen	marvin.damschen@ri.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+#include "ch.h"
+#include "hal.h"
+#include "terminal.h"
+
+#include <string.h>
+
+/*
+ * Events are written to a RAM ring from threads and ISRs without locking:
+ * every writer reserves its own slot with an atomic increment. Timestamps
+ * are DWT cycles, the counter is enabled in prof_init.
+ *
+ * "trace dump" prints the ring in the Chrome trace event format, one event
+ * per line. Saving the terminal output between the brackets as a .json
+ * file gives a timeline in chrome://tracing or ui.perfetto.dev.
+ */
+
+#if TRACE_ENABLE
+
+// Private types
+typedef struct {
+	uint32_t time;
+	uint32_t arg;
+	uint8_t event;
+	uint8_t phase;
+	uint16_t tid;
+} trace_record;
+
+// Private variables
+__attribute__((section(".ram4"))) static trace_record m_records[TRACE_LEN];
+static volatile uint32_t m_write;
+static volatile bool m_paused;
+
+static const char *m_event_names[TRACE_EV_NUM] = {
+		"pos_imu_data_cb",
+		"pos_correction_imu",
+		"pos_correction_imu_hook",
+		"pos_correction_imu_post_hook",
+		"pos_gnss_nmea_cb",
+		"pos_correction_gnss",
+		"pos_correction_mc",
+		"pps"
+};
+
+// Private functions
+static uint16_t thread_to_tid(thread_t *tp);
+static void terminal_trace(int argc, const char **argv);
+static void dump(void);
+
+_Static_assert((TRACE_LEN & (TRACE_LEN - 1)) == 0, "TRACE_LEN must be a power of two");
+
+void trace_init(void) {
+	m_write = 0;
+	m_paused = false;
+
+	terminal_register_command_callback(
+			"trace",
+			"Dump the event trace as Chrome trace JSON, or clear it.",
+			"[dump/clear]",
+			terminal_trace);
+}
+
+/**
+ * Add an event to the trace. Safe to call from threads and ISRs, use the
+ * TRACE_ macros so that the call disappears when tracing is disabled.
+ */
+void trace_event(TRACE_EVENT ev, TRACE_PHASE ph, uint32_t arg) {
+	if (m_paused) {
+		return;
+	}
+
+	uint32_t ind = __atomic_fetch_add(&m_write, 1, __ATOMIC_RELAXED) & (TRACE_LEN - 1);
+	trace_record *r = &m_records[ind];
+	r->time = DWT->CYCCNT;
+	r->arg = arg;
+	r->event = ev;
+	r->phase = ph;
+	r->tid = port_is_isr_context() ? 0 : thread_to_tid(chThdGetSelfX());
+}
+
+static uint16_t thread_to_tid(thread_t *tp) {
+	return (((uint32_t)tp >> 2) & 0xFFFF) | 1;
+}
+
+static void terminal_trace(int argc, const char **argv) {
+	if (argc == 2) {
+		if (strcmp(argv[1], "dump") == 0) {
+			m_paused = true;
+			dump();
+			m_paused = false;
+		} else if (strcmp(argv[1], "clear") == 0) {
+			m_paused = true;
+			m_write = 0;
+			m_paused = false;
+			terminal_printf("OK\n");
+		} else {
+			terminal_printf("Invalid argument %s\n", argv[1]);
+		}
+	} else {
+		terminal_printf("Wrong number of arguments\n");
+	}
+}
+
+static void dump(void) {
+	uint32_t write = m_write;
+	uint32_t num = write < TRACE_LEN ? write : TRACE_LEN;
+	uint32_t start = write - num;
+	const float cycles_per_us = (float)STM32_SYSCLK / 1.0e6;
+
+	terminal_printf("[");
+	terminal_printf("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":0,\"args\":{\"name\":\"ISR\"}},");
+
+	thread_t *tp = chRegFirstThread();
+	do {
+		terminal_printf("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"args\":{\"name\":\"%s\"}},",
+				thread_to_tid(tp), tp->name == NULL ? "" : tp->name);
+		tp = chRegNextThread(tp);
+	} while (tp != NULL);
+
+	static const char phases[] = {'B', 'E', 'i'};
+	uint32_t t0 = m_records[start & (TRACE_LEN - 1)].time;
+
+	for (uint32_t i = 0;i < num;i++) {
+		const trace_record *r = &m_records[(start + i) & (TRACE_LEN - 1)];
+		terminal_printf("{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.2f,\"pid\":0,\"tid\":%u%s\"args\":{\"arg\":%u}},",
+				r->event < TRACE_EV_NUM ? m_event_names[r->event] : "unknown",
+				phases[r->phase < 3 ? r->phase : 2],
+				(double)((float)(r->time - t0) / cycles_per_us),
+				r->tid,
+				r->phase == TRACE_PH_INSTANT ? ",\"s\":\"t\"," : ",",
+				r->arg);
+	}
+
+	// Marks the end of the dump and keeps the list free of a trailing comma
+	terminal_printf("{\"name\":\"trace_dump\",\"ph\":\"i\",\"ts\":%.2f,\"pid\":0,\"tid\":0,\"s\":\"g\"}",
+			(double)((float)(DWT->CYCCNT - t0) / cycles_per_us));
+	terminal_printf("]");
+}
+
+#else
+
+void trace_init(void) {
+}
+
+void trace_event(TRACE_EVENT ev, TRACE_PHASE ph, uint32_t arg) {
+	(void)ev;
+	(void)ph;
+	(void)arg;
+}
+
+#endif
@@ -0,0 +1,68 @@
+/*
+	Copyright 2021 Marvin Damschen	marvin.damschen@ri.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+
+/*
+ * Hot-path event tracing. Disabled by default, build with e.g.
+ * make rover UDEFS=-DTRACE_ENABLE=1
+ * to enable it. When disabled, the TRACE_ macros compile to nothing.
+ */
+#ifndef TRACE_ENABLE
+#define TRACE_ENABLE				0
+#endif
+
+// Settings
+#define TRACE_LEN					512 // must be a power of two
+
+// Events
+typedef enum {
+	TRACE_EV_IMU_DATA = 0,
+	TRACE_EV_POS_CORR_IMU,
+	TRACE_EV_POS_IMU_HOOK,
+	TRACE_EV_POS_IMU_POST_HOOK,
+	TRACE_EV_GNSS_NMEA,
+	TRACE_EV_POS_CORR_GNSS,
+	TRACE_EV_POS_CORR_MC,
+	TRACE_EV_PPS,
+	TRACE_EV_NUM
+} TRACE_EVENT;
+
+typedef enum {
+	TRACE_PH_BEGIN = 0,
+	TRACE_PH_END,
+	TRACE_PH_INSTANT
+} TRACE_PHASE;
+
+#if TRACE_ENABLE
+#define TRACE_BEGIN(ev, arg)		trace_event((ev), TRACE_PH_BEGIN, (arg))
+#define TRACE_END(ev, arg)			trace_event((ev), TRACE_PH_END, (arg))
+#define TRACE_INSTANT(ev, arg)		trace_event((ev), TRACE_PH_INSTANT, (arg))
+#else
+#define TRACE_BEGIN(ev, arg)		((void)0)
+#define TRACE_END(ev, arg)			((void)0)
+#define TRACE_INSTANT(ev, arg)		((void)0)
+#endif
+
+// Functions
+void trace_init(void);
+void trace_event(TRACE_EVENT ev, TRACE_PHASE ph, uint32_t arg);
+
+#endif /* TRACE_H_ */
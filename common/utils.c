@@ -345,17 +345,17 @@ float utils_fast_inv_sqrt(float x) {
  * The angle in radians
  */
 float utils_fast_atan2(float y, float x) {
-	float abs_y = fabsf(y) + 1e-10; // kludge to prevent 0/0 condition
+	float abs_y = fabsf(y) + 1e-10f; // kludge to prevent 0/0 condition
 	float angle;
 
 	if (x >= 0) {
 		float r = (x - abs_y) / (x + abs_y);
 		float rsq = r * r;
-		angle = ((0.1963 * rsq) - 0.9817) * r + (M_PI / 4.0);
+		angle = ((0.1963f * rsq) - 0.9817f) * r + ((float)M_PI / 4.0f);
 	} else {
 		float r = (x + abs_y) / (abs_y - x);
 		float rsq = r * r;
-		angle = ((0.1963 * rsq) - 0.9817) * r + (3.0 * M_PI / 4.0);
+		angle = ((0.1963f * rsq) - 0.9817f) * r + (3.0f * (float)M_PI / 4.0f);
 	}
 
 	if (y < 0) {
@@ -462,54 +462,54 @@ void utils_fast_sincos(float angle, float *sin, float *cos) {
  */
 void utils_fast_sincos_better(float angle, float *sin, float *cos) {
 	//always wrap input angle to -PI..PI
-	while (angle < -M_PI) {
-		angle += 2.0 * M_PI;
+	while (angle < -(float)M_PI) {
+		angle += 2.0f * (float)M_PI;
 	}
 
-	while (angle >  M_PI) {
-		angle -= 2.0 * M_PI;
+	while (angle >  (float)M_PI) {
+		angle -= 2.0f * (float)M_PI;
 	}
 
 	//compute sine
-	if (angle < 0.0) {
-		*sin = 1.27323954 * angle + 0.405284735 * angle * angle;
+	if (angle < 0.0f) {
+		*sin = 1.27323954f * angle + 0.405284735f * angle * angle;
 
-		if (*sin < 0.0) {
-			*sin = 0.225 * (*sin * -*sin - *sin) + *sin;
+		if (*sin < 0.0f) {
+			*sin = 0.225f * (*sin * -*sin - *sin) + *sin;
 		} else {
-			*sin = 0.225 * (*sin * *sin - *sin) + *sin;
+			*sin = 0.225f * (*sin * *sin - *sin) + *sin;
 		}
 	} else {
-		*sin = 1.27323954 * angle - 0.405284735 * angle * angle;
+		*sin = 1.27323954f * angle - 0.405284735f * angle * angle;
 
-		if (*sin < 0.0) {
-			*sin = 0.225 * (*sin * -*sin - *sin) + *sin;
+		if (*sin < 0.0f) {
+			*sin = 0.225f * (*sin * -*sin - *sin) + *sin;
 		} else {
-			*sin = 0.225 * (*sin * *sin - *sin) + *sin;
+			*sin = 0.225f * (*sin * *sin - *sin) + *sin;
 		}
 	}
 
 	// compute cosine: sin(x + PI/2) = cos(x)
-	angle += 0.5 * M_PI;
-	if (angle >  M_PI) {
-		angle -= 2.0 * M_PI;
+	angle += 0.5f * (float)M_PI;
+	if (angle >  (float)M_PI) {
+		angle -= 2.0f * (float)M_PI;
 	}
 
-	if (angle < 0.0) {
-		*cos = 1.27323954 * angle + 0.405284735 * angle * angle;
+	if (angle < 0.0f) {
+		*cos = 1.27323954f * angle + 0.405284735f * angle * angle;
 
-		if (*cos < 0.0) {
-			*cos = 0.225 * (*cos * -*cos - *cos) + *cos;
+		if (*cos < 0.0f) {
+			*cos = 0.225f * (*cos * -*cos - *cos) + *cos;
 		} else {
-			*cos = 0.225 * (*cos * *cos - *cos) + *cos;
+			*cos = 0.225f * (*cos * *cos - *cos) + *cos;
 		}
 	} else {
-		*cos = 1.27323954 * angle - 0.405284735 * angle * angle;
+		*cos = 1.27323954f * angle - 0.405284735f * angle * angle;
 
-		if (*cos < 0.0) {
-			*cos = 0.225 * (*cos * -*cos - *cos) + *cos;
+		if (*cos < 0.0f) {
+			*cos = 0.225f * (*cos * -*cos - *cos) + *cos;
 		} else {
-			*cos = 0.225 * (*cos * *cos - *cos) + *cos;
+			*cos = 0.225f * (*cos * *cos - *cos) + *cos;
 		}
 	}
 }
@@ -836,6 +836,22 @@ bool utils_time_before(int32_t t1, int32_t t2) {
 	}
 }
 
+/**
+ * Get the absolute difference between two timebase stamps.
+ *
+ * @param t1
+ * The first stamp in microseconds.
+ *
+ * @param t2
+ * The second stamp in microseconds.
+ *
+ * @return
+ * The difference in microseconds.
+ */
+uint64_t utils_time_diff_us(uint64_t t1, uint64_t t2) {
+	return t1 > t2 ? t1 - t2 : t2 - t1;
+}
+
 /**
  * Convert milliseconds to hours, minutes, seconds
  *
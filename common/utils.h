@@ -57,6 +57,7 @@ void utils_llh_to_enu(const double *iLlh, const double *llh, double *xyz);
 void utils_enu_to_llh(const double *iLlh, const double *xyz, double *llh);
 void utils_byte_to_binary(int x, char *b);
 bool utils_time_before(int32_t t1, int32_t t2);
+uint64_t utils_time_diff_us(uint64_t t1, uint64_t t2);
 void utils_ms_to_hhmmss(int ms, int *hh, int *mm, int *ss);
 int utils_decode_nmea_gga(const char *data, nmea_gga_info_t *gga);
 int utils_decode_nmea_gsv(const char *system_str, const char *data, nmea_gsv_info_t *gsv_info);
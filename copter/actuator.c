@@ -19,10 +19,33 @@
 #include "ch.h"
 #include "hal.h"
 #include "servo_pwm.h"
+#include "dshot.h"
 #include "utils.h"
 #include "conf_general.h"
+#include "terminal.h"
 //#include "adconv.h"
 
+// Private variables
+static bool m_dshot;
+
+/**
+ * Start the motor outputs with the protocol in main_config.mr.motor_output.
+ * Changing the protocol needs a restart.
+ */
+void actuator_init(void) {
+	m_dshot = main_config.mr.motor_output == MOTOR_OUTPUT_DSHOT600;
+
+	if (m_dshot) {
+		if (!dshot_init()) {
+			// Better no output than PWM to ESCs that expect DShot
+			terminal_printf("DShot DMA streams are used by another driver, motor outputs disabled");
+		}
+	} else {
+		// safe stop value 0 (TODO: currently, the copter will fall from the sky like a rock)
+		servo_pwm_init(0b1111, 0.0);
+	}
+}
+
 void actuator_set_output(float throttle, float roll, float pitch, float yaw) {
 	float motors[4];
 
@@ -60,7 +83,15 @@ void actuator_set_output(float throttle, float roll, float pitch, float yaw) {
 //		}
 
 		utils_truncate_number(&motors[i], 0.0, 1.0);
-		servo_pwm_set(i, motors[i]);
+		if (m_dshot) {
+			dshot_set(i, motors[i]);
+		} else {
+			servo_pwm_set(i, motors[i]);
+		}
+	}
+
+	if (m_dshot) {
+		dshot_update();
 	}
 }
 
@@ -81,12 +112,38 @@ void actuator_set_output(float throttle, float roll, float pitch, float yaw) {
 void actuator_set_motor(int motor, float throttle) {
 	utils_truncate_number(&throttle, 0.0, 1.0);
 
+	void (*set)(uint8_t channel, float value) = m_dshot ? dshot_set : servo_pwm_set;
+
 	switch (motor) {
-	case 0: servo_pwm_set(main_config.mr.motor_fl_f, throttle); break;
-	case 1: servo_pwm_set(main_config.mr.motor_bl_l, throttle); break;
-	case 2: servo_pwm_set(main_config.mr.motor_fr_r, throttle); break;
-	case 3: servo_pwm_set(main_config.mr.motor_br_b, throttle); break;
-	case -1: servo_pwm_set_all(throttle); break;
+	case 0: set(main_config.mr.motor_fl_f, throttle); break;
+	case 1: set(main_config.mr.motor_bl_l, throttle); break;
+	case 2: set(main_config.mr.motor_fr_r, throttle); break;
+	case 3: set(main_config.mr.motor_br_b, throttle); break;
+	case -1: set(0xFF, throttle); break;
 	default: break;
 	}
+
+	if (m_dshot) {
+		dshot_update();
+	}
+}
+
+/**
+ * Stop all motors and ignore motor commands until
+ * actuator_reset_safety_stop is called.
+ */
+void actuator_safety_stop(void) {
+	if (m_dshot) {
+		dshot_safety_stop();
+	} else {
+		servo_pwm_safety_stop();
+	}
+}
+
+void actuator_reset_safety_stop(void) {
+	if (m_dshot) {
+		dshot_reset_safety_stop();
+	} else {
+		servo_pwm_reset_safety_stop();
+	}
 }
@@ -18,7 +18,10 @@
 #ifndef ACTUATOR_H_
 #define ACTUATOR_H_
 
+void actuator_init(void);
 void actuator_set_output(float throttle, float roll, float pitch, float yaw);
 void actuator_set_motor(int motor, float throttle);
+void actuator_safety_stop(void);
+void actuator_reset_safety_stop(void);
 
 #endif /* ACTUATOR_H_ */
@@ -21,39 +21,73 @@
 #include "terminal.h"
 #include "stm32f4xx_conf.h"
 #include "eeprom.h"
+#include "conf_store.h"
 #include <string.h>
 #include <stdio.h>
+#include <stddef.h>
 
 // Settings
 #define EEPROM_BASE_MAINCONF		1000
 
+/*
+ * Older firmware kept MAIN_CONFIG in the emulated EEPROM, one halfword per
+ * variable with the first byte in the high half. Its layout ended after
+ * mr.motor_pwm_max_us, everything after that was appended later and keeps
+ * the defaults when migrating. It was written with sizeof, so the
+ * variables include the struct padding.
+ */
+#define LEGACY_MAINCONF_SIZE		(offsetof(MAIN_CONFIG, mr) + offsetof(MAIN_CONFIG_MULTIROTOR, motor_output))
+#define LEGACY_MAINCONF_VARS		(((LEGACY_MAINCONF_SIZE + 3) & ~3) / 2)
+#define LEGACY_MAINCONF_VERSION		0
+
 // Global variables
 MAIN_CONFIG main_config;
 int main_id = 0;
 uint16_t VirtAddVarTab[NB_OF_VAR];
 
+// Private variables
+static MAIN_CONFIG m_conf_stored;
+
 // Private functions
-static bool conf_general_load_main_conf(MAIN_CONFIG *conf);
+static bool conf_general_load_main_conf(MAIN_CONFIG *conf, uint32_t version);
+static bool conf_general_load_legacy_main_conf(MAIN_CONFIG *conf);
 static void terminal_cmd_set_id(int argc, const char **argv);
 static void terminal_cmd_set_id_quiet(int argc, const char **argv);
 
 void conf_general_init(void) {
 	main_id = 0;
 
-	// try to read config from emulated EEPROM, use default config if this fails
-	memset(VirtAddVarTab, 0, sizeof(VirtAddVarTab));
-
-	for (unsigned int i = 0;i < (sizeof(MAIN_CONFIG) / 2);i++) {
-		VirtAddVarTab[i] = EEPROM_BASE_MAINCONF + i;
-	}
-
 	FLASH_Unlock();
 	FLASH_ClearFlag(FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR |
 			FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
-	EE_Init();
 
-	if (!conf_general_load_main_conf(&main_config))
-		conf_general_get_default_main_config(&main_config);
+	conf_general_get_default_main_config(&main_config);
+
+	uint32_t size, version;
+	if (conf_store_newest(&size, &version)) {
+		if (!conf_general_load_main_conf(&main_config, version)) {
+			conf_general_get_default_main_config(&main_config);
+		}
+	} else {
+		// No stored record yet, migrate the config from the emulated EEPROM
+		// that older firmware used. EE_Init may format the sectors, so only
+		// run it when there is nothing in the new format.
+		memset(VirtAddVarTab, 0, sizeof(VirtAddVarTab));
+
+		for (unsigned int i = 0;i < LEGACY_MAINCONF_VARS;i++) {
+			VirtAddVarTab[i] = EEPROM_BASE_MAINCONF + i;
+		}
+
+		EE_Init();
+
+		if (conf_general_load_main_conf(&main_config, LEGACY_MAINCONF_VERSION)) {
+			conf_general_store_main_config(&main_config);
+		} else {
+			conf_general_get_default_main_config(&main_config);
+		}
+	}
+
+	conf_store_init();
 
 	terminal_register_command_callback(
 			"set_id",
@@ -192,6 +226,19 @@ void conf_general_get_default_main_config(MAIN_CONFIG *conf) {
 	conf->mr.motors_cw = true;
 	conf->mr.motor_pwm_min_us = 1200;
 	conf->mr.motor_pwm_max_us = 2000;
+	conf->mr.motor_output = MOTOR_OUTPUT_PWM;
+
+	conf->gyro_bias_x = 0.0;
+	conf->gyro_bias_y = 0.0;
+	conf->gyro_bias_z = 0.0;
+
+	conf->ahrs_filter = AHRS_FILTER_MADGWICK;
+	conf->ahrs_use_mag = false;
+
+	conf->drive.type = DRIVE_ACKERMANN;
+	for (int i = 0;i < DRIVE_WHEELS_MAX;i++) {
+		conf->drive.vesc_id[i] = VESC_ID;
+	}
 
 	// Only the SLU testbot for now
 #if HAS_DIFF_STEERING
@@ -227,12 +274,37 @@ void conf_general_get_default_main_config(MAIN_CONFIG *conf) {
 #endif
 }
 
-static bool conf_general_load_main_conf(MAIN_CONFIG *conf) {
+/*
+ * Load a stored config of the given version into conf, which has to hold
+ * the defaults. Each version is decoded from its own layout, one upgrade
+ * step per version. Records written by newer firmware are not loaded.
+ *
+ * When MAIN_CONFIG_VERSION is increased, the case of the previous version
+ * has to decode its layout into a copy and convert that, and the older
+ * cases fall through into that conversion.
+ */
+static bool conf_general_load_main_conf(MAIN_CONFIG *conf, uint32_t version) {
+	switch (version) {
+	case LEGACY_MAINCONF_VERSION:
+		// Version 1 is the legacy layout with fields appended, so there is
+		// nothing to convert.
+		return conf_general_load_legacy_main_conf(conf);
+
+	case 1:
+		// Appended fields that the record does not have keep their defaults
+		return conf_store_load(conf, sizeof(MAIN_CONFIG)) > 0;
+
+	default:
+		return false;
+	}
+}
+
+static bool conf_general_load_legacy_main_conf(MAIN_CONFIG *conf) {
 	bool is_ok = true;
 	uint8_t *conf_addr = (uint8_t*)conf;
 	uint16_t var;
 
-	for (unsigned int i = 0;i < (sizeof(MAIN_CONFIG) / 2);i++) {
+	for (unsigned int i = 0;i < (LEGACY_MAINCONF_SIZE / 2);i++) {
 		if (EE_ReadVariable(EEPROM_BASE_MAINCONF + i, &var) == 0) {
 			conf_addr[2 * i] = (var >> 8) & 0xFF;
 			conf_addr[2 * i + 1] = var & 0xFF;
@@ -249,25 +321,40 @@ bool conf_general_store_main_config(MAIN_CONFIG *conf) {
 	utils_sys_lock_cnt();
 //	RCC_APB1PeriphClockCmd(RCC_APB1Periph_WWDG, DISABLE);
 
-	bool is_ok = true;
-	uint8_t *conf_addr = (uint8_t*)conf;
-	uint16_t var;
+	bool is_ok = conf_store_save(conf, sizeof(MAIN_CONFIG), MAIN_CONFIG_VERSION);
 
-	FLASH_ClearFlag(FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR |
-			FLASH_FLAG_PGPERR | FLASH_FLAG_PGSERR);
+//	RCC_APB1PeriphClockCmd(RCC_APB1Periph_WWDG, ENABLE);
+	utils_sys_unlock_cnt();
 
-	for (unsigned int i = 0;i < (sizeof(MAIN_CONFIG) / 2);i++) {
-		var = (conf_addr[2 * i] << 8) & 0xFF00;
-		var |= conf_addr[2 * i + 1] & 0xFF;
+	return is_ok;
+}
 
-		if (EE_WriteVariable(EEPROM_BASE_MAINCONF + i, var) != FLASH_COMPLETE) {
-			is_ok = false;
-			break;
-		}
+/**
+ * Store the gyro bias without storing anything else of main_config. The
+ * other fields are taken from the newest stored record, so changes that
+ * were only made in RAM are not persisted along with the bias. Stalls the
+ * CPU like conf_general_store_main_config, so never call this from a
+ * control loop.
+ */
+bool conf_general_store_gyro_bias(float x, float y, float z) {
+	uint32_t size, version;
+	if (conf_store_newest(&size, &version) && version == MAIN_CONFIG_VERSION) {
+		conf_general_get_default_main_config(&m_conf_stored);
+		conf_store_load(&m_conf_stored, sizeof(MAIN_CONFIG));
+	} else {
+		m_conf_stored = main_config;
 	}
 
-//	RCC_APB1PeriphClockCmd(RCC_APB1Periph_WWDG, ENABLE);
-	utils_sys_unlock_cnt();
+	m_conf_stored.gyro_bias_x = x;
+	m_conf_stored.gyro_bias_y = y;
+	m_conf_stored.gyro_bias_z = z;
+
+	bool is_ok = conf_general_store_main_config(&m_conf_stored);
+	if (is_ok) {
+		main_config.gyro_bias_x = x;
+		main_config.gyro_bias_y = y;
+		main_config.gyro_bias_z = z;
+	}
 
 	return is_ok;
 }
@@ -20,10 +20,29 @@
 #include "utils.h"
 #include "actuator.h"
 #include "time_today.h"
+#include "latency.h"
+#include "terminal.h"
 
 #include <math.h>
+#include <string.h>
+
+/*
+ * The control loop runs in its own thread, woken once per IMU FIFO batch
+ * after pos has processed the last sample of it. Waking on every sample
+ * would run two iterations back to back and then none for the rest of the
+ * batch. It reads the state with pos_get_latest, so neither the IMU thread
+ * nor a pos update in progress can delay the motor outputs. dt is the sum
+ * of the sample dt of the batches since the previous iteration, so it
+ * follows the sensor clock.
+ *
+ * No batch within BATCH_DEADLINE_MS counts as an overrun. Batches that
+ * arrive while an iteration is still running are merged into the next one
+ * and counted as missed.
+ */
 
 // Settings
+#define CONTROL_THREAD_PRIO				(NORMALPRIO + 10)
+#define BATCH_DEADLINE_MS				10 // Two IMU batch periods: 400 Hz ODR, 2 frames per batch
 #define INPUT_TIMEOUT_MS				1000
 #define POWER_OVERRIDE_TIMEOUT_MS		500
 #define AUTOPILOT_TIMEOUT_MS			1000
@@ -69,9 +88,22 @@ static POS_STATE m_pos_last;
 static MR_OUTPUT m_output;
 static float m_power_override[4];
 static float m_power_override_time;
+static binary_semaphore_t m_batch_sem;
+static float m_batch_dt;
+static int m_batches;
+static uint32_t m_iterations;
+static uint32_t m_missed;
+static uint32_t m_overruns;
+static uint32_t m_exec_max_cycles;
+
+// Threads
+static THD_WORKING_AREA(control_thread_wa, 2048);
+static THD_FUNCTION(control_thread, arg);
 
 // Private functions
+static void run_iteration(float dt);
 static void update_rc_control(MR_CONTROL_STATE *ctrl, MR_RC_STATE *rc, POS_STATE *pos, float dt);
+static void terminal_copter_ctrl(int argc, const char **argv);
 
 void copter_control_init(void) {
 	memset(&m_rc, 0, sizeof(MR_RC_STATE));
@@ -80,6 +112,22 @@ void copter_control_init(void) {
 	memset(&m_output, 0, sizeof(MR_OUTPUT));
 	memset(m_power_override, 0, sizeof(m_power_override));
 	m_power_override_time = 0.0;
+	chBSemObjectInit(&m_batch_sem, true);
+	m_batch_dt = 0.0;
+	m_batches = 0;
+	m_iterations = 0;
+	m_missed = 0;
+	m_overruns = 0;
+	m_exec_max_cycles = 0;
+
+	chThdCreateStatic(control_thread_wa, sizeof(control_thread_wa),
+			CONTROL_THREAD_PRIO, control_thread, NULL);
+
+	terminal_register_command_callback(
+			"copter_ctrl",
+			"Print control loop statistics. Use reset to clear them.",
+			"[reset]",
+			terminal_copter_ctrl);
 }
 
 systime_t copter_control_time_since_input_update(void) {
@@ -105,10 +153,64 @@ bool copter_control_is_throttle_over_tres(void) {
 	return m_output.throttle > MIN_THROTTLE;
 }
 
-void copter_control_run_iteration(float dt) {
-	bool lost_signal = true;
+/**
+ * Wake the control thread. Set as the BMI160 batch callback, so it runs in
+ * the IMU thread after pos has processed the batch.
+ *
+ * @param dt
+ * The time the batch covers.
+ */
+void copter_control_imu_batch(float dt) {
+	chSysLock();
+	m_batch_dt += dt;
+	m_batches++;
+	chBSemSignalI(&m_batch_sem);
+	chSchRescheduleS();
+	chSysUnlock();
+}
+
+static THD_FUNCTION(control_thread, arg) {
+	(void)arg;
+
+	chRegSetThreadName("Copter control");
+
+	for(;;) {
+		if (chBSemWaitTimeout(&m_batch_sem, TIME_MS2I(BATCH_DEADLINE_MS)) == MSG_TIMEOUT) {
+			m_overruns++;
+			continue;
+		}
+
+		uint32_t start = DWT->CYCCNT;
+
+		chSysLock();
+		float dt = m_batch_dt;
+		int batches = m_batches;
+		m_batch_dt = 0.0;
+		m_batches = 0;
+		chSysUnlock();
+
+		// Already taken by the previous iteration
+		if (batches == 0) {
+			continue;
+		}
+
+		if (batches > 1) {
+			m_missed += batches - 1;
+		}
+
+		pos_get_latest(&m_pos_last);
+		run_iteration(dt);
+
+		uint32_t cycles = DWT->CYCCNT - start;
+		if (cycles > m_exec_max_cycles) {
+			m_exec_max_cycles = cycles;
+		}
+		m_iterations++;
+	}
+}
 
-	pos_get(&m_pos_last);
+static void run_iteration(float dt) {
+	bool lost_signal = true;
 
 	// require rc input and GNSS fix, velocity integration drift (from copter_control_pos_correction_imu) is unbounded otherwise
 	if (copter_control_time_since_input_update() < INPUT_TIMEOUT_MS && TIME_I2MS(chVTTimeElapsedSinceX(m_ctrl.gnss_update_time)) < INPUT_TIMEOUT_MS) {
@@ -225,6 +327,31 @@ void copter_control_run_iteration(float dt) {
 	}
 
 	actuator_set_output(m_output.throttle, m_output.roll, m_output.pitch, m_output.yaw);
+	latency_record(LATENCY_PATH_IMU_ACTUATOR, m_pos_last.imu_sample_stamp);
+}
+
+static void terminal_copter_ctrl(int argc, const char **argv) {
+	if (argc == 2) {
+		if (strcmp(argv[1], "reset") == 0) {
+			m_missed = 0;
+			m_overruns = 0;
+			m_exec_max_cycles = 0;
+			m_iterations = 0;
+			terminal_printf("OK\n");
+		} else {
+			terminal_wrong_args();
+		}
+		return;
+	} else if (argc != 1) {
+		terminal_wrong_args();
+		return;
+	}
+
+	terminal_printf("Iterations:       %lu", m_iterations);
+	terminal_printf("Missed batches:   %lu", m_missed);
+	terminal_printf("Overruns:         %lu (no batch within %d ms)", m_overruns, BATCH_DEADLINE_MS);
+	terminal_printf("Max exec time:    %.1f us",
+			(double)((float)m_exec_max_cycles / ((float)STM32_SYSCLK / 1e6)));
 }
 
 static void update_rc_control(MR_CONTROL_STATE *ctrl, MR_RC_STATE *rc, POS_STATE *pos, float dt) {
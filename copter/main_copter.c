@@ -27,13 +27,18 @@
 #include "conf_general.h"
 #include "log.h"
 #include "time_today.h"
+#include "timebase.h"
 #include "bmi160_wrapper.h"
 #include "pos.h"
 #include "pos_imu.h"
 #include "pos_gnss.h"
-#include "servo_pwm.h"
+#include "actuator.h"
 #include "ublox.h"
 #include "timeout.h"
+#include "blackbox.h"
+#include "prof.h"
+#include "trace.h"
+#include "latency.h"
 #include "copter_control.h"
 
 // see: USB_CDC in ChibiOS testhal
@@ -58,17 +63,22 @@ static void usbSerialInit(void) {
 static void timeout_stop_cb(void) {
   palWriteLine(LINE_LED_RED, 1);
 
+  // keep what happened before the stop, a boot without a host is no incident
+  if (timeout_has_contact())
+    blackbox_trigger(BLACKBOX_REASON_TIMEOUT);
+
 //  TODO!
-  // set servo_pwm to safe value
-  servo_pwm_safety_stop();
+  // stop motors
+  actuator_safety_stop();
 }
 
 static void timeout_reset_cb(void) {
   palWriteLine(LINE_LED_RED, 0);
+  blackbox_rearm();
 
 //  TODO!
-  // set servo_pwm to safe value
-  servo_pwm_reset_safety_stop();
+  // allow motor commands again
+  actuator_reset_safety_stop();
 }
 
 /*
@@ -101,27 +111,34 @@ int main(void) {
       chThdSleepMilliseconds(100);
   }
   palWriteLine(LINE_LED_RED, 0); // USB-Serial connection is set up
+  commands_init();
   comm_serial_init((BaseSequentialStream *)&PORTAB_SDU1);
   terminal_set_vprintf(&commands_vprintf);
+  prof_init();
+  trace_init();
+  latency_init();
+  timebase_init();
+  time_today_init();
 
   conf_general_init();
 
-  // copter: init all servos incl. safe stop value (TODO: currently, the copter will fall from the sky like a rock)
-  servo_pwm_init(0b1111, 0.0);
+  // copter: init motor outputs, servo PWM or DShot
+  actuator_init();
 
   // Init positioning (pos), BMI160 IMU and u-blox GNSS (F9P).
-  // pos input: IMU (500 Hz), GNSS (5 Hz).
+  // pos input: IMU (400 Hz ODR, the BMI160 has no 500 Hz rate), GNSS (5 Hz).
   // Note: F9P supports 10 Hz update rate, but moving base over 4G does not (TODO: -> conf_general)
   // Copter-specific correction functions are called by pos using registered hooks.
-  // Copter control iteration is run _after_ IMU-based position correction (post hook).
+  // The copter control thread is woken after pos has processed each IMU FIFO batch.
   pos_init();
+  copter_control_init();
   pos_set_correction_imu_hook(copter_control_pos_correction_imu);
-  pos_set_correction_imu_post_hook(copter_control_run_iteration);
   pos_set_correction_gnss_hook(copter_control_pos_correction_gnss);
   pos_imu_init();
   pos_gnss_init();
-  bmi160_wrapper_init(500);
+  bmi160_wrapper_init(400);
   bmi160_wrapper_set_read_callback(pos_imu_data_cb);
+  bmi160_wrapper_set_batch_callback(copter_control_imu_batch);
   palWriteLine(LINE_LED_RED, 1);
   ublox_init();
   ublox_set_nmea_callback(&pos_gnss_nmea_cb);
@@ -136,6 +153,8 @@ int main(void) {
   log_set_enabled(main_config.log_en);
   log_set_name(main_config.log_name);
 
+  blackbox_init();
+
   timeout_init(1000, timeout_stop_cb, timeout_reset_cb); // safety timeout
 
   /*
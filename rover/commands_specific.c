@@ -12,7 +12,7 @@
 #include "conf_general.h"
 #include "servo_pwm.h"
 #include "bldc_interface.h"
-#include "comm_can.h"
+#include "drive.h"
 #include "pos.h"
 #include "pos_imu.h"
 #include "autopilot.h"
@@ -89,17 +89,11 @@ bool commands_specific_process_packet(CMD_PACKET packet_id, unsigned char *data,
 
 		switch (mode) {
 		case RC_MODE_CURRENT:
-			if (!main_config.car.disable_motor) {
-				comm_can_set_vesc_id(VESC_ID);
-				bldc_interface_set_current(throttle);
-			}
+			drive_set_current(throttle);
 			break;
 		case RC_MODE_DUTY:
 			utils_truncate_number(&throttle, -1.0, 1.0);
-			if (!main_config.car.disable_motor) {
-				comm_can_set_vesc_id(VESC_ID);
-				bldc_interface_set_duty_cycle(throttle);
-			}
+			drive_set_duty(throttle);
 			break;
 		default:
 			break;
@@ -32,14 +32,21 @@
 #define FW_VERSION_MAJOR			20
 #define FW_VERSION_MINOR			1
 
+// Version of the stored MAIN_CONFIG layout. Increase it when fields are
+// changed, removed or reordered. Fields appended at the end of MAIN_CONFIG
+// do not need a new version, they get their defaults when an older record
+// is loaded.
+#define MAIN_CONFIG_VERSION			1
+
 // General settings
 #define ID_ALL						255
 #define ID_CAR_CLIENT				254 // Packet for car client only
 #ifndef VESC_ID
-#define VESC_ID						ID_ALL // id, or ID_ALL for any VESC (not used in diff steering mode)
+#define VESC_ID						ID_ALL // id, or ID_ALL for any VESC (default for drive.vesc_id)
 #endif
 
 // Car parameters
+#define SERVO_STEERING				0 // Servo channel, ramped with car.steering_ramp_time
 #ifndef BOARD_YAW_ROT
 #define BOARD_YAW_ROT				180.0
 #endif
@@ -55,5 +62,6 @@ extern int main_id;
 void conf_general_init(void);
 void conf_general_get_default_main_config(MAIN_CONFIG *conf);
 bool conf_general_store_main_config(MAIN_CONFIG *conf);
+bool conf_general_store_gyro_bias(float x, float y, float z);
 
 #endif /* CONF_GENERAL_H_ */
@@ -27,6 +27,7 @@
 #include "conf_general.h"
 #include "log.h"
 #include "time_today.h"
+#include "timebase.h"
 #include "bmi160_wrapper.h"
 #include "pos.h"
 #include "pos_mc.h"
@@ -38,6 +39,10 @@
 #include "motor_sim.h"
 #include "ublox.h"
 #include "timeout.h"
+#include "blackbox.h"
+#include "prof.h"
+#include "trace.h"
+#include "latency.h"
 #include "autopilot.h"
 
 // see: USB_CDC in ChibiOS testhal
@@ -62,6 +67,10 @@ static void usbSerialInit(void) {
 static void timeout_stop_cb(void) {
   palWriteLine(LINE_LED_RED, 1);
 
+  // keep what happened before the stop, a boot without a host is no incident
+  if (timeout_has_contact())
+    blackbox_trigger(BLACKBOX_REASON_TIMEOUT);
+
   // stop bldc_interface, brake if in motion
   comm_can_set_vesc_id(ID_ALL);
   if (!main_config.car.disable_motor && bldc_interface_get_last_received_values().rpm > TIMEOUT_MIN_RPM_BRAKE)
@@ -78,6 +87,7 @@ static void timeout_stop_cb(void) {
 
 static void timeout_reset_cb(void) {
   palWriteLine(LINE_LED_RED, 0);
+  blackbox_rearm();
   bldc_interface_reset_safety_stop();
   servo_pwm_reset_safety_stop();
 }
@@ -112,33 +122,41 @@ int main(void) {
       chThdSleepMilliseconds(100);
   }
   palWriteLine(LINE_LED_RED, 0); // USB-Serial connection is set up
+  commands_init();
   comm_serial_init((BaseSequentialStream *)&PORTAB_SDU1);
   terminal_set_vprintf(&commands_vprintf);
+  prof_init();
+  trace_init();
+  latency_init();
+  timebase_init();
+  time_today_init();
 
   conf_general_init();
 
   // car: init single servo (SERVO0) incl. safe stop value, set to center
   servo_pwm_init(0b0001, 0.5);
-  servo_pwm_set(0, 0.5);
+  servo_pwm_set(SERVO_STEERING, 0.5);
+  servo_pwm_set_ramp_time(SERVO_STEERING, main_config.car.steering_ramp_time);
 
   // init CAN communication (incl. VESC/bldc_interface)
   comm_can_init();
 
   // Init positioning (pos), BMI160 IMU and u-blox GNSS (F9P).
   // Set bldc_interface (Motor Controller) callback
-  // pos input: IMU (500 Hz), GNSS (5 Hz), Motor Controller (50 Hz)
+  // pos input: IMU (400 Hz ODR, the BMI160 has no 500 Hz rate), GNSS (5 Hz), Motor Controller (50 Hz)
   // Note: F9P supports 10 Hz update rate, but moving base over 4G does not (TODO: -> conf_general)
   pos_init();
   pos_mc_init();
   pos_imu_init();
   pos_gnss_init();
-  bmi160_wrapper_init(500);
+  bmi160_wrapper_init(400);
   bmi160_wrapper_set_read_callback(pos_imu_data_cb);
   palWriteLine(LINE_LED_RED, 1);
   ublox_init();
   ublox_set_nmea_callback(&pos_gnss_nmea_cb);
   palWriteLine(LINE_LED_RED, 0); // u-blox init done
   bldc_interface_set_rx_value_func(pos_mc_values_cb);
+  comm_can_set_status_func(pos_mc_status_cb);
 
   // u-blox PPS callback for timekeeping
   palEnableLineEvent(LINE_UBX_PPS, PAL_EVENT_MODE_RISING_EDGE);
@@ -153,6 +171,8 @@ int main(void) {
 
   motor_sim_init();
 
+  blackbox_init();
+
   timeout_init(1000, timeout_stop_cb, timeout_reset_cb); // safety timeout
 
   /*
@@ -169,8 +189,10 @@ int main(void) {
 	// packet communication timeout
     packet_timerfunc();
 
-    // poll motor controller info every 20 ms -> 50 Hz
-    if (i % 2 == 0)
+    // poll motor controller info every 20 ms -> 50 Hz. With status
+    // broadcasts the odometry comes from those, then poll every 500 ms
+    // for the remaining values.
+    if (pos_mc_status_active() ? (i % 50 == 0) : (i % 2 == 0))
     	bldc_interface_get_values();
 
     chThdSleepMilliseconds(10);
@@ -0,0 +1,526 @@
+/*
+	Copyright 2021 Marvin Damschen	marvin.damschen@ri.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Replays IMU data through all AHRS variants on the host and reports the
+ * attitude error against a reference and the time per update.
+ *
+ * Input is a CSV file with one sample per line:
+ *
+ *   dt,ax,ay,az,gx,gy,gz,mx,my,mz[,q0,q1,q2,q3]
+ *
+ * in s, g, deg/s and any unit for mag, in the frame that pos_imu passes to
+ * the filters (after mag calibration and board rotation). The optional
+ * quaternion is the reference attitude. Lines starting with # are skipped.
+ *
+ * Without a file a recording is simulated: the vehicle rotates with varying
+ * rates, the gyro has a bias and all sensors have noise. -w writes that
+ * recording in the format above. With simulated data the run fails if the
+ * 9-DOF variants do not hold yaw better than the 6-DOF ones, or if any
+ * variant loses the tilt. The simulated field has the inclination of
+ * Sweden, where the vertical part of the field dominates. Mahony9 feeds
+ * that into the tilt, so it ends up with both more tilt and more yaw error
+ * than Madgwick9 there.
+ *
+ * The estimates of every variant are also converted to roll, pitch and yaw
+ * with both the libm and the fast math (AHRS_FAST_MATH) extraction, and the
+ * sin and cos of the roll and pitch are taken with utils_fast_sincos_better
+ * as in the tilt compensation. The run fails if the fast path is off by more
+ * than FAST_ANGLE_ERR_MAX_DEG from libm on any sample, for both simulated
+ * and recorded data.
+ *
+ * The times are host times and only useful to compare the variants and the
+ * two paths, ahrs_bench on the board gives cycle counts.
+ */
+
+#include "ahrs.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+// Settings
+#define SIM_RATE_HZ					400
+#define SIM_TIME_S					120.0
+#define SIM_GYRO_BIAS				{0.2, -0.1, 0.5} // deg/s
+#define SIM_GYRO_NOISE				0.1 // deg/s
+#define SIM_ACC_NOISE				0.005 // g
+#define SIM_MAG_NOISE				0.01 // Field strength is 1
+#define SIM_MAG_INCLINATION			70.0 // deg
+#define SETTLE_TIME_S				5.0 // Not counted in the error
+#define TILT_MAX_DEG				5.0 // Limit for the simulated run
+#define FAST_ANGLE_ERR_MAX_DEG		0.6 // utils_fast_atan2 is within 0.58 deg
+#define FAST_SINCOS_ERR_MAX			0.002 // utils_fast_sincos_better vs libm
+
+// Private types
+typedef struct {
+	float dt;
+	float acc[3];
+	float gyro[3];
+	float mag[3];
+	bool has_ref;
+	float ref[4];
+} sample_t;
+
+typedef struct {
+	const char *name;
+	bool use_mag;
+	bool mahony;
+} variant_t;
+
+// Private variables
+static const variant_t m_variants[] = {
+		{"Madgwick", false, false},
+		{"Madgwick9", true, false},
+		{"Mahony", false, true},
+		{"Mahony9", true, true}
+};
+
+static sample_t *m_samples;
+static int m_sample_num;
+static volatile float m_sink; // Keeps the timed calls
+
+// Private functions
+static bool load_csv(const char *path);
+static void simulate(void);
+static bool write_csv(const char *path);
+static float randn(void);
+static void gravity_in_body(const float *q, float *v);
+static void earth_to_body(const float *q, const float *e, float *b);
+static float vec_angle(const float *a, const float *b);
+static void fast_math_check(const float *est, int num, double *ns, float *err, float *sincos_err);
+static double ns_since(const struct timespec *t0, int num);
+
+int main(int argc, char **argv) {
+	const char *in = NULL;
+	const char *out = NULL;
+
+	for (int i = 1;i < argc;i++) {
+		if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+			out = argv[++i];
+		} else if (argv[i][0] != '-' && !in) {
+			in = argv[i];
+		} else {
+			fprintf(stderr, "Usage: %s [-w simulated.csv] [recording.csv]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	if (in) {
+		if (!load_csv(in)) {
+			return 2;
+		}
+	} else {
+		simulate();
+		if (out && !write_csv(out)) {
+			return 2;
+		}
+	}
+
+	bool has_ref = m_sample_num > 0 && m_samples[0].has_ref;
+	float *est = malloc(sizeof(float) * 4 * m_sample_num);
+	float yaw_rms[4] = {0};
+	float tilt_max[4] = {0};
+	double fast_ns[4][2];
+	float fast_err[4][3];
+	float sincos_err[4];
+	bool ok = true;
+
+	printf("%d samples, %s\n", m_sample_num, in ? in : "simulated");
+	printf("   filter  ns/update  tilt rms  tilt max   yaw rms   yaw max  (deg)\n");
+
+	for (unsigned int v = 0;v < sizeof(m_variants) / sizeof(m_variants[0]);v++) {
+		const variant_t *var = &m_variants[v];
+		ATTITUDE_INFO att;
+		ahrs_init_attitude_info(&att);
+
+		// Start from the reference so that the error is what the filter adds
+		if (has_ref) {
+			att.q0 = m_samples[0].ref[0];
+			att.q1 = m_samples[0].ref[1];
+			att.q2 = m_samples[0].ref[2];
+			att.q3 = m_samples[0].ref[3];
+		}
+		att.initialUpdateDone = 1;
+
+		struct timespec t0;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+
+		for (int i = 0;i < m_sample_num;i++) {
+			const sample_t *s = &m_samples[i];
+			float acc[3] = {s->acc[0], s->acc[1], s->acc[2]};
+			float mag[3] = {s->mag[0], s->mag[1], s->mag[2]};
+			float gyro[3];
+			for (int j = 0;j < 3;j++) {
+				gyro[j] = s->gyro[j] * M_PI / 180.0;
+			}
+
+			if (var->mahony) {
+				if (var->use_mag) {
+					ahrs_update_mahony(gyro, acc, mag, s->dt, &att);
+				} else {
+					ahrs_update_mahony_imu(gyro, acc, s->dt, &att);
+				}
+			} else {
+				if (var->use_mag) {
+					ahrs_update_madgwick(gyro, acc, mag, s->dt, &att);
+				} else {
+					ahrs_update_madgwick_imu(gyro, acc, s->dt, &att);
+				}
+			}
+
+			est[4 * i] = att.q0;
+			est[4 * i + 1] = att.q1;
+			est[4 * i + 2] = att.q2;
+			est[4 * i + 3] = att.q3;
+		}
+
+		double ns = ns_since(&t0, m_sample_num);
+		fast_math_check(est, m_sample_num, fast_ns[v], fast_err[v], &sincos_err[v]);
+
+		if (!has_ref) {
+			ATTITUDE_INFO end = att;
+			float rpy[3];
+			ahrs_get_roll_pitch_yaw_precise(rpy, &end);
+			printf("%9s %10.1f  no reference, final rpy %.2f %.2f %.2f\n", var->name, ns,
+					(double)(rpy[0] * 180.0 / M_PI), (double)(rpy[1] * 180.0 / M_PI),
+					(double)(rpy[2] * 180.0 / M_PI));
+			continue;
+		}
+
+		double time = 0.0, tilt_sq = 0.0, yaw_sq = 0.0;
+		float yaw_max = 0.0;
+		int num = 0;
+
+		for (int i = 0;i < m_sample_num;i++) {
+			time += m_samples[i].dt;
+			if (time < SETTLE_TIME_S) {
+				continue;
+			}
+
+			float g_est[3], g_ref[3];
+			gravity_in_body(&est[4 * i], g_est);
+			gravity_in_body(m_samples[i].ref, g_ref);
+			float tilt = vec_angle(g_est, g_ref);
+
+			ATTITUDE_INFO a_est, a_ref;
+			memset(&a_est, 0, sizeof(a_est));
+			memset(&a_ref, 0, sizeof(a_ref));
+			a_est.q0 = est[4 * i]; a_est.q1 = est[4 * i + 1];
+			a_est.q2 = est[4 * i + 2]; a_est.q3 = est[4 * i + 3];
+			a_ref.q0 = m_samples[i].ref[0]; a_ref.q1 = m_samples[i].ref[1];
+			a_ref.q2 = m_samples[i].ref[2]; a_ref.q3 = m_samples[i].ref[3];
+			float yaw = fabsf(utils_angle_difference_rad(ahrs_get_yaw(&a_est), ahrs_get_yaw(&a_ref)));
+
+			tilt_sq += tilt * tilt;
+			yaw_sq += yaw * yaw;
+			if (tilt > tilt_max[v]) {
+				tilt_max[v] = tilt;
+			}
+			if (yaw > yaw_max) {
+				yaw_max = yaw;
+			}
+			num++;
+		}
+
+		const double r2d = 180.0 / M_PI;
+		num = num > 0 ? num : 1;
+		yaw_rms[v] = sqrt(yaw_sq / num);
+		tilt_max[v] *= r2d;
+		yaw_rms[v] *= r2d;
+
+		printf("%9s %10.1f %9.3f %9.3f %9.3f %9.3f\n", var->name, ns,
+				sqrt(tilt_sq / num) * r2d, (double)tilt_max[v],
+				(double)yaw_rms[v], (double)yaw_max * r2d);
+	}
+
+	printf("\n   filter rpy libm ns rpy fast ns  roll max pitch max   yaw max  (deg)  sincos max\n");
+
+	for (int v = 0;v < 4;v++) {
+		const double r2d = 180.0 / M_PI;
+		printf("%9s %11.1f %11.1f %9.4f %9.4f %9.4f %18.5f\n", m_variants[v].name,
+				fast_ns[v][0], fast_ns[v][1],
+				(double)fast_err[v][0] * r2d, (double)fast_err[v][1] * r2d,
+				(double)fast_err[v][2] * r2d, (double)sincos_err[v]);
+
+		for (int j = 0;j < 3;j++) {
+			if (!(fast_err[v][j] * r2d < FAST_ANGLE_ERR_MAX_DEG)) {
+				printf("FAIL: %s fast %s off by more than %.2f deg\n", m_variants[v].name,
+						j == 0 ? "roll" : (j == 1 ? "pitch" : "yaw"), FAST_ANGLE_ERR_MAX_DEG);
+				ok = false;
+			}
+		}
+
+		if (!(sincos_err[v] < FAST_SINCOS_ERR_MAX)) {
+			printf("FAIL: %s fast sin and cos off by more than %.3f\n",
+					m_variants[v].name, FAST_SINCOS_ERR_MAX);
+			ok = false;
+		}
+	}
+
+	if (!in) {
+		for (int v = 0;v < 4;v++) {
+			if (!(tilt_max[v] < TILT_MAX_DEG)) {
+				printf("FAIL: %s tilt error above %.1f deg\n", m_variants[v].name, TILT_MAX_DEG);
+				ok = false;
+			}
+		}
+
+		// Madgwick9 vs Madgwick and Mahony9 vs Mahony
+		for (int v = 1;v < 4;v += 2) {
+			if (!(yaw_rms[v] < yaw_rms[v - 1])) {
+				printf("FAIL: %s does not hold yaw better than %s\n",
+						m_variants[v].name, m_variants[v - 1].name);
+				ok = false;
+			}
+		}
+	}
+
+	free(est);
+	free(m_samples);
+
+	return ok ? 0 : 1;
+}
+
+static bool load_csv(const char *path) {
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return false;
+	}
+
+	int cap = 1024;
+	m_samples = malloc(sizeof(sample_t) * cap);
+	m_sample_num = 0;
+
+	char line[512];
+	int line_num = 0;
+	while (fgets(line, sizeof(line), f)) {
+		line_num++;
+		if (line[0] == '#' || line[0] == '\n' || line[0] == '\r') {
+			continue;
+		}
+
+		sample_t s;
+		int n = sscanf(line, "%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f,%f",
+				&s.dt, &s.acc[0], &s.acc[1], &s.acc[2],
+				&s.gyro[0], &s.gyro[1], &s.gyro[2],
+				&s.mag[0], &s.mag[1], &s.mag[2],
+				&s.ref[0], &s.ref[1], &s.ref[2], &s.ref[3]);
+
+		if (n != 10 && n != 14) {
+			fprintf(stderr, "%s:%d: expected 10 or 14 values, got %d\n", path, line_num, n);
+			fclose(f);
+			return false;
+		}
+
+		s.has_ref = n == 14;
+		if (m_sample_num > 0 && s.has_ref != m_samples[0].has_ref) {
+			fprintf(stderr, "%s:%d: reference on some lines only\n", path, line_num);
+			fclose(f);
+			return false;
+		}
+
+		if (m_sample_num == cap) {
+			cap *= 2;
+			m_samples = realloc(m_samples, sizeof(sample_t) * cap);
+		}
+		m_samples[m_sample_num++] = s;
+	}
+
+	fclose(f);
+	return true;
+}
+
+/*
+ * The truth is integrated the same way as in the filters, q' = q * (0, w) / 2,
+ * and the sensors see gravity and the earth field rotated into the body
+ * frame with the same convention the filters use for their estimates.
+ */
+static void simulate(void) {
+	const float dt = 1.0 / SIM_RATE_HZ;
+	const float bias[3] = SIM_GYRO_BIAS;
+	const float incl = SIM_MAG_INCLINATION * M_PI / 180.0;
+	const float field[3] = {cosf(incl), 0.0, sinf(incl)};
+
+	m_sample_num = (int)(SIM_TIME_S * SIM_RATE_HZ);
+	m_samples = malloc(sizeof(sample_t) * m_sample_num);
+	srand(1);
+
+	// Start at 30 deg yaw and a small tilt
+	float q[4] = {cosf(0.27), 0.05, -0.03, sinf(0.27)};
+
+	for (int i = 0;i < m_sample_num;i++) {
+		sample_t *s = &m_samples[i];
+		float t = (float)i * dt;
+
+		// Rates in rad/s, zero mean so the tilt stays bounded
+		float w[3] = {
+				0.6 * sinf(2.0 * M_PI * 0.31 * t),
+				0.5 * sinf(2.0 * M_PI * 0.23 * t + 1.0),
+				0.8 * sinf(2.0 * M_PI * 0.05 * t) + 0.3 * sinf(2.0 * M_PI * 0.7 * t)
+		};
+
+		float qd[4] = {
+				0.5 * (-q[1] * w[0] - q[2] * w[1] - q[3] * w[2]),
+				0.5 * (q[0] * w[0] + q[2] * w[2] - q[3] * w[1]),
+				0.5 * (q[0] * w[1] - q[1] * w[2] + q[3] * w[0]),
+				0.5 * (q[0] * w[2] + q[1] * w[1] - q[2] * w[0])
+		};
+
+		float norm = 0.0;
+		for (int j = 0;j < 4;j++) {
+			q[j] += qd[j] * dt;
+			norm += q[j] * q[j];
+		}
+		norm = sqrtf(norm);
+		for (int j = 0;j < 4;j++) {
+			q[j] /= norm;
+		}
+
+		float g[3], m[3];
+		gravity_in_body(q, g);
+		earth_to_body(q, field, m);
+
+		s->dt = dt;
+		for (int j = 0;j < 3;j++) {
+			s->acc[j] = g[j] + SIM_ACC_NOISE * randn();
+			s->gyro[j] = w[j] * 180.0 / M_PI + bias[j] + SIM_GYRO_NOISE * randn();
+			s->mag[j] = m[j] + SIM_MAG_NOISE * randn();
+		}
+		s->has_ref = true;
+		memcpy(s->ref, q, sizeof(s->ref));
+	}
+}
+
+static bool write_csv(const char *path) {
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		perror(path);
+		return false;
+	}
+
+	fprintf(f, "# dt,ax,ay,az,gx,gy,gz,mx,my,mz,q0,q1,q2,q3\n");
+	for (int i = 0;i < m_sample_num;i++) {
+		const sample_t *s = &m_samples[i];
+		fprintf(f, "%.6f,%.5f,%.5f,%.5f,%.4f,%.4f,%.4f,%.5f,%.5f,%.5f,%.6f,%.6f,%.6f,%.6f\n",
+				(double)s->dt, (double)s->acc[0], (double)s->acc[1], (double)s->acc[2],
+				(double)s->gyro[0], (double)s->gyro[1], (double)s->gyro[2],
+				(double)s->mag[0], (double)s->mag[1], (double)s->mag[2],
+				(double)s->ref[0], (double)s->ref[1], (double)s->ref[2], (double)s->ref[3]);
+	}
+
+	fclose(f);
+	return true;
+}
+
+static float randn(void) {
+	// Box-Muller, deterministic with the fixed seed
+	float u1 = ((float)rand() + 1.0) / ((float)RAND_MAX + 2.0);
+	float u2 = ((float)rand() + 1.0) / ((float)RAND_MAX + 2.0);
+	return sqrtf(-2.0 * logf(u1)) * cosf(2.0 * M_PI * u2);
+}
+
+static void gravity_in_body(const float *q, float *v) {
+	v[0] = 2.0 * (q[1] * q[3] - q[0] * q[2]);
+	v[1] = 2.0 * (q[0] * q[1] + q[2] * q[3]);
+	v[2] = q[0] * q[0] - q[1] * q[1] - q[2] * q[2] + q[3] * q[3];
+}
+
+static void earth_to_body(const float *q, const float *e, float *b) {
+	const float q0 = q[0], q1 = q[1], q2 = q[2], q3 = q[3];
+
+	b[0] = 2.0 * (e[0] * (0.5 - q2 * q2 - q3 * q3) + e[1] * (q1 * q2 + q0 * q3) + e[2] * (q1 * q3 - q0 * q2));
+	b[1] = 2.0 * (e[0] * (q1 * q2 - q0 * q3) + e[1] * (0.5 - q1 * q1 - q3 * q3) + e[2] * (q0 * q1 + q2 * q3));
+	b[2] = 2.0 * (e[0] * (q0 * q2 + q1 * q3) + e[1] * (q2 * q3 - q0 * q1) + e[2] * (0.5 - q1 * q1 - q2 * q2));
+}
+
+/*
+ * Runs both angle extraction paths over the estimates. The libm result is
+ * taken as the truth, the errors are the maximum over all samples. The
+ * timing loops store into m_sink so that they are not optimized out.
+ */
+static void fast_math_check(const float *est, int num, double *ns, float *err, float *sincos_err) {
+	float *precise = malloc(sizeof(float) * 3 * num);
+	float *fast = malloc(sizeof(float) * 3 * num);
+	struct timespec t0;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int i = 0;i < num;i++) {
+		ATTITUDE_INFO att;
+		att.q0 = est[4 * i]; att.q1 = est[4 * i + 1];
+		att.q2 = est[4 * i + 2]; att.q3 = est[4 * i + 3];
+		ahrs_get_roll_pitch_yaw_precise(&precise[3 * i], &att);
+		m_sink = precise[3 * i];
+	}
+	ns[0] = ns_since(&t0, num);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int i = 0;i < num;i++) {
+		ATTITUDE_INFO att;
+		att.q0 = est[4 * i]; att.q1 = est[4 * i + 1];
+		att.q2 = est[4 * i + 2]; att.q3 = est[4 * i + 3];
+		ahrs_get_roll_pitch_yaw_fast(&fast[3 * i], &att);
+		m_sink = fast[3 * i];
+	}
+	ns[1] = ns_since(&t0, num);
+
+	err[0] = err[1] = err[2] = 0.0;
+	*sincos_err = 0.0;
+
+	for (int i = 0;i < num;i++) {
+		for (int j = 0;j < 3;j++) {
+			float e = fabsf(utils_angle_difference_rad(fast[3 * i + j], precise[3 * i + j]));
+			if (e > err[j]) {
+				err[j] = e;
+			}
+		}
+
+		// The tilt compensation rotates the mag by roll and pitch
+		for (int j = 0;j < 2;j++) {
+			float ang = precise[3 * i + j];
+			float s, c;
+			utils_fast_sincos_better(ang, &s, &c);
+			float e = fmaxf(fabsf(s - sinf(ang)), fabsf(c - cosf(ang)));
+			if (e > *sincos_err) {
+				*sincos_err = e;
+			}
+		}
+	}
+
+	free(precise);
+	free(fast);
+}
+
+static double ns_since(const struct timespec *t0, int num) {
+	struct timespec t1;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return ((double)(t1.tv_sec - t0->tv_sec) * 1e9 + (double)(t1.tv_nsec - t0->tv_nsec)) /
+			(double)(num > 0 ? num : 1);
+}
+
+static float vec_angle(const float *a, const float *b) {
+	float dot = a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+	float na = sqrtf(a[0] * a[0] + a[1] * a[1] + a[2] * a[2]);
+	float nb = sqrtf(b[0] * b[0] + b[1] * b[1] + b[2] * b[2]);
+	float c = dot / (na * nb);
+	utils_truncate_number(&c, -1.0, 1.0);
+	return acosf(c);
+}
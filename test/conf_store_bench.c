@@ -0,0 +1,175 @@
+/*
+	Copyright 2021 Marvin Damschen	marvin.damschen@ri.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Wear and throughput of saving MAIN_CONFIG, measured on the flash
+ * emulator: conf_store records against the per-halfword EEPROM emulation
+ * that older firmware used.
+ *
+ * Erases and programmed bytes are counted by the emulator. The flash busy
+ * time is the sum of the typical program and erase times of the STM32F405
+ * datasheet, the host time is what the code under test takes on this
+ * machine without those.
+ */
+
+#include "flash_emu.h"
+#include "eeprom.h"
+#include "conf_store.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Settings
+#define FLASH_FILE					"build/flash_bench.bin"
+#define SAVES						1000
+#define EEPROM_BASE_MAINCONF		1000
+#define CONF_HALFWORDS				((int)sizeof(MAIN_CONFIG) / 2)
+
+// Private types
+typedef enum {
+	CHANGE_ONE_FLOAT = 0,
+	CHANGE_ALL
+} change_type;
+
+// Global variables
+uint16_t VirtAddVarTab[NB_OF_VAR];
+
+// Private variables
+static MAIN_CONFIG m_conf;
+
+// Private functions
+static void change_conf(change_type change, int save);
+static bool save_conf_store(void);
+static bool save_eeprom(void);
+static void run(const char *name, bool (*save)(void), change_type change);
+
+void terminal_register_command_callback(const char* command, const char *help,
+		const char *arg_names, void(*cbf)(int argc, const char **argv)) {
+	(void)command; (void)help; (void)arg_names; (void)cbf;
+}
+
+void terminal_printf(const char* format, ...) {
+	(void)format;
+}
+
+int main(void) {
+	if (!flash_emu_open(FLASH_FILE)) {
+		return 2;
+	}
+
+	for (int i = 0;i < CONF_HALFWORDS;i++) {
+		VirtAddVarTab[i] = EEPROM_BASE_MAINCONF + i;
+	}
+
+	printf("%d saves of a %d byte MAIN_CONFIG\n", SAVES, (int)sizeof(MAIN_CONFIG));
+	printf("%-12s %-10s %8s %10s %10s %12s %10s\n", "store", "change", "erases",
+			"programs", "kB", "flash s", "host us");
+
+	run("conf_store", save_conf_store, CHANGE_ONE_FLOAT);
+	run("eeprom", save_eeprom, CHANGE_ONE_FLOAT);
+	run("conf_store", save_conf_store, CHANGE_ALL);
+	run("eeprom", save_eeprom, CHANGE_ALL);
+
+	flash_emu_close();
+	return 0;
+}
+
+static void change_conf(change_type change, int save) {
+	switch (change) {
+	case CHANGE_ONE_FLOAT:
+		// Like tuning one parameter from the GUI
+		m_conf.mr.vel_decay_e = (float)save * 0.01f;
+		break;
+
+	case CHANGE_ALL: {
+		uint8_t *p = (uint8_t*)&m_conf;
+		for (unsigned int i = 0;i < sizeof(m_conf);i++) {
+			p[i] = (uint8_t)(i + save);
+		}
+	} break;
+	}
+}
+
+static bool save_conf_store(void) {
+	return conf_store_save(&m_conf, sizeof(m_conf), 1);
+}
+
+// conf_general_store_main_config of older firmware
+static bool save_eeprom(void) {
+	uint8_t *conf_addr = (uint8_t*)&m_conf;
+
+	for (int i = 0;i < CONF_HALFWORDS;i++) {
+		uint16_t var = (conf_addr[2 * i] << 8) & 0xFF00;
+		var |= conf_addr[2 * i + 1] & 0xFF;
+
+		if (EE_WriteVariable(EEPROM_BASE_MAINCONF + i, var) != FLASH_COMPLETE) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void run(const char *name, bool (*save)(void), change_type change) {
+	flash_emu_erase_all();
+	memset(&m_conf, 0, sizeof(m_conf));
+	if (save == save_eeprom) {
+		EE_Init();
+	}
+
+	// Start from a stored configuration
+	save();
+	flash_emu_reset_stats();
+
+	double host_us = 0.0;
+	int fails = 0;
+
+	for (int i = 0;i < SAVES;i++) {
+		change_conf(change, i + 1);
+
+		struct timespec start, end;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		if (!save()) {
+			fails++;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		host_us += (double)(end.tv_sec - start.tv_sec) * 1e6 +
+				(double)(end.tv_nsec - start.tv_nsec) * 1e-3;
+	}
+
+	flash_emu_stats stats;
+	flash_emu_get_stats(&stats);
+
+	uint32_t erases = 0;
+	for (int i = 0;i < FLASH_EMU_SECTORS;i++) {
+		erases += stats.erases[i];
+	}
+
+	printf("%-12s %-10s %8lu %10lu %10.1f %12.2f %10.1f\n", name,
+			change == CHANGE_ONE_FLOAT ? "one float" : "all",
+			(unsigned long)erases, (unsigned long)stats.programs,
+			(double)stats.program_bytes / 1024.0, stats.busy_us * 1e-6,
+			host_us / SAVES);
+
+	if (fails > 0) {
+		printf("%d saves failed\n", fails);
+		exit(1);
+	}
+}
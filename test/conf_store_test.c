@@ -0,0 +1,428 @@
+/*
+	Copyright 2021 Marvin Damschen	marvin.damschen@ri.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Tests of the EEPROM emulation and conf_store on the flash emulator.
+ *
+ * Power loss is injected at every flash operation of a sequence in turn,
+ * starting from the same flash image each time, and the sequence is
+ * repeated with different torn bits. After the "reboot" the stored data
+ * must be the complete old or the complete new version.
+ *
+ * The EEPROM emulation has one known hole: when the address half of an
+ * entry is torn it can match another variable, which then reads the value
+ * of the interrupted write. Firmware only reads the EEPROM to upgrade old
+ * configurations, so such cases are counted and printed, not failed.
+ */
+
+#include "flash_emu.h"
+#include "eeprom.h"
+#include "conf_store.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Settings
+#define FLASH_FILE					"build/flash_test.bin"
+#define EE_VARS						64
+#define EE_BASE						1000
+#define REC_SIZE					((int)sizeof(MAIN_CONFIG))
+#define SEEDS						8
+
+// Global variables
+uint16_t VirtAddVarTab[NB_OF_VAR];
+
+// Private variables
+static uint8_t m_image[2 * PAGE_SIZE];
+static int m_failures;
+
+// Private functions
+static void check(bool ok, const char *what, int step);
+static void snapshot(void);
+static void restore(void);
+static uint16_t ee_value(int var, int round);
+static bool ee_value_of_other(int var, uint16_t value, int round);
+static void fill_record(uint8_t *rec, int round);
+static void test_ee_basic(void);
+static void test_ee_power_loss(void);
+static bool ee_power_loss_step(int step, int round, int *aliased);
+static void test_store_basic(void);
+static void test_store_power_loss(void);
+static bool store_power_loss_step(int step, int round, int saves);
+static void test_store_erase_fail(void);
+
+void terminal_register_command_callback(const char* command, const char *help,
+		const char *arg_names, void(*cbf)(int argc, const char **argv)) {
+	(void)command; (void)help; (void)arg_names; (void)cbf;
+}
+
+void terminal_printf(const char* format, ...) {
+	(void)format;
+}
+
+int main(void) {
+	if (!flash_emu_open(FLASH_FILE)) {
+		return 2;
+	}
+
+	for (int i = 0;i < EE_VARS;i++) {
+		VirtAddVarTab[i] = EE_BASE + i;
+	}
+
+	test_ee_basic();
+	test_ee_power_loss();
+	test_store_basic();
+	test_store_power_loss();
+	test_store_erase_fail();
+
+	flash_emu_close();
+
+	if (m_failures > 0) {
+		printf("%d checks failed\n", m_failures);
+		return 1;
+	}
+
+	printf("All checks passed\n");
+	return 0;
+}
+
+static void check(bool ok, const char *what, int step) {
+	if (!ok) {
+		printf("FAIL: %s (step %d)\n", what, step);
+		m_failures++;
+	}
+}
+
+// Only the two pages are written by the code under test
+static void snapshot(void) {
+	memcpy(m_image, (const void*)(uintptr_t)PAGE0_BASE_ADDRESS, sizeof(m_image));
+}
+
+static void restore(void) {
+	flash_emu_write_raw(PAGE0_BASE_ADDRESS, m_image, sizeof(m_image));
+}
+
+static uint16_t ee_value(int var, int round) {
+	return (uint16_t)(var * 31 + round * 7 + 1);
+}
+
+// Value of another variable in this or the next round
+static bool ee_value_of_other(int var, uint16_t value, int round) {
+	for (int i = 0;i < EE_VARS;i++) {
+		if (i != var && (value == ee_value(i, round) || value == ee_value(i, round + 1))) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void fill_record(uint8_t *rec, int round) {
+	for (int i = 0;i < REC_SIZE;i++) {
+		rec[i] = (uint8_t)(i * 13 + round);
+	}
+}
+
+static void test_ee_basic(void) {
+	printf("EEPROM write, read and page transfer\n");
+	flash_emu_erase_all();
+	flash_emu_power_loss_after(-1);
+	check(EE_Init() == FLASH_COMPLETE, "EE_Init on erased flash", 0);
+
+	// 4095 entries fit in a page, so this transfers the page a few times
+	const int rounds = 300;
+	for (int r = 0;r < rounds;r++) {
+		for (int i = 0;i < EE_VARS;i++) {
+			if (EE_WriteVariable(EE_BASE + i, ee_value(i, r)) != FLASH_COMPLETE) {
+				check(false, "EE_WriteVariable", r);
+				return;
+			}
+		}
+	}
+
+	check(EE_Init() == FLASH_COMPLETE, "EE_Init after writes", 0);
+	for (int i = 0;i < EE_VARS;i++) {
+		uint16_t v = 0;
+		check(EE_ReadVariable(EE_BASE + i, &v) == 0 && v == ee_value(i, rounds - 1),
+				"EE_ReadVariable after reboot", i);
+	}
+}
+
+static void test_ee_power_loss(void) {
+	flash_emu_erase_all();
+	flash_emu_power_loss_after(-1);
+	EE_Init();
+
+	// Fill the page so that the next round needs a page transfer
+	int round = 0;
+	for (;;) {
+		uint32_t page = *(const uint16_t*)(uintptr_t)PAGE0_BASE_ADDRESS == VALID_PAGE ?
+				PAGE0_BASE_ADDRESS : PAGE1_BASE_ADDRESS;
+		uint32_t free = PAGE_SIZE;
+		for (uint32_t a = PAGE_SIZE - 4;a >= 4;a -= 4) {
+			if (*(const uint32_t*)(uintptr_t)(page + a) != 0xFFFFFFFF) {
+				break;
+			}
+			free = a;
+		}
+		if ((PAGE_SIZE - free) / 4 < EE_VARS) {
+			break;
+		}
+
+		for (int i = 0;i < EE_VARS;i++) {
+			EE_WriteVariable(EE_BASE + i, ee_value(i, round));
+		}
+		round++;
+	}
+	round--;
+
+	snapshot();
+
+	int steps = 0;
+	int aliased = 0;
+	for (int seed = 1;seed <= SEEDS;seed++) {
+		srand(seed);
+		for (int step = 0;ee_power_loss_step(step, round, &aliased);step++) {
+			steps++;
+		}
+	}
+
+	printf("EEPROM power loss at each of %d flash operations, including a page transfer\n", steps);
+	printf("  %d torn addresses changed another variable\n", aliased);
+}
+
+/*
+ * Rewrite all variables with power loss at operation step. Returns false
+ * when the sequence finished before that.
+ */
+static bool ee_power_loss_step(int step, int round, int *aliased) {
+	volatile int written = 0;
+
+	restore();
+	EE_Init();
+	flash_emu_power_loss_after(step);
+
+	if (setjmp(flash_emu_reset) == 0) {
+		for (int i = 0;i < EE_VARS;i++) {
+			EE_WriteVariable(EE_BASE + i, ee_value(i, round + 1));
+			written++;
+		}
+		flash_emu_power_loss_after(-1);
+		return false;
+	}
+
+	flash_emu_power_loss_after(-1);
+	check(EE_Init() == FLASH_COMPLETE, "EE_Init after power loss", step);
+
+	for (int i = 0;i < EE_VARS;i++) {
+		uint16_t v = 0;
+		bool read = EE_ReadVariable(EE_BASE + i, &v) == 0;
+		bool ok;
+		if (i < written) {
+			ok = read && v == ee_value(i, round + 1);
+		} else if (i == written) {
+			ok = read && (v == ee_value(i, round + 1) || v == ee_value(i, round));
+		} else {
+			ok = read && v == ee_value(i, round);
+		}
+
+		if (!ok && read && ee_value_of_other(i, v, round)) {
+			(*aliased)++;
+		} else if (!ok) {
+			check(false, "EEPROM variable after power loss", step);
+			break;
+		}
+	}
+
+	return true;
+}
+
+static void test_store_basic(void) {
+	printf("conf_store save, load and rollback\n");
+	flash_emu_erase_all();
+	flash_emu_power_loss_after(-1);
+
+	uint8_t rec[REC_SIZE], res[REC_SIZE];
+	uint32_t size, version;
+
+	check(!conf_store_newest(&size, &version), "no record on erased flash", 0);
+
+	// Enough saves to wrap around both sectors a few times
+	const int saves = 200;
+	for (int r = 0;r < saves;r++) {
+		fill_record(rec, r);
+		check(conf_store_save(rec, REC_SIZE, 3), "conf_store_save", r);
+	}
+
+	check(conf_store_newest(&size, &version) && size == REC_SIZE && version == 3,
+			"size and version of the newest record", 0);
+	check(conf_store_load(res, sizeof(res)) == REC_SIZE && memcmp(res, rec, REC_SIZE) == 0,
+			"newest record", 0);
+
+	// A shorter buffer gets a prefix, a longer one keeps the rest
+	memset(res, 0xAA, sizeof(res));
+	check(conf_store_load(res, 100) == 100 && memcmp(res, rec, 100) == 0 && res[100] == 0xAA,
+			"loading a prefix", 0);
+
+	check(conf_store_rollback(), "rollback leaves an older record", 0);
+	fill_record(rec, saves - 2);
+	check(conf_store_load(res, sizeof(res)) == REC_SIZE && memcmp(res, rec, REC_SIZE) == 0,
+			"record before the rolled back one", 0);
+}
+
+static void test_store_power_loss(void) {
+	uint8_t rec[REC_SIZE];
+
+	flash_emu_erase_all();
+	flash_emu_power_loss_after(-1);
+
+	// Count the records per sector from the erases, then fill a sector up
+	// to one record before the next save has to erase the other one.
+	int round = 0;
+	int per_sector = 0;
+	for (int switches = 0;switches < 2;) {
+		flash_emu_stats before, after;
+		flash_emu_get_stats(&before);
+		fill_record(rec, round++);
+		conf_store_save(rec, REC_SIZE, 1);
+		flash_emu_get_stats(&after);
+
+		if (after.erases[2] + after.erases[1] != before.erases[2] + before.erases[1]) {
+			switches++;
+		} else if (switches == 1) {
+			per_sector++;
+		}
+	}
+
+	for (int i = 0;i < per_sector - 1;i++) {
+		fill_record(rec, round++);
+		conf_store_save(rec, REC_SIZE, 1);
+	}
+
+	snapshot();
+
+	// The first save fits in the sector, the second one switches sectors
+	int steps = 0;
+	for (int seed = 1;seed <= SEEDS;seed++) {
+		srand(seed);
+		for (int saves = 1;saves <= 2;saves++) {
+			for (int step = 0;store_power_loss_step(step, round, saves);step++) {
+				steps++;
+			}
+		}
+	}
+
+	printf("conf_store power loss at each of %d flash operations, including a sector erase\n", steps);
+}
+
+/*
+ * Save saves records with power loss at operation step of the last one.
+ * Returns false when the last save finished before that.
+ */
+static bool store_power_loss_step(int step, int round, int saves) {
+	uint8_t rec[REC_SIZE], res[REC_SIZE];
+	uint8_t old[REC_SIZE], new[REC_SIZE];
+	int last = round + saves - 1;
+
+	restore();
+	for (int i = 0;i < saves - 1;i++) {
+		fill_record(rec, round + i);
+		conf_store_save(rec, REC_SIZE, 1);
+	}
+
+	flash_emu_stats before;
+	flash_emu_get_stats(&before);
+	flash_emu_power_loss_after(step);
+
+	if (setjmp(flash_emu_reset) == 0) {
+		fill_record(rec, last);
+		conf_store_save(rec, REC_SIZE, 1);
+		flash_emu_power_loss_after(-1);
+
+		flash_emu_stats after;
+		flash_emu_get_stats(&after);
+		bool erased = after.erases[2] + after.erases[1] != before.erases[2] + before.erases[1];
+		check(erased == (saves == 2), "sector switch on the second save only", step);
+		return false;
+	}
+
+	flash_emu_power_loss_after(-1);
+
+	fill_record(old, last - 1);
+	fill_record(new, last);
+	bool ok = conf_store_load(res, sizeof(res)) == REC_SIZE &&
+			(memcmp(res, old, REC_SIZE) == 0 || memcmp(res, new, REC_SIZE) == 0);
+	check(ok, saves == 2 ? "record after power loss while switching sectors" :
+			"record after power loss", step);
+
+	// Saving has to work again after the reboot
+	fill_record(rec, 1000 + step);
+	check(conf_store_save(rec, REC_SIZE, 1) &&
+			conf_store_load(res, sizeof(res)) == REC_SIZE &&
+			memcmp(res, rec, REC_SIZE) == 0, "save after power loss", step);
+
+	return true;
+}
+
+static void test_store_erase_fail(void) {
+	printf("conf_store failing sector erase\n");
+
+	uint8_t rec[REC_SIZE], res[REC_SIZE];
+	uint32_t size, version;
+
+	flash_emu_erase_all();
+	flash_emu_power_loss_after(-1);
+
+	int round = 0;
+	fill_record(rec, round);
+	conf_store_save(rec, REC_SIZE, 1);
+	int sector = *(const uint32_t*)(uintptr_t)PAGE1_BASE_ADDRESS != 0xFFFFFFFF ? 1 : 0;
+
+	// Fill that sector, then the save that needs the other one fails
+	for (;;) {
+		uint32_t used = 0;
+		uint32_t base = sector ? PAGE1_BASE_ADDRESS : PAGE0_BASE_ADDRESS;
+		for (uint32_t a = 0;a < PAGE_SIZE;a += 4) {
+			if (*(const uint32_t*)(uintptr_t)(base + a) != 0xFFFFFFFF) {
+				used = a + 4;
+			}
+		}
+		if (used + REC_SIZE + 16 > PAGE_SIZE) {
+			break;
+		}
+		fill_record(rec, ++round);
+		conf_store_save(rec, REC_SIZE, 1);
+	}
+
+	// Make the other sector need an erase
+	uint32_t other = sector ? PAGE0_BASE_ADDRESS : PAGE1_BASE_ADDRESS;
+	FLASH_ProgramWord(other + PAGE_SIZE - 4, 0);
+
+	flash_emu_fail_erase(sector ? PAGE0_ID : PAGE1_ID, 1);
+	fill_record(rec, round + 1);
+	check(!conf_store_save(rec, REC_SIZE, 1), "save with a failing erase", 0);
+
+	fill_record(rec, round);
+	check(conf_store_newest(&size, &version) &&
+			conf_store_load(res, sizeof(res)) == REC_SIZE && memcmp(res, rec, REC_SIZE) == 0,
+			"previous record after a failing erase", 0);
+
+	fill_record(rec, round + 1);
+	check(conf_store_save(rec, REC_SIZE, 1) &&
+			conf_store_load(res, sizeof(res)) == REC_SIZE && memcmp(res, rec, REC_SIZE) == 0,
+			"save after the erase works again", 0);
+}
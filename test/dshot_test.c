@@ -0,0 +1,83 @@
+/*
+	Copyright 2021 Marvin Damschen	marvin.damschen@ri.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Checks the DShot frame encoding against reference frames.
+ */
+
+#include "dshot_encode.h"
+
+#include <stdio.h>
+
+// Private variables
+static int m_failures;
+
+// Private functions
+static void check_packet(uint16_t value, bool telemetry, uint16_t expected);
+static void check_throttle(float throttle, uint16_t expected);
+
+int main(void) {
+	// Reference frames, the first one from the DShot protocol description
+	check_packet(1046, false, 0x82C6);
+	check_packet(1046, true, 0x82D7);
+	check_packet(0, false, 0x0000);
+	check_packet(48, false, 0x0606);
+	check_packet(2047, false, 0xFFEE);
+
+	// The checksum makes the XOR of all nibbles zero
+	for (uint16_t v = 0;v <= DSHOT_THROTTLE_MAX;v++) {
+		for (int t = 0;t < 2;t++) {
+			uint16_t p = dshot_encode_packet(v, t);
+			if (((p ^ (p >> 4) ^ (p >> 8) ^ (p >> 12)) & 0x0F) != 0 || (p >> 5) != v) {
+				printf("FAIL: packet 0x%04X for value %u\n", p, v);
+				m_failures++;
+			}
+		}
+	}
+
+	check_throttle(-0.5f, 0);
+	check_throttle(0.0f, 0);
+	check_throttle(0.0001f, DSHOT_THROTTLE_MIN);
+	check_throttle(0.5f, 1047);
+	check_throttle(1.0f, DSHOT_THROTTLE_MAX);
+	check_throttle(1.5f, DSHOT_THROTTLE_MAX);
+
+	if (m_failures > 0) {
+		printf("%d checks failed\n", m_failures);
+		return 1;
+	}
+
+	printf("All checks passed\n");
+	return 0;
+}
+
+static void check_packet(uint16_t value, bool telemetry, uint16_t expected) {
+	uint16_t p = dshot_encode_packet(value, telemetry);
+	if (p != expected) {
+		printf("FAIL: value %u telemetry %d: 0x%04X, expected 0x%04X\n",
+				value, telemetry, p, expected);
+		m_failures++;
+	}
+}
+
+static void check_throttle(float throttle, uint16_t expected) {
+	uint16_t v = dshot_encode_throttle(throttle);
+	if (v != expected) {
+		printf("FAIL: throttle %.4f: %u, expected %u\n", (double)throttle, v, expected);
+		m_failures++;
+	}
+}
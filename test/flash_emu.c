@@ -0,0 +1,256 @@
+/*
+	Copyright 2021 Marvin Damschen	marvin.damschen@ri.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+#include "flash_emu.h"
+#include "stm32f4xx_flash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/*
+ * STM32F405 flash on the host. A file is mapped read-only at the address
+ * of the internal flash, so the code under test reads it like on the
+ * board, and the FLASH_* functions change it through the file. Programming
+ * can only clear bits, like NOR flash.
+ *
+ * Faults:
+ * - Power loss after a number of operations. The interrupted operation is
+ *   left half done: a program clears a random part of its bits and an
+ *   erase only reaches part of the sector. Then flash_emu_reset is
+ *   longjmp'ed to, which is where the test "reboots".
+ * - Failing erases of a sector, which leave the sector as it was.
+ */
+
+// Settings
+#define PROGRAM_US					16.0 // Typical word program time, x32 parallelism
+#define ERASE_16K_US				250000.0 // Typical sector erase times, x32 parallelism
+#define ERASE_64K_US				550000.0
+#define ERASE_128K_US				1000000.0
+
+// Global variables
+jmp_buf flash_emu_reset;
+
+// Private variables
+static const uint32_t m_sector_addr[FLASH_EMU_SECTORS + 1] = {
+		0x08000000, 0x08004000, 0x08008000, 0x0800C000,
+		0x08010000, 0x08020000, 0x08040000, 0x08060000,
+		0x08080000, 0x080A0000, 0x080C0000, 0x080E0000,
+		0x08100000
+};
+
+static int m_fd = -1;
+static uint8_t *m_flash;
+static int m_ops;
+static int m_power_loss_at;
+static uint32_t m_fail_sector;
+static int m_fail_count;
+static flash_emu_stats m_stats;
+
+// Private functions
+static void write_bytes(uint32_t addr, const void *data, uint32_t len);
+static bool power_lost(void);
+
+/**
+ * Map the flash image in path, creating an erased one if it does not
+ * exist.
+ */
+bool flash_emu_open(const char *path) {
+	m_fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (m_fd < 0) {
+		perror(path);
+		return false;
+	}
+
+	off_t size = lseek(m_fd, 0, SEEK_END);
+	if (size != FLASH_EMU_SIZE) {
+		if (ftruncate(m_fd, FLASH_EMU_SIZE) != 0) {
+			perror(path);
+			return false;
+		}
+		flash_emu_erase_all();
+	}
+
+	m_flash = mmap((void*)(uintptr_t)FLASH_EMU_BASE, FLASH_EMU_SIZE, PROT_READ,
+			MAP_SHARED | MAP_FIXED_NOREPLACE, m_fd, 0);
+	if (m_flash == MAP_FAILED || m_flash != (uint8_t*)(uintptr_t)FLASH_EMU_BASE) {
+		perror("mmap at the flash address");
+		return false;
+	}
+
+	m_power_loss_at = -1;
+	m_fail_count = 0;
+	flash_emu_reset_stats();
+	return true;
+}
+
+void flash_emu_close(void) {
+	munmap(m_flash, FLASH_EMU_SIZE);
+	close(m_fd);
+	m_fd = -1;
+}
+
+/**
+ * Erase the whole flash without counting it.
+ */
+void flash_emu_erase_all(void) {
+	static uint8_t ff[16384];
+	memset(ff, 0xFF, sizeof(ff));
+	for (uint32_t i = 0;i < FLASH_EMU_SIZE;i += sizeof(ff)) {
+		write_bytes(FLASH_EMU_BASE + i, ff, sizeof(ff));
+	}
+}
+
+/**
+ * Overwrite flash without counting it, to restore a saved image.
+ */
+void flash_emu_write_raw(uint32_t addr, const void *data, uint32_t len) {
+	write_bytes(addr, data, len);
+}
+
+/**
+ * Lose power during operation number ops from now, counting from 0. A
+ * negative number disables it.
+ */
+void flash_emu_power_loss_after(int ops) {
+	m_ops = 0;
+	m_power_loss_at = ops;
+}
+
+/**
+ * Let the next count erases of a sector fail, sector as in FLASH_Sector_x.
+ */
+void flash_emu_fail_erase(uint32_t sector, int count) {
+	m_fail_sector = sector;
+	m_fail_count = count;
+}
+
+/**
+ * Number of program and erase operations since flash_emu_power_loss_after.
+ */
+int flash_emu_ops(void) {
+	return m_ops;
+}
+
+void flash_emu_get_stats(flash_emu_stats *stats) {
+	*stats = m_stats;
+}
+
+void flash_emu_reset_stats(void) {
+	memset(&m_stats, 0, sizeof(m_stats));
+}
+
+void FLASH_Unlock(void) {
+}
+
+void FLASH_Lock(void) {
+}
+
+void FLASH_ClearFlag(uint32_t FLASH_FLAG) {
+	(void)FLASH_FLAG;
+}
+
+FLASH_Status FLASH_EraseSector(uint32_t FLASH_Sector, uint8_t VoltageRange) {
+	(void)VoltageRange;
+
+	uint32_t sector = FLASH_Sector >> 3;
+	if ((FLASH_Sector & 7) != 0 || sector >= FLASH_EMU_SECTORS) {
+		return FLASH_ERROR_OPERATION;
+	}
+
+	if (m_fail_count > 0 && FLASH_Sector == m_fail_sector) {
+		m_fail_count--;
+		return FLASH_ERROR_OPERATION;
+	}
+
+	uint32_t start = m_sector_addr[sector];
+	uint32_t len = m_sector_addr[sector + 1] - start;
+	uint32_t done = len;
+	bool lost = power_lost();
+
+	if (lost) {
+		done = ((uint32_t)rand() % len) & ~3u;
+	}
+
+	uint8_t *ff = malloc(len);
+	memset(ff, 0xFF, len);
+	write_bytes(start, ff, done);
+	free(ff);
+
+	m_stats.erases[sector]++;
+	m_stats.busy_us += len == 16384 ? ERASE_16K_US : (len == 65536 ? ERASE_64K_US : ERASE_128K_US);
+
+	if (lost) {
+		longjmp(flash_emu_reset, 1);
+	}
+
+	return FLASH_COMPLETE;
+}
+
+static FLASH_Status program(uint32_t addr, uint32_t data, uint32_t len) {
+	if (addr < FLASH_EMU_BASE || addr + len > FLASH_EMU_BASE + FLASH_EMU_SIZE || (addr % len) != 0) {
+		return FLASH_ERROR_PGA;
+	}
+
+	uint32_t old = 0;
+	memcpy(&old, m_flash + (addr - FLASH_EMU_BASE), len);
+
+	// Only bits that are set can be cleared
+	uint32_t res = old & data;
+	bool lost = power_lost();
+
+	if (lost) {
+		res = old & (data | (uint32_t)rand());
+	}
+
+	write_bytes(addr, &res, len);
+
+	m_stats.programs++;
+	m_stats.program_bytes += len;
+	m_stats.busy_us += PROGRAM_US;
+
+	if (lost) {
+		longjmp(flash_emu_reset, 1);
+	}
+
+	return FLASH_COMPLETE;
+}
+
+FLASH_Status FLASH_ProgramWord(uint32_t Address, uint32_t Data) {
+	return program(Address, Data, 4);
+}
+
+FLASH_Status FLASH_ProgramHalfWord(uint32_t Address, uint16_t Data) {
+	return program(Address, Data, 2);
+}
+
+static void write_bytes(uint32_t addr, const void *data, uint32_t len) {
+	if (pwrite(m_fd, data, len, addr - FLASH_EMU_BASE) != (ssize_t)len) {
+		perror("flash write");
+		exit(2);
+	}
+}
+
+static bool power_lost(void) {
+	bool lost = m_ops == m_power_loss_at;
+	m_ops++;
+	return lost;
+}
@@ -0,0 +1,52 @@
+/*
+	Copyright 2021 Marvin Damschen	marvin.damschen@ri.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TEST_FLASH_EMU_H_
+#define TEST_FLASH_EMU_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <setjmp.h>
+
+// Settings
+#define FLASH_EMU_BASE				0x08000000u
+#define FLASH_EMU_SIZE				(1024 * 1024)
+#define FLASH_EMU_SECTORS			12
+
+// Types
+typedef struct {
+	uint32_t erases[FLASH_EMU_SECTORS];
+	uint32_t programs;
+	uint32_t program_bytes;
+	double busy_us; // Typical flash busy time from the datasheet
+} flash_emu_stats;
+
+// Variables
+extern jmp_buf flash_emu_reset;
+
+// Functions
+bool flash_emu_open(const char *path);
+void flash_emu_close(void);
+void flash_emu_erase_all(void);
+void flash_emu_write_raw(uint32_t addr, const void *data, uint32_t len);
+void flash_emu_power_loss_after(int ops);
+void flash_emu_fail_erase(uint32_t sector, int count);
+int flash_emu_ops(void);
+void flash_emu_get_stats(flash_emu_stats *stats);
+void flash_emu_reset_stats(void);
+
+#endif /* TEST_FLASH_EMU_H_ */
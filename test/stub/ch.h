@@ -0,0 +1,29 @@
+/*
+	Copyright 2021 Marvin Damschen	marvin.damschen@ri.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TEST_STUB_CH_H_
+#define TEST_STUB_CH_H_
+
+// Just enough of ChibiOS to build common code on the host
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define chSysLock()
+#define chSysUnlock()
+
+#endif /* TEST_STUB_CH_H_ */
@@ -0,0 +1,72 @@
+/*
+	Copyright 2021 Marvin Damschen	marvin.damschen@ri.se
+
+	This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TEST_STUB_STM32F4XX_FLASH_H_
+#define TEST_STUB_STM32F4XX_FLASH_H_
+
+/*
+ * The part of the standard peripheral flash driver that eeprom.c,
+ * conf_store.c and blackbox.c use. It is implemented by flash_emu.c.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define __IO						volatile
+
+typedef enum {
+	FLASH_BUSY = 1,
+	FLASH_ERROR_RD,
+	FLASH_ERROR_PGS,
+	FLASH_ERROR_PGP,
+	FLASH_ERROR_PGA,
+	FLASH_ERROR_WRP,
+	FLASH_ERROR_PROGRAM,
+	FLASH_ERROR_OPERATION,
+	FLASH_COMPLETE
+} FLASH_Status;
+
+#define VoltageRange_3				((uint8_t)0x02)
+
+#define FLASH_Sector_0				((uint16_t)0x0000)
+#define FLASH_Sector_1				((uint16_t)0x0008)
+#define FLASH_Sector_2				((uint16_t)0x0010)
+#define FLASH_Sector_3				((uint16_t)0x0018)
+#define FLASH_Sector_4				((uint16_t)0x0020)
+#define FLASH_Sector_5				((uint16_t)0x0028)
+#define FLASH_Sector_6				((uint16_t)0x0030)
+#define FLASH_Sector_7				((uint16_t)0x0038)
+#define FLASH_Sector_8				((uint16_t)0x0040)
+#define FLASH_Sector_9				((uint16_t)0x0048)
+#define FLASH_Sector_10				((uint16_t)0x0050)
+#define FLASH_Sector_11				((uint16_t)0x0058)
+
+#define FLASH_FLAG_EOP				((uint32_t)0x00000001)
+#define FLASH_FLAG_OPERR			((uint32_t)0x00000002)
+#define FLASH_FLAG_WRPERR			((uint32_t)0x00000010)
+#define FLASH_FLAG_PGAERR			((uint32_t)0x00000020)
+#define FLASH_FLAG_PGPERR			((uint32_t)0x00000040)
+#define FLASH_FLAG_PGSERR			((uint32_t)0x00000080)
+
+void FLASH_Unlock(void);
+void FLASH_Lock(void);
+void FLASH_ClearFlag(uint32_t FLASH_FLAG);
+FLASH_Status FLASH_EraseSector(uint32_t FLASH_Sector, uint8_t VoltageRange);
+FLASH_Status FLASH_ProgramWord(uint32_t Address, uint32_t Data);
+FLASH_Status FLASH_ProgramHalfWord(uint32_t Address, uint16_t Data);
+
+#endif /* TEST_STUB_STM32F4XX_FLASH_H_ */